@@ -0,0 +1,163 @@
+/*
+Convolutional Network - posture classifier
+
++ TRAIN: trains cnn_postureNet on augmented batches of the Postures dataset
+         and saves it to CNN_MODEL
++ otherwise: classifies the held out frames with the saved network and
+             reports the accuracy and the time per frame
+
+Every CNN_HOLDOUT-th frame of each pose is held out: it is never augmented
+into a training batch, so the reported accuracy is on frames the network
+has not seen.
+
+Idris Soule
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <highgui.h>
+#include <cv.h>
+
+#include "archive.h"
+#include "augment.h"
+#include "pyramid.h"
+#include "cnn.h"
+
+#define W 200
+#define H 200
+#define CNN_LEVEL 2 //pyramid level fed to the network, 50x50
+#define CNN_MODEL "postures.cnn"
+#define POSTURE_ARCHIVE "Postures.wmgp" //DatasetTool pack Postures Postures.wmgp
+
+#define CNN_BATCH_SIZE 64
+#define CNN_NUM_BATCHES 3000
+#define CNN_RATE 0.02f
+#define CNN_MOMENTUM 0.9f
+#define CNN_DECAY 1e-4f
+#define CNN_HOLDOUT 5 //every 5th frame of a pose is kept for the evaluation
+
+/* holdoutSplit: marks the held out frames, the same split in both modes */
+static void holdoutSplit(const int *poses, int n, int classCount, bool *held)
+{
+	int *seen = (int *)calloc(classCount, sizeof(int));
+	for(int i = 0; i < n; i++)
+		held[i] = seen[poses[i]]++ % CNN_HOLDOUT == CNN_HOLDOUT - 1;
+	free(seen);
+}
+
+int main()
+{
+	static const char *poseNames[] = {"1pose", "2pose", "3pose", "4pose"};
+	const int classCount = 4;
+	DatasetArchive_t archive;
+	IplImage **sources;
+	int *poses;
+
+	bool packed = archive_open(&archive, POSTURE_ARCHIVE); //falls back to the JPEGs
+	printf("Loading source frames ...\n");
+	int numSources = augment_loadPoses(packed ? &archive : NULL, "Postures", poseNames, classCount, 0,
+									   &sources, &poses);
+	if(packed)
+		archive_close(&archive);
+	if(numSources == 0){
+		fprintf(stderr, "Error: Couldn't load any posture frame!\n");
+		return -1;
+	}
+	bool *held = (bool *)malloc(sizeof(bool) * numSources);
+	holdoutSplit(poses, numSources, classCount, held);
+
+	CnnNet_t net;
+	long macs, params;
+#if TRAIN
+	Augmenter_t augmenter;
+	cnn_postureNet(&net, classCount, true, cvGetTickCount());
+	cnn_cost(&net, &macs, &params);
+	printf("Network: %ld multiply-adds, %ld parameters\n", macs, params);
+
+	IplImage **trainImages = (IplImage **)malloc(sizeof(IplImage *) * numSources);
+	int *trainPoses = (int *)malloc(sizeof(int) * numSources);
+	int numTrain = 0;
+	for(int i = 0; i < numSources; i++)
+		if(!held[i]){
+			trainImages[numTrain] = sources[i];
+			trainPoses[numTrain++] = poses[i];
+		}
+	printf("Training on %d frames, %d held out\n", numTrain, numSources - numTrain);
+
+	/* variants are warped at full size and reduced through the pyramid like the runtime frames */
+	if(!augment_initialize(&augmenter, trainImages, trainPoses, numTrain, classCount, NULL,
+						   cvSize(net.inW, net.inH), CNN_LEVEL, CNN_BATCH_SIZE, 0, cvGetTickCount()))
+		return -1;
+
+	printf("Training on %d augmented batches of %d ...\n", CNN_NUM_BATCHES, CNN_BATCH_SIZE);
+	double loss = 0;
+	int correct = 0;
+	for(int i = 0; i < CNN_NUM_BATCHES; i++){
+		AugmentBatch_t *batch = augment_next(&augmenter);
+		for(int j = 0; j < batch->data->rows; j++){
+			const float *x = batch->data->data.fl + j * batch->data->cols;
+			const float *p = cnn_forward(&net, x);
+			const int label = batch->labels->data.i[j];
+			int best = 0;
+			for(int c = 1; c < classCount; c++)
+				if(p[c] > p[best])
+					best = c;
+			correct += best == label;
+			loss += cnn_backward(&net, label);
+		}
+		cnn_step(&net, i < CNN_NUM_BATCHES / 2 ? CNN_RATE : CNN_RATE / 10, CNN_MOMENTUM, CNN_DECAY,
+				 batch->data->rows);
+		augment_release(&augmenter, batch);
+
+		if((i + 1) % 100 == 0){
+			printf("batch %d: loss %.4f, accuracy %.3f\n", i + 1, loss / (100 * CNN_BATCH_SIZE),
+				   correct / (100. * CNN_BATCH_SIZE));
+			loss = 0;
+			correct = 0;
+		}
+	}
+	augment_destroy(&augmenter);
+	free(trainImages);
+	free(trainPoses);
+	cnn_save(&net, CNN_MODEL);
+#else
+	if(!cnn_load(&net, CNN_MODEL, false))
+		return -1;
+	cnn_cost(&net, &macs, &params);
+	printf("Network: %ld multiply-adds, %ld parameters\n", macs, params);
+
+	/* frames are reduced the same way as at runtime, through the pyramid */
+	ImagePyramid_t pyr;
+	float *input = (float *)malloc(sizeof(float) * net.inW * net.inH);
+	int correct = 0, tested = 0;
+	int64 ticks = 0;
+	pyramid_initialize(&pyr);
+	for(int i = 0; i < numSources; i++){
+		if(!held[i]) //trained on
+			continue;
+		pyramid_build(&pyr, sources[i], CNN_LEVEL + 1);
+		const IplImage *level = pyr.level[CNN_LEVEL];
+		if(level->width != net.inW || level->height != net.inH){
+			fprintf(stderr, "Error: Frames are %dx%d, the network takes %dx%d at level %d!\n",
+					sources[i]->width, sources[i]->height, net.inW, net.inH, CNN_LEVEL);
+			break;
+		}
+		int64 t0 = cvGetTickCount();
+		cnn_frameInput(level, input);
+		correct += cnn_predict(&net, input) == poses[i];
+		ticks += cvGetTickCount() - t0;
+		tested++;
+	}
+	printf("%d / %d held out frames correct, %.3f ms per frame\n", correct, tested,
+		   tested ? ticks / (cvGetTickFrequency() * 1000.) / tested : 0.);
+	pyramid_destroy(&pyr);
+	free(input);
+#endif
+	cnn_destroy(&net);
+	free(held);
+	augment_freePoses(sources, poses, numSources);
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*
+   Dataset Tool
+   Bulk preprocessing of captured posture sessions
+
+   usage: DatasetTool gray <pose directory> [threads]
+          converts every frame of the directory to 8-bit grey in place (resumable)
+          DatasetTool pack <root> <archive> [raw]
+          packs <root>\1pose .. <root>\4pose into a single archive (see archive.h),
+          PackBits compressed unless raw is given
+          DatasetTool shapes <root | archive> <index>
+          builds the Hu moment posture index (see shape.h) from the archive,
+          or from <root>\1pose .. <root>\4pose if it isn't one
+
+   Idris Soule
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dataset.h"
+#include "archive.h"
+#include "shape.h"
+
+int main(int argc, char **argv)
+{
+	static const char *poseNames[] = {"1pose", "2pose", "3pose", "4pose"};
+
+	if(argc >= 3 && !strcmp(argv[1], "gray")){
+		int numThreads = argc > 3 ? atoi(argv[3]) : 0;
+		return dataset_convertGray(argv[2], numThreads, NULL) ? 0 : 1;
+	}
+	if(argc >= 4 && !strcmp(argv[1], "pack")){
+		bool compress = !(argc > 4 && !strcmp(argv[4], "raw"));
+		return archive_build(argv[3], argv[2], poseNames, 4, compress) >= 0 ? 0 : 1;
+	}
+
+	if(argc >= 4 && !strcmp(argv[1], "shapes")){
+		DatasetArchive_t archive;
+		ShapeIndex_t index;
+		bool packed = archive_open(&archive, argv[2]);
+		shape_indexInitialize(&index);
+		int n = shape_indexFromDataset(&index, packed ? &archive : NULL, argv[2], poseNames, 4);
+		bool ok = n > 0 && shape_indexSave(&index, argv[3]);
+		if(ok)
+			printf("%d shapes indexed\n", n);
+		shape_indexDestroy(&index);
+		if(packed)
+			archive_close(&archive);
+		return ok ? 0 : 1;
+	}
+
+	fprintf(stderr, "usage: %s gray <pose directory> [threads]\n"
+					"       %s pack <root> <archive> [raw]\n"
+					"       %s shapes <root | archive> <index>\n", argv[0], argv[0], argv[0]);
+	return 1;
+}
@@ -0,0 +1,314 @@
+/*
+FSM Replay - deterministic runs of the posture state machine
+
++ scripts: posture streams such as "T L T L T" are stepped through the FSM on a
+           virtual clock (fsm_setup, fsm_process, fsm_advance) into a recording
+           sink, the mouse events it emits are checked against the expected ones
+           and the processing cost per posture is reported
++ stress:  producer threads emit into the running FSM (its own thread, the real
+           clock) at STRESS_RATE events/s, then as fast as they can, and the
+           event accounting of the queue must balance
+
+Script tokens: T L R Z D Q  postures, one camera frame (REPLAY_FRAME) apart
+               +<n>ms       the clock runs n ms without a posture (timers fire)
+               |            checkpoint, shows up in the output where it was reached
+Expected output: M (move) LD LU RD RU and the checkpoints, space separated
+
+Idris Soule
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fsm.h"
+
+#define REPLAY_FRAME   50000 //us between postures, the camera loop waits 50 ms
+#define REPLAY_REPEAT  2000  //runs of each script for the cost
+#define REPLAY_MAX_OUT 512
+
+#define STRESS_PRODUCERS 4
+#define STRESS_RATE      20000 //events/s of all producers together
+#define STRESS_SECONDS   2     //paced phase, the flood lasts 1 s
+
+typedef struct {
+	const char *name;
+	const char *script;
+	const char *expected;
+}ReplayCase_t;
+
+static const ReplayCase_t cases[] = {
+	{"tracking",            "T T T",                            "M M M"},
+	{"single click",        "T L T | +1500ms",                  "M | LD LU"},
+	{"double click",        "T L T L T",                        "M LD LU LD LU"},
+	{"two single clicks",   "T L T | +1500ms | L T | +1500ms",  "M | LD LU | | LD LU"},
+	{"left held",           "T L L L T | +1500ms",              "M | LD LU"},
+	{"track after timeout", "T L +1500ms | T",                  "M | LD LU"},
+	{"right click",         "T R T",                            "M RD RU"},
+	{"left right click",    "T L R T",                          "M LD LU RD RU"},
+	{"left after left right", "T L R T L T | +1500ms",          "M LD LU RD RU | LD LU"},
+	{"drag",                "T D D L T",                        "M M LD M M LU"},
+	{"zoom",                "T Z T T",                          "M M"},
+	{"quit",                "T Q T",                            "M"},
+};
+
+static fsmTime_t virtualNow;
+
+static fsmTime_t replay_clock(void)
+{
+	return virtualNow;
+}
+
+static void replay_sleepMs(int ms)
+{
+#if defined(_WIN32)
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+/* replay_run: lets the virtual clock run to @until, firing each timer at its deadline */
+static void replay_run(fsmTime_t until)
+{
+	fsmTime_t next = fsm_advance();
+	while(next <= until){
+		virtualNow = next;
+		next = fsm_advance();
+	}
+	virtualNow = until;
+	fsm_advance();
+}
+
+/* replay_posture: script letter to posture, NOP if it isn't one */
+static stateEvent_t replay_posture(char c)
+{
+	switch(c){
+		case 'T': return TRACK;
+		case 'L': return LEFT;
+		case 'R': return RIGHT;
+		case 'Z': return ZOOM;
+		case 'D': return DRAG;
+		case 'Q': return QUIT;
+	}
+	return NOP;
+}
+
+/* replay_append: what the recording sink got since @seen, as tokens */
+static void replay_append(const OutputSink_t *rec, int *seen, char *out)
+{
+	static const char *tokens[] = {"M", "LD", "LU", "RD", "RU"};
+	int count;
+	const SinkEvent_t *log = sink_recorded(rec, &count);
+	for(; *seen < count; (*seen)++){
+		if(*out)
+			strcat(out, " ");
+		strcat(out, tokens[log[*seen].action]);
+	}
+}
+
+/*
+replay_script:
+	Steps @script through a fresh machine, on the virtual clock
+
+	@sink: output of the machine
+	@rec: @sink if it is the recording sink, its events are written to @out
+	@return: postures processed, -1 on a bad script
+*/
+static int replay_script(const char *script, OutputSink_t *sink, const OutputSink_t *rec, char *out)
+{
+	int postures = 0, seen = 0;
+	bool running = true;
+	POINT pos = {0, 0};
+
+	virtualNow = 1000000;
+	if(!fsm_setup(TRACK, sink))
+		return -1;
+	if(out)
+		out[0] = 0;
+
+	for(const char *p = script; *p && running; ){
+		if(*p == ' '){
+			p++;
+			continue;
+		}
+		if(*p == '+'){
+			char *end;
+			const long ms = strtol(p + 1, &end, 10);
+			if(strncmp(end, "ms", 2)){
+				fprintf(stderr, "Error: Couldn't parse the delay in \"%s\"!\n", script);
+				fsm_process(QUIT, pos);
+				return -1;
+			}
+			replay_run(virtualNow + ms * 1000);
+			p = end + 2;
+			continue;
+		}
+		if(*p == '|'){
+			if(rec)
+				replay_append(rec, &seen, out);
+			if(out)
+				strcat(out, *out ? " |" : "|");
+			p++;
+			continue;
+		}
+
+		const stateEvent_t posture = replay_posture(*p++);
+		if(posture == NOP){
+			fprintf(stderr, "Error: Couldn't parse the posture '%c' in \"%s\"!\n", p[-1], script);
+			fsm_process(QUIT, pos);
+			return -1;
+		}
+		replay_run(virtualNow + REPLAY_FRAME);
+		pos.x = 40 + postures; //the hand drifts a pixel a frame
+		pos.y = 63 + postures;
+		running = fsm_process(posture, pos);
+		postures++;
+	}
+	if(running)
+		fsm_process(QUIT, pos);
+	if(rec)
+		replay_append(rec, &seen, out);
+	return postures;
+}
+
+/* replay_cases: @return: number of scripts whose output differed */
+static int replay_cases(void)
+{
+	const int numCases = sizeof(cases) / sizeof(cases[0]);
+	char out[REPLAY_MAX_OUT];
+	OutputSink_t rec, null;
+	int failed = 0;
+
+	sink_null(&null);
+	fsm_setClock(replay_clock);
+	printf("%-24s %-6s %10s  output\n", "script", "result", "ns/event");
+	for(int i = 0; i < numCases; i++){
+		if(!sink_recording(&rec, 64))
+			return numCases;
+		const int postures = replay_script(cases[i].script, &rec, &rec, out);
+		const bool pass = postures >= 0 && !strcmp(out, cases[i].expected);
+		failed += !pass;
+		sink_destroy(&rec);
+
+		/* cost: the same script into a null sink, setup excluded */
+		fsmTime_t ticks = 0;
+		for(int r = 0; r < REPLAY_REPEAT && postures > 0; r++){
+			const fsmTime_t t0 = fsm_monotonic_us();
+			replay_script(cases[i].script, &null, NULL, NULL);
+			ticks += fsm_monotonic_us() - t0;
+		}
+		printf("%-24s %-6s %10.1f  %s", cases[i].name, pass ? "ok" : "FAIL",
+			   postures > 0 ? ticks * 1000. / ((double)REPLAY_REPEAT * postures) : 0., out);
+		if(!pass)
+			printf("  (expected %s)", cases[i].expected);
+		printf("\n");
+	}
+	fsm_destroy();
+	fsm_setClock(NULL);
+	return failed;
+}
+
+typedef struct {
+	unsigned seed;
+	int rate;         //events/s of this producer, 0 floods
+	fsmTime_t end;
+	long accepted, refused;
+}Producer_t;
+
+/* producer_thread: a camera, mostly TRACK with the odd discrete posture */
+static void *producer_thread(void *arg)
+{
+	Producer_t *p = (Producer_t *)arg;
+	static const stateEvent_t discrete[] = {LEFT, RIGHT, ZOOM, DRAG};
+	const fsmTime_t start = fsm_monotonic_us();
+	long sent = 0;
+	POINT pos;
+
+	for(fsmTime_t now = start; now < p->end; now = fsm_monotonic_us()){
+		const long due = p->rate ? (long)((now - start) * p->rate / 1000000) : sent + 256;
+		for(; sent < due; sent++){
+			p->seed = p->seed * 1103515245 + 12345;
+			const unsigned r = p->seed >> 16;
+			pos.x = 40 + r % 100;
+			pos.y = 63 + (r >> 7) % 100;
+			if(fsm_queue_emit(r % 16 ? TRACK : discrete[(r >> 4) % 4], pos))
+				p->accepted++;
+			else
+				p->refused++;
+		}
+		if(p->rate)
+			replay_sleepMs(1);
+	}
+	return NULL;
+}
+
+/*
+replay_stress:
+	One phase of producers against the FSM thread
+
+	@rate: events/s of all producers together, 0 floods
+	@return: false if the event accounting didn't balance
+*/
+static bool replay_stress(int rate, int seconds)
+{
+	OutputSink_t null, batch;
+	Producer_t producers[STRESS_PRODUCERS];
+	pthread_t threads[STRESS_PRODUCERS];
+	POINT origin = {0, 0};
+
+	sink_null(&null);
+	if(!sink_batching(&batch, &null, FSM_BATCH) || !fsm_initialize(TRACK, &batch))
+		return false;
+
+	const fsmTime_t start = fsm_monotonic_us();
+	for(int i = 0; i < STRESS_PRODUCERS; i++){
+		memset(&producers[i], 0, sizeof(Producer_t));
+		producers[i].seed = 7919 * (i + 1);
+		producers[i].rate = rate / STRESS_PRODUCERS;
+		producers[i].end = start + seconds * 1000000ULL;
+		if(pthread_create(&threads[i], NULL, producer_thread, &producers[i])){
+			printf("Replay::%s: Couldn't create producer-thread %d!\n", __FUNCTION__, i);
+			return false;
+		}
+	}
+	long accepted = 0, refused = 0;
+	for(int i = 0; i < STRESS_PRODUCERS; i++){
+		pthread_join(threads[i], NULL);
+		accepted += producers[i].accepted;
+		refused += producers[i].refused;
+	}
+	const double elapsed = (fsm_monotonic_us() - start) / 1e6;
+
+	while(ring_size(&fsmQueue)) //let the FSM drain the queue
+		replay_sleepMs(1);
+	while(!fsm_queue_emit(QUIT, origin))
+		replay_sleepMs(1);
+	pthread_join(fsmThread, NULL);
+	fsm_destroy(); //producers are joined
+
+	const FSMStats_t stats = fsm_stats();
+	const bool balanced = stats.dispatched + stats.coalesced + (long)stats.discarded == accepted &&
+						  (long)stats.refused == refused;
+	printf("%s %d s: %ld events accepted (%.0f/s), %ld refused\n", rate ? "paced" : "flood",
+		   seconds, accepted, accepted / elapsed, refused);
+	printf("  %ld dispatched, %ld TRACK coalesced, %ld discarded, %ld parks: %s\n", stats.dispatched,
+		   stats.coalesced, (long)stats.discarded, stats.parks, balanced ? "balanced" : "MISMATCH");
+	printf("  dispatch latency avg %.1f us max %llu us, action avg %.2f us max %llu us\n",
+		   stats.dispatched ? (double)stats.latencySum / stats.dispatched : 0., stats.latencyMax,
+		   stats.dispatched ? (double)stats.handlerSum / stats.dispatched : 0., stats.handlerMax);
+	printf("  sink: %ld events in %ld injections\n", null.events, null.injections);
+	sink_destroy(&batch);
+	return balanced;
+}
+
+int main()
+{
+	const int failed = replay_cases();
+	printf("%d script(s) failed\n\n", failed);
+
+	bool balanced = replay_stress(STRESS_RATE, STRESS_SECONDS);
+	balanced = replay_stress(0, 1) && balanced;
+	return failed || !balanced ? -1 : 0;
+}
@@ -18,6 +18,11 @@
 #include <cv.h>		//haartraining
 
 #include "ocv.h"
+#include "haar.h"
+#include "capture.h"
+#include "pyramid.h"
+#include "chamfer.h"
+#include "augment.h"
 #include "NPTrackingTools.h"
 
 #define W 200//380
@@ -25,56 +30,214 @@
 #define KEY_ESC 27
 #define KEY_NOTPRESSED 0
 #define MAX_NUM_CAMERAS 3
+#define HAND_CAMERA 0 //the only camera showCameraWindow processes
 
 #pragma warning(disable:4716) //disable missing return from function error 
 
 int key = KEY_NOTPRESSED;
 pthread_mutex_t keyMutex;
 
+#define MAX_HANDS 16
+#define HAAR_TRACKING 1         //scan around the previous hand only
+#define HAAR_RESCAN_INTERVAL 15 //full frame scan every n frames while tracking
+#define HAAR_LEVEL 1            //pyramid level scanned, 1 = quarter resolution
+
+/* hand detection state of one camera, detectPosture only touches the one it is given */
+typedef struct {
+	HaarDetector_t detector;
+	HaarTracker_t tracker;
+	ImagePyramid_t pyramid;
+	IplImage *image; //frame with the bounding boxes, reused between frames
+}HandDetection_t;
+
 typedef struct {
 	unsigned int i;
 	IplImage *displayImage;
+	HandDetection_t *hand; //NULL for a camera that doesn't detect hands
 }CameraData_t;
 
-CvHaarClassifierCascade *cascade;
+#define CAPTURE_ONLY 0      //1 records at the camera rate, skipping the 250 ms firmware delay between snaps
+#define CAPTURE_LIMIT 500   //frames per training session
+#define CAPTURE_QUEUE 64    //frames buffered before frames are dropped
+#define CAPTURE_WRITERS 2
+#define CAPTURE_BATCH 8
+
+CaptureWriter_t captureWriter;
+
+#define CHAMFER_EXEMPLARS 32 //templates per pose
+#define CHAMFER_REJECT 3.0f  //mean edge distance of an accepted match (pixels)
+
+/* initHandDetection: cascade copies (one per worker), minimum hand size at the scanned level
+   @return: false if the cascade couldn't be loaded, there is nothing to destroy then */
+bool initHandDetection(HandDetection_t *hd)
+{
+	pyramid_initialize(&hd->pyramid);
+	haar_trackerInit(&hd->tracker, HAAR_RESCAN_INTERVAL);
+	hd->image = NULL;
+	return haar_initialize(&hd->detector, "HandClassifier_1Pose.xml", 0, 1.1, 2,
+						   cvSize(90 >> HAAR_LEVEL, 90 >> HAAR_LEVEL));
+}
+
+void destroyHandDetection(HandDetection_t *hd)
+{
+	haar_destroy(&hd->detector);
+	pyramid_destroy(&hd->pyramid);
+	cvReleaseImage(&hd->image);
+}
 
-/* Draw a bounding box (rectangle) around the location of the hand */
-void detectPosture(IplImage *img)
+/* Draw a bounding box (rectangle) around the location of the hand
+   @hd: detection state of the camera img comes from */
+void detectPosture(HandDetection_t *hd, IplImage *img)
 {
+ CvRect hands[MAX_HANDS];
+ int i, n, scale = 1;
+ IplImage *scanned = img;
+ int level = 0;
+
+ /* scan a reduced level of the frame, the hands are mapped back afterwards */
+ if(img->nChannels == 1){
+	pyramid_build(&hd->pyramid, img, HAAR_LEVEL + 1);
+	scanned = hd->pyramid.level[level = HAAR_LEVEL];
+ }
+
+#if HAAR_TRACKING
+ n = haar_track(&hd->detector, &hd->tracker, scanned, hands, MAX_HANDS);
+#else
+ n = haar_detect(&hd->detector, scanned, hands, MAX_HANDS);
+#endif
+ for(i = 0; i < n; i++)
+	hands[i] = pyramid_toLevel0(hands[i], level);
+
+ if(!hd->image || hd->image->width != img->width || hd->image->height != img->height){
+	cvReleaseImage(&hd->image);
+	hd->image = cvCreateImage(cvSize(img->width,img->height),8,3);
+ }
+ if(img->nChannels == 1)
+	cvCvtColor(img, hd->image, CV_GRAY2BGR);
+ else
+	cvCopy(img, hd->image);
 
- CvMemStorage* storage = cvCreateMemStorage(0);
- CvSeq* hand;
- int i, scale = 1;
- hand = cvHaarDetectObjects( img, cascade, storage, 1.1, 2, 0/*CV_HAAR_DO_CANNY_PRUNING*/, cvSize(90,90));
- 
- IplImage *image = cvCreateImage(cvSize(img->width,img->height),8,3);
- 
     /* draw all the rectangles */
-    for( i = 0; i < hand->total; i++ )
+    for( i = 0; i < n; i++ )
     {
         /* extract the rectanlges only */
-        CvRect face_rect = *(CvRect*)cvGetSeqElem(hand, i );
-        cvRectangle( image, cvPoint(face_rect.x*scale,face_rect.y*scale),
+        CvRect face_rect = hands[i];
+        cvRectangle( hd->image, cvPoint(face_rect.x*scale,face_rect.y*scale),
                      cvPoint((face_rect.x+face_rect.width)*scale,
                              (face_rect.y+face_rect.height)*scale),
                      CV_RGB(25,255,112), 3 );
-		cvNamedWindow("Bounding BOX DISPLAY",CV_WINDOW_AUTOSIZE);
-		cvShowImage("Bounding BOX DISPLAY", image);
     }
-	cvClearMemStorage(storage);
-	cvReleaseImage(&image);
+	cvNamedWindow("Bounding BOX DISPLAY",CV_WINDOW_AUTOSIZE);
+	cvShowImage("Bounding BOX DISPLAY", hd->image);
 }
 
+#if HAAR_VERIFY
+/* verifyHaarDetector:
+	Runs cvHaarDetectObjects and the flattened SIMD detector on the posture images
+	and reports differing detections and the time taken by each
+*/
+void verifyHaarDetector(HaarDetector_t *det, const char *poseName, int n)
+{
+	CvHaarClassifierCascade *cascade = (CvHaarClassifierCascade *)cvLoad("HandClassifier_1Pose.xml",0,0,0);
+	CvMemStorage *storage = cvCreateMemStorage(0);
+	CvRect hands[MAX_HANDS];
+	char fn[110];
+	int mismatches = 0;
+	int64 cvTicks = 0, flatTicks = 0;
+
+	if(!det->useFlat)
+		printf("Cascade can't be flattened, comparing against the OpenCV path\n");
+
+	for(int i = 1; i <= n; i++){
+		sprintf(fn, "Postures\\%s\\%s-%d.jpg", poseName, poseName, i);
+		IplImage *img = cvLoadImage(fn, 0);
+		if(!img)
+			break;
+
+		int64 t0 = cvGetTickCount();
+		CvSeq *hand = cvHaarDetectObjects(img, cascade, storage, 1.1, 2, 0, cvSize(90,90));
+		int64 t1 = cvGetTickCount();
+		int found = haar_detect(det, img, hands, MAX_HANDS);
+		int64 t2 = cvGetTickCount();
+		cvTicks += t1 - t0;
+		flatTicks += t2 - t1;
+
+		/* same windows, same decisions, same grouping: the rects must be identical */
+		bool same = found == hand->total;
+		for(int j = 0; same && j < found; j++){
+			bool matched = false;
+			for(int k = 0; k < hand->total && !matched; k++){
+				CvRect r = *(CvRect*)cvGetSeqElem(hand, k);
+				matched = r.x == hands[j].x && r.y == hands[j].y &&
+						  r.width == hands[j].width && r.height == hands[j].height;
+			}
+			same = matched;
+		}
+		if(!same){
+			printf("%s: OpenCV %d, flat %d detections\n", fn, hand->total, found);
+			mismatches++;
+		}
+		cvClearMemStorage(storage);
+		cvReleaseImage(&img);
+	}
+	printf("%d mismatches, OpenCV %.2f ms, flat %.2f ms in total\n", mismatches,
+		   cvTicks / (cvGetTickFrequency() * 1000.), flatTicks / (cvGetTickFrequency() * 1000.));
+	cvReleaseMemStorage(&storage);
+	cvReleaseHaarClassifierCascade(&cascade);
+}
+#endif
+
+#if CHAMFER_VERIFY
+/* verifyChamferMatcher:
+	Cuts templates from evenly spread frames of each pose and classifies the
+	remaining frames with them, reports the accuracy and the time per frame
+*/
+void verifyChamferMatcher(const char *root)
+{
+	static const char *poseNames[] = {"1pose", "2pose", "3pose", "4pose"};
+	DatasetArchive_t archive;
+	ChamferMatcher_t matcher;
+	IplImage **images;
+	int *labels;
+	bool packed = archive_open(&archive, "Postures.wmgp");
+
+	int n = augment_loadPoses(packed ? &archive : NULL, root, poseNames, 4, 0, &images, &labels);
+	if(!chamfer_initialize(&matcher, 0, 50, 150, CHAMFER_REJECT))
+		printf("Chamfer matcher: ERROR\n");
+	int templates = chamfer_addPoses(&matcher, images, labels, n, 4, CHAMFER_EXEMPLARS);
+	printf("%d templates from %d frames\n", templates, n);
+
+	/* exemplar frames are scored too, they should match themselves */
+	int correct = 0, rejected = 0;
+	int64 ticks = 0;
+	for(int i = 0; i < n; i++){
+		int64 t0 = cvGetTickCount();
+		int label = chamfer_match(&matcher, images[i], NULL);
+		ticks += cvGetTickCount() - t0;
+		correct += label == labels[i];
+		rejected += label < 0;
+	}
+	printf("%d / %d correct, %d rejected, %.2f ms per frame\n", correct, n, rejected,
+		   n ? ticks / (cvGetTickFrequency() * 1000.) / n : 0.);
+
+	chamfer_destroy(&matcher);
+	augment_freePoses(images, labels, n);
+	if(packed)
+		archive_close(&archive);
+}
+#endif
+
+/* snapPicture: queues the frame for the capture writers, returns without touching the disk
+   frames dropped by a full queue do not use up a file number */
 void snapPicture(const char *threadName, IplImage *img, int *count)
 {
 	static int pcount = 1;
 	//imagename: <threadName>999.jpg
-	char *resultName = (char *)malloc(sizeof(char) * 110);//(strlen(threadName) + 8) + 1);
+	char resultName[CAPTURE_NAME_LEN];
 
 	sprintf(resultName, "Postures\\%s\\%s-%d.jpg",threadName,threadName,pcount);
-	pcount++;
-	cvSaveImage(resultName, img);
-	free(resultName);
+	if(capture_submit(&captureWriter, img, resultName))
+		pcount++;
 	*count = pcount;
 }
 
@@ -83,23 +246,33 @@ void *showCameraWindow(void *arg)
 {
 	CameraData_t *myCam = (CameraData_t *)arg; 
 	const char *windowName = TT_CameraName(myCam->i);
+	long frames = 0;
 
 	cvNamedWindow(windowName,CV_WINDOW_AUTOSIZE);
 
 #if 1
-	if(myCam->i != 0)
+	if(myCam->i != HAND_CAMERA)
 		pthread_exit(NULL);
 #endif
 	for( ;key != KEY_ESC; ){
 		TT_CameraFrameBuffer(myCam->i, W, H, 0, 8, (unsigned char *)myCam->displayImage->imageData);
 		cvShowImage(windowName, myCam->displayImage);
+		//detectPosture(myCam->hand, myCam->displayImage);
+		int count = 0;
+		snapPicture("4pose",myCam->displayImage, &count); //copy only, encoding is done by the writers
+
 		pthread_mutex_lock(&keyMutex);
+#if CAPTURE_ONLY
+		key = cvWaitKey(1); //pump window events only
+		if(++frames % 100 == 0){
+			CaptureStats_t stats = capture_stats(&captureWriter);
+			printf("captured %ld, dropped %ld, queue %d (max %d)\n",
+				   stats.written, stats.dropped, stats.depth, stats.maxDepth);
+		}
+#else
 		key = cvWaitKey(250); //delay atleast n ms for TT firmware propogation delay
-
-		//detectPosture(myCam->displayImage);
-		int count = 0;
-		snapPicture("4pose",myCam->displayImage, &count);
-		if(count > 500) {printf("\a\a\a"); key = KEY_ESC;}
+#endif
+		if(count > CAPTURE_LIMIT) {printf("\a\a\a"); key = KEY_ESC;}
 		pthread_mutex_unlock(&keyMutex);
 	}
 	cvReleaseImage(&myCam->displayImage);
@@ -117,14 +290,21 @@ int main()
 	tsuite.generatePositiveSampleData("4pose", 2093);*/
 	
 	tsuite.generateNegativeSampleData();
+#elif HAAR_VERIFY
+	HaarDetector_t detector;
+	if(!haar_initialize(&detector, "HandClassifier_1Pose.xml", 0, 1.1, 2, cvSize(90,90)))
+		return -1;
+	verifyHaarDetector(&detector, "1pose", 500);
+	haar_destroy(&detector);
+#elif CHAMFER_VERIFY
+	verifyChamferMatcher("Postures");
 #else 
 	TT_Initialize(); //setup TT cameras
 	printf("Opening Calibration: %s\n", 
 		TT_LoadCalibration("CalibrationResult 2010-12-30 4.39pm.cal") == NPRESULT_SUCCESS ?
 		"PASS" : "ERROR");
 	
-		//open Cascade
-	cascade = (CvHaarClassifierCascade *)cvLoad("HandClassifier_1Pose.xml",0,0,0);
+	capture_initialize(&captureWriter, CAPTURE_QUEUE, CAPTURE_WRITERS, CAPTURE_BATCH);
 
 	int cameraCount = TT_CameraCount();
 	CameraData_t cameras[MAX_NUM_CAMERAS];
@@ -141,7 +321,14 @@ int main()
 	for(int i = 0; i < cameraCount; i++){
 		cameras[i].i = i;
 		cameras[i].displayImage = cvCreateImage(cvSize(W,H), IPL_DEPTH_8U, 1);
+		cameras[i].hand = NULL;
 	}
+	/* open Cascade for the camera that is processed, the others would only hold idle workers */
+	HandDetection_t handDetection;
+	if(initHandDetection(&handDetection))
+		cameras[HAND_CAMERA].hand = &handDetection;
+	else
+		printf("Haar detector: ERROR\n");
 
 	/* call the threads for display of camera data */
 	
@@ -168,6 +355,14 @@ int main()
 		pthread_join(threads[i], NULL);
 	
 	pthread_mutex_destroy(&keyMutex);
+	capture_destroy(&captureWriter); //writes out the queued frames
+	{
+		CaptureStats_t stats = captureWriter.stats;
+		printf("Capture: %ld written, %ld dropped, %ld failed, max queue %d\n",
+			   stats.written, stats.dropped, stats.failed, stats.maxDepth);
+	}
+	if(cameras[HAND_CAMERA].hand)
+		destroyHandDetection(cameras[HAND_CAMERA].hand);
 	cvDestroyAllWindows();
 	TT_Shutdown();
 	TT_FinalCleanup();
@@ -0,0 +1,353 @@
+/*
+   Model Code Generator
+   Freezes a trained posture classifier (random forest or MLP) into a C++ header.
+   The header holds the model as constant tables and straight-line, template
+   specialized evaluation code so no model file is loaded at runtime and the
+   compiler is free to inline and vectorize the whole classifier.
+
+   usage: ModelCodegen forest forest.xml PostureForest.h
+          ModelCodegen mlp    t1.xml     PostureMLP.h
+
+   The generated headers are consumed by "Random Trees.cpp" and mlp.cpp when
+   built with COMPILED_MODEL, building with VERIFY cross-checks them against predict()
+
+   Every weight of an MLP becomes a literal of the header, so the generator is
+   meant for small networks (see MAX_MLP_WEIGHTS). The 40000 input network
+   trained on raw frames is left to CvANN_MLP.
+
+   Idris Soule
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include <cv.h>
+#include <ml.h> //Random Forests, ANN (Machine Learning)
+
+#define MAX_CLASSES 32
+#define MAX_MLP_WEIGHTS 100000 //~1.7MB of header, the compiler copes with that
+
+/* the MLP used for postures is created with the default symmetric sigmoid,
+   CvANN_MLP::set_activ_func replaces the zero parameters with these */
+#define MLP_SIGMOID_ALPHA (2./3)
+#define MLP_SIGMOID_BETA  1.7159
+
+static float classLabels[MAX_CLASSES];
+static int numClasses;
+
+/* classIndex:
+	Maps a leaf response onto its (sorted) position in the class label table
+*/
+static int classIndex(double value)
+{
+	for(int i = 0; i < numClasses; i++)
+		if(classLabels[i] == (float)value)
+			return i;
+	assert(!"leaf value is not a known class label");
+	return -1;
+}
+
+static int sortLabels(const void *a, const void *b)
+{
+	float d = *(const float *)a - *(const float *)b;
+	return d < 0 ? -1 : d > 0;
+}
+
+/* collectLabels:
+	Walks a tree and records every distinct leaf response
+	@return: false if there are more classes than MAX_CLASSES
+*/
+static bool collectLabels(const CvDTreeNode *node)
+{
+	if(!node->left){
+		for(int i = 0; i < numClasses; i++)
+			if(classLabels[i] == (float)node->value)
+				return true;
+		if(numClasses == MAX_CLASSES)
+			return false;
+		classLabels[numClasses++] = (float)node->value;
+		return true;
+	}
+	return collectLabels(node->left) && collectLabels(node->right);
+}
+
+static void indent(FILE *out, int depth)
+{
+	for(int i = 0; i < depth; i++)
+		fputc('\t', out);
+}
+
+/* emitNode:
+	Emits a (sub)tree as nested if/else, mirrors CvDTree::predict for ordered splits
+	i.e go left when x <= c, the other way round when the split is inversed
+
+	@return: false if the tree holds a split the generator does not support
+*/
+static bool emitNode(FILE *out, const CvDTreeNode *node, bool classifier, int depth)
+{
+	if(!node->left){
+		indent(out, depth);
+		if(classifier)
+			fprintf(out, "return %d;\n", classIndex(node->value));
+		else
+			fprintf(out, "return %.9ef;\n", node->value);
+		return true;
+	}
+
+	const CvDTreeSplit *split = node->split;
+	if(!split || split->var_idx < 0) //surrogates only matter for missing data
+		return false;
+
+	const CvDTreeNode *lhs = split->inversed ? node->right : node->left;
+	const CvDTreeNode *rhs = split->inversed ? node->left : node->right;
+
+	indent(out, depth);
+	fprintf(out, "if(x[%d] <= %.9ef) {\n", split->var_idx, split->ord.c);
+	if(!emitNode(out, lhs, classifier, depth + 1))
+		return false;
+	indent(out, depth);
+	fprintf(out, "} else {\n");
+	if(!emitNode(out, rhs, classifier, depth + 1))
+		return false;
+	indent(out, depth);
+	fprintf(out, "}\n");
+	return true;
+}
+
+/* generateForest:
+	Emits PostureForestTree<i>::eval for each tree plus the vote/average
+	recursion that CvRTrees::predict performs, trees are evaluated in order
+	because the vote depends on it
+*/
+static bool generateForest(const char *modelName, const char *headerName)
+{
+	CvRTrees forest;
+	forest.load(modelName);
+
+	const int ntrees = forest.get_tree_count();
+	if(ntrees <= 0){
+		fprintf(stderr, "Error: %s holds no trees!\n", modelName);
+		return false;
+	}
+
+	CvDTreeTrainData *data = forest.get_tree(0)->get_data();
+	const bool classifier = data->is_classifier;
+	const int nvars = data->var_all;
+
+	for(int c = 0; c < data->var_count; c++)
+		if(data->get_var_type(c) >= 0){
+			fprintf(stderr, "Error: categorical variables are not supported!\n");
+			return false;
+		}
+
+	numClasses = 0;
+	if(classifier){
+		for(int t = 0; t < ntrees; t++)
+			if(!collectLabels(forest.get_tree(t)->get_root())){
+				fprintf(stderr, "Error: more than %d classes!\n", MAX_CLASSES);
+				return false;
+			}
+		qsort(classLabels, numClasses, sizeof(float), &sortLabels);
+	}
+
+	FILE *out = fopen(headerName, "w");
+	if(!out){
+		perror(headerName);
+		return false;
+	}
+
+	fprintf(out, "/* %s\n   Generated by ModelCodegen from %s -- do not edit\n"
+				 "   %d trees over %d variables (%s)\n*/\n\n",
+				 headerName, modelName, ntrees, nvars, classifier ? "classification" : "regression");
+	fprintf(out, "#ifndef POSTURE_FOREST_H\n#define POSTURE_FOREST_H\n\n");
+	fprintf(out, "#define POSTURE_FOREST_TREES %d\n#define POSTURE_FOREST_VARS %d\n", ntrees, nvars);
+	fprintf(out, "#define POSTURE_FOREST_CLASSES %d\n\n", numClasses);
+
+	if(classifier){
+		fprintf(out, "static const float postureForestLabels[POSTURE_FOREST_CLASSES] = {");
+		for(int i = 0; i < numClasses; i++)
+			fprintf(out, "%s%.9ef", i ? ", " : "", classLabels[i]);
+		fprintf(out, "};\n\n");
+	}
+
+	fprintf(out, "template<int T> struct PostureForestTree;\n\n");
+	for(int t = 0; t < ntrees; t++){
+		fprintf(out, "template<> struct PostureForestTree<%d> {\n", t);
+		fprintf(out, "\tstatic inline %s eval(const float *x)\n\t{\n", classifier ? "int" : "float");
+		if(!emitNode(out, forest.get_tree(t)->get_root(), classifier, 2)){
+			fprintf(stderr, "Error: tree %d has an unsupported split!\n", t);
+			fclose(out);
+			remove(headerName);
+			return false;
+		}
+		fprintf(out, "\t}\n};\n\n");
+	}
+
+	if(classifier){
+		fprintf(out,
+			"template<int N> struct PostureForestVote {\n"
+			"\tstatic inline void eval(const float *x, int *votes, int &best, int &most)\n\t{\n"
+			"\t\tPostureForestVote<N - 1>::eval(x, votes, best, most);\n"
+			"\t\tconst int c = PostureForestTree<N - 1>::eval(x);\n"
+			"\t\tif(++votes[c] > most)\n\t\t\tmost = votes[c], best = c;\n\t}\n};\n\n"
+			"template<> struct PostureForestVote<0> {\n"
+			"\tstatic inline void eval(const float *, int *, int &, int &) {}\n};\n\n"
+			"/* majority vote counted in tree order as in CvRTrees::predict,\n"
+			"   a tie goes to the class that reached the top count first */\n"
+			"static inline float postureForest_predict(const float *x)\n{\n"
+			"\tint votes[POSTURE_FOREST_CLASSES] = {0};\n"
+			"\tint best = 0, most = 0;\n"
+			"\tPostureForestVote<POSTURE_FOREST_TREES>::eval(x, votes, best, most);\n"
+			"\treturn postureForestLabels[best];\n}\n\n");
+	}
+	else {
+		fprintf(out,
+			"template<int N> struct PostureForestSum {\n"
+			"\tstatic inline float eval(const float *x)\n\t{\n"
+			"\t\treturn PostureForestTree<N - 1>::eval(x) + PostureForestSum<N - 1>::eval(x);\n\t}\n};\n\n"
+			"template<> struct PostureForestSum<0> {\n"
+			"\tstatic inline float eval(const float *) { return 0.0f; }\n};\n\n"
+			"/* mean response of all trees as in CvRTrees::predict */\n"
+			"static inline float postureForest_predict(const float *x)\n{\n"
+			"\treturn PostureForestSum<POSTURE_FOREST_TREES>::eval(x) / POSTURE_FOREST_TREES;\n}\n\n");
+	}
+	fprintf(out, "#endif\n");
+	fclose(out);
+
+	printf("%s: %d trees, %d variables => %s\n", modelName, ntrees, nvars, headerName);
+	return true;
+}
+
+static void emitTable(FILE *out, const char *name, const double *v, int n, int stride)
+{
+	fprintf(out, "static const float %s[%d] = {", name, n);
+	for(int i = 0; i < n; i++)
+		fprintf(out, "%s%s%.9ef", i ? "," : "", i % 8 ? " " : "\n\t", v[i * stride]);
+	fprintf(out, "\n};\n\n");
+}
+
+/* generateMLP:
+	Emits the weights transposed to [out][in] so each neuron is a contiguous dot product,
+	input/output scaling is folded in as in CvANN_MLP::predict
+	@return: false for networks above MAX_MLP_WEIGHTS, those stay with CvANN_MLP
+*/
+static bool generateMLP(const char *modelName, const char *headerName)
+{
+	CvANN_MLP mlp;
+	mlp.load(modelName);
+
+	const CvMat *layers = mlp.get_layer_sizes();
+	const int nlayers = mlp.get_layer_count();
+	if(!layers || nlayers < 2){
+		fprintf(stderr, "Error: %s holds no network!\n", modelName);
+		return false;
+	}
+
+	double weights = 0; //the 40000 input network would be ~20M
+	for(int l = 1; l < nlayers; l++)
+		weights += (layers->data.i[l - 1] + 1.0) * layers->data.i[l];
+	if(weights > MAX_MLP_WEIGHTS){
+		fprintf(stderr, "Error: %s has %.0f weights, only small networks (up to %d) are compiled!\n",
+				modelName, weights, MAX_MLP_WEIGHTS);
+		return false;
+	}
+
+	FILE *out = fopen(headerName, "w");
+	if(!out){
+		perror(headerName);
+		return false;
+	}
+
+	fprintf(out, "/* %s\n   Generated by ModelCodegen from %s -- do not edit\n   layers:",
+			headerName, modelName);
+	for(int l = 0; l < nlayers; l++)
+		fprintf(out, " %d", layers->data.i[l]);
+	fprintf(out, "\n*/\n\n#ifndef POSTURE_MLP_H\n#define POSTURE_MLP_H\n\n#include <math.h>\n\n");
+	fprintf(out, "#define POSTURE_MLP_INPUTS %d\n#define POSTURE_MLP_OUTPUTS %d\n\n",
+			layers->data.i[0], layers->data.i[nlayers - 1]);
+
+	char name[64];
+	const int nin = layers->data.i[0], nout = layers->data.i[nlayers - 1];
+	const double *inScale = mlp.get_weights(0), *outScale = mlp.get_weights(nlayers);
+
+	emitTable(out, "postureMLP_InScale", inScale, nin, 2);
+	emitTable(out, "postureMLP_InShift", inScale + 1, nin, 2);
+	emitTable(out, "postureMLP_OutScale", outScale, nout, 2);
+	emitTable(out, "postureMLP_OutShift", outScale + 1, nout, 2);
+
+	for(int l = 1; l < nlayers; l++){
+		const int n = layers->data.i[l - 1], m = layers->data.i[l];
+		const double *w = mlp.get_weights(l); //(n + 1) x m, last row is the bias
+
+		fprintf(out, "static const float postureMLP_W%d[%d][%d] = {\n", l, m, n);
+		for(int j = 0; j < m; j++){
+			fprintf(out, "\t{");
+			for(int i = 0; i < n; i++)
+				fprintf(out, "%s%s%.9ef", i ? "," : "", i % 8 ? " " : "\n\t", w[i * m + j]);
+			fprintf(out, "\n\t},\n");
+		}
+		fprintf(out, "};\n\n");
+		sprintf(name, "postureMLP_B%d", l);
+		emitTable(out, name, w + n * m, m, 1);
+	}
+
+	fprintf(out,
+		"/* one fully connected layer with the symmetric sigmoid\n"
+		"   f(x) = beta * (1 - e^(-alpha x)) / (1 + e^(-alpha x)) */\n"
+		"template<int IN, int OUT>\n"
+		"static inline void postureMLP_layer(const float (&w)[OUT][IN], const float (&b)[OUT],\n"
+		"\t\t\t\t\t\t\t\t\tconst float *in, float *out)\n{\n"
+		"\tfor(int o = 0; o < OUT; o++){\n"
+		"\t\tfloat s = 0.0f;\n"
+		"\t\tfor(int i = 0; i < IN; i++)\n\t\t\ts += w[o][i] * in[i];\n"
+		"\t\tconst float e = expf(-%.9ef * (s + b[o]));\n"
+		"\t\tout[o] = %.9ef * (1.0f - e) / (1.0f + e);\n\t}\n}\n\n",
+		MLP_SIGMOID_ALPHA, MLP_SIGMOID_BETA);
+
+	/* ping-pong buffers sized to the widest layer */
+	int widest = 0;
+	for(int l = 0; l < nlayers; l++)
+		if(layers->data.i[l] > widest)
+			widest = layers->data.i[l];
+
+	fprintf(out,
+		"/* postureMLP_predict:\n\tSame outputs as CvANN_MLP::predict, not reentrant (static buffers)\n"
+		"\t@x: POSTURE_MLP_INPUTS features\n\t@y: POSTURE_MLP_OUTPUTS responses\n*/\n"
+		"static inline void postureMLP_predict(const float *x, float *y)\n{\n"
+		"\tstatic float buf[2][%d];\n"
+		"\tfor(int i = 0; i < POSTURE_MLP_INPUTS; i++)\n"
+		"\t\tbuf[0][i] = x[i] * postureMLP_InScale[i] + postureMLP_InShift[i];\n", widest);
+	for(int l = 1; l < nlayers; l++)
+		fprintf(out, "\tpostureMLP_layer(postureMLP_W%d, postureMLP_B%d, buf[%d], buf[%d]);\n",
+				l, l, (l - 1) & 1, l & 1);
+	fprintf(out,
+		"\tfor(int i = 0; i < POSTURE_MLP_OUTPUTS; i++)\n"
+		"\t\ty[i] = buf[%d][i] * postureMLP_OutScale[i] + postureMLP_OutShift[i];\n}\n\n#endif\n",
+		(nlayers - 1) & 1);
+	fclose(out);
+
+	printf("%s: %d layers => %s\n", modelName, nlayers, headerName);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 4){
+		fprintf(stderr, "usage: %s forest|mlp <model.xml> <header.h>\n", argv[0]);
+		return 1;
+	}
+
+	bool ok;
+	if(!strcmp(argv[1], "forest"))
+		ok = generateForest(argv[2], argv[3]);
+	else if(!strcmp(argv[1], "mlp"))
+		ok = generateMLP(argv[2], argv[3]);
+	else {
+		fprintf(stderr, "Error: unknown model kind %s\n", argv[1]);
+		ok = false;
+	}
+	return ok ? 0 : 1;
+}
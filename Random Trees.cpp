@@ -20,11 +20,16 @@
 #include "ocv.h"
 #include "NPTrackingTools.h"
 
+#if COMPILED_MODEL
+#include "PostureForest.h" //ModelCodegen forest forest.xml PostureForest.h
+#endif
+
 #define W 380
 #define H 300
 #define KEY_ESC 27
 #define KEY_NOTPRESSED 0
 #define MAX_NUM_CAMERAS 3
+#define POSTURE_ARCHIVE "Postures.wmgp" //DatasetTool pack Postures Postures.wmgp
 
 #pragma warning(disable:4716) //disable missing return from function error 
 
@@ -63,11 +68,13 @@ bool setupRandomForest(CvRTrees *forest, const CvMat *featureVector,
 
    @dirName: "Postures\\1pose\\"
    @N:		Rows in matrix i.e # of images in dir 
+   @archive: packed dataset to read the frames from instead of dirName (may be NULL)
    @return: a 32FC1 matrix which is the feature vector
 			client must free allocated matrix
 			on error a NULL casted CvMat is returned
 */
-CvMat * upscaleCvt_FeatureVector(const char *dirName, int N, bool single)
+CvMat * upscaleCvt_FeatureVector(const char *dirName, int N, bool single,
+								 const DatasetArchive_t *archive = NULL)
 {
 	CvMat *fvector = cvCreateMat(N, 1, CV_32FC1);
 	IplImage *tmp8 = NULL, *tmp32 = NULL;
@@ -80,13 +87,16 @@ CvMat * upscaleCvt_FeatureVector(const char *dirName, int N, bool single)
 	for(n = 0; n < N; n++){
 		sprintf(imageName, "%s%dpose-%d.jpg",dirName,single ? 2 : 1,n+1);
 		
-		if((tmp8 = cvLoadImage(imageName,0)) == NULL){
+		tmp8 = archive ? archive_load(archive, archive_find(archive, single ? 2 : 1, n+1))
+					   : cvLoadImage(imageName,0);
+		if(tmp8 == NULL){
 			fprintf(stderr, "Error: Couldn't open %s!", imageName);
 			return (CvMat *)NULL;
 		}
 		
 		tmp32 = cvCreateImage(cvSize(tmp8->width, tmp8->height), IPL_DEPTH_32F, 1);
 		cvConvertScale(tmp8, tmp32, 1/255.); //upscale the image
+		cvReleaseImage(&tmp8);
 
 	/* fill the rows of the matrix with ImageData from the converted image */
 		*( (float *)CV_MAT_ELEM_PTR(*fvector, n, 0)) = *(float*)tmp32->imageData;
@@ -156,16 +166,21 @@ int main()
 	for(int i = 0; i < N; i++)
 		*( (float *)CV_MAT_ELEM_PTR(*response, i, 0)) = 7.00F; //Response for 1-pose
 	
-	CvMat *m = upscaleCvt_FeatureVector("Postures\\1pose\\",N, false);
+	DatasetArchive_t archive;
+	bool packed = archive_open(&archive, POSTURE_ARCHIVE); //falls back to the JPEGs
+	CvMat *m = upscaleCvt_FeatureVector("Postures\\1pose\\",N, false, packed ? &archive : NULL);
 	bool res = setupRandomForest(&forest, m, response, "1-pose");
 	if(!res)
 		printf("Problem with training!\n");
-	else
+	else {
 		printf("OK!!\n");
+		forest.save("forest.xml"); //input to ModelCodegen
+	}
 	
 	printf("Trying to predict ...\n");
 	float pResult;
-	CvMat *pmat = upscaleCvt_FeatureVector("Postures\\2pose\\",1, true);
+	CvMat *pmat = upscaleCvt_FeatureVector("Postures\\2pose\\",1, true, packed ? &archive : NULL);
+	archive_close(&archive);
 	pResult = forest.predict(pmat, 0);
 	printf("Prediction value = %f\n", pResult);
 	cvReleaseMat(&m);cvReleaseMat(&pmat);cvReleaseMat(&response);
@@ -175,6 +190,32 @@ int main()
 	printImage(img);
 	system("pause");
 	return 0;
+#elif COMPILED_MODEL && VERIFY
+	/* cross-check the compiled forest against CvRTrees::predict on the training set */
+	int N = 2000, mismatches = 0;
+	forest.load("forest.xml");
+	DatasetArchive_t archive;
+	bool packed = archive_open(&archive, POSTURE_ARCHIVE);
+	CvMat *m = upscaleCvt_FeatureVector("Postures\\1pose\\",N, false, packed ? &archive : NULL);
+	archive_close(&archive);
+	if(!m)
+		return -1;
+	assert(m->cols == POSTURE_FOREST_VARS);
+
+	for(int i = 0; i < N; i++){
+		CvMat sample;
+		cvGetRow(m, &sample, i);
+		float expected = forest.predict(&sample, 0);
+		float actual = postureForest_predict(sample.data.fl);
+		if(fabs(expected - actual) > 1e-4f * (1.0f + fabs(expected))){
+			printf("Sample %d: predict = %f, compiled = %f\n", i + 1, expected, actual);
+			mismatches++;
+		}
+	}
+	printf("Compiled forest: %d/%d mismatches\n", mismatches, N);
+	cvReleaseMat(&m);
+	system("pause");
+	return mismatches ? -1 : 0;
 #else
 	TT_Initialize(); //setup TT cameras
 	printf("Opening Calibration: %s\n", 
@@ -0,0 +1,394 @@
+/* Packed Posture Dataset Archive
+   The whole Postures tree in a single file instead of thousands of JPEGs:
+
+	 ArchiveHeader_t             magic "WMGP", version, number of frames
+	 ArchiveEntry_t[count]       per frame: pose label, frame number, size, offset
+	 frame data                  8-bit grey rows, raw or PackBits compressed
+
+   Entries are sorted by (label, frame) so a frame is found by binary search.
+   Readers map the file (MapViewOfFile / mmap) and decode straight from the
+   mapping, nothing is read that isn't used and no JPEG is decoded.
+
+   Idris Soule
+*/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <cv.h>
+#include <highgui.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "dataset.h"
+
+#define ARCHIVE_MAGIC   "WMGP"
+#define ARCHIVE_VERSION 1
+
+typedef enum {ARCHIVE_RAW = 0, ARCHIVE_PACKBITS} archiveCompression_t;
+
+typedef struct {
+	char magic[4];
+	unsigned int version;
+	unsigned int count;
+	unsigned int reserved;
+}ArchiveHeader_t;
+
+typedef struct {
+	unsigned short label;       //pose, 1 for 1pose ...
+	unsigned short compression; //archiveCompression_t
+	unsigned int frame;         //frame number in the capture session
+	unsigned short width, height;
+	unsigned int size;          //stored bytes
+	uint64 offset;              //from the start of the file
+}ArchiveEntry_t;
+
+typedef struct {
+	const uchar *base;
+	size_t size;
+	const ArchiveHeader_t *header;
+	const ArchiveEntry_t *index;
+#if defined(_WIN32)
+	HANDLE file, mapping;
+#else
+	int fd;
+#endif
+}DatasetArchive_t;
+
+static void archive_close(DatasetArchive_t *ar);
+
+static int archive_sortEntries(const void *a, const void *b)
+{
+	const ArchiveEntry_t *x = (const ArchiveEntry_t *)a, *y = (const ArchiveEntry_t *)b;
+	if(x->label != y->label)
+		return (int)x->label - (int)y->label;
+	return x->frame < y->frame ? -1 : x->frame > y->frame;
+}
+
+/* archive_packBits:
+	PackBits run length encoding, IR frames are mostly flat black
+	@return: bytes written to out (at most n + n / 128 + 1)
+*/
+static int archive_packBits(const uchar *in, int n, uchar *out)
+{
+	int o = 0;
+	for(int i = 0; i < n; ){
+		int run = 1;
+		while(i + run < n && run < 128 && in[i + run] == in[i])
+			run++;
+		if(run > 2){
+			out[o++] = (uchar)(1 - run); //-(run - 1)
+			out[o++] = in[i];
+			i += run;
+			continue;
+		}
+		/* literal block up to the next run of 3, shorter runs cost as much as they save */
+		int lit = 1;
+		while(i + lit < n && lit < 128 &&
+			  !(i + lit + 2 < n && in[i + lit] == in[i + lit + 1] && in[i + lit] == in[i + lit + 2]))
+			lit++;
+		out[o++] = (uchar)(lit - 1);
+		memcpy(out + o, in + i, lit);
+		o += lit;
+		i += lit;
+	}
+	return o;
+}
+
+/* archive_unpackBits: @return: false if the data is corrupt */
+static bool archive_unpackBits(const uchar *in, int size, uchar *out, int n)
+{
+	int o = 0;
+	for(int i = 0; i < size && o < n; ){
+		int c = (signed char)in[i++];
+		if(c >= 0){
+			if(o + c + 1 > n || i + c + 1 > size)
+				return false;
+			memcpy(out + o, in + i, c + 1);
+			o += c + 1;
+			i += c + 1;
+		}
+		else if(c != -128){
+			if(o + 1 - c > n || i >= size)
+				return false;
+			memset(out + o, in[i++], 1 - c);
+			o += 1 - c;
+		}
+	}
+	return o == n;
+}
+
+/*
+archive_build:
+	Packs pose directories into an archive
+
+	@path: archive to write
+	@root: directory holding the pose directories i.e "Postures"
+	@poseNames: pose directories, their leading number is the label ("1pose" => 1)
+	@compress: PackBits compress the frames
+	@return: number of frames packed, -1 on error
+*/
+static int archive_build(const char *path, const char *root, const char **poseNames, int numPoses,
+						 bool compress)
+{
+	char dir[DATASET_PATH_LEN], fn[DATASET_PATH_LEN];
+	char ***names = (char ***)calloc(numPoses, sizeof(char **));
+	int *counts = (int *)calloc(numPoses, sizeof(int));
+	unsigned int total = 0;
+
+	for(int p = 0; p < numPoses; p++){
+		dataset_path(dir, root, poseNames[p]);
+		if((counts[p] = dataset_list(dir, &names[p])) < 0){
+			fprintf(stderr, "Error: Couldn't read directory %s!\n", dir);
+			counts[p] = 0;
+		}
+		total += counts[p];
+	}
+
+	FILE *out = fopen(path, "wb");
+	if(!out){
+		perror(path);
+		return -1;
+	}
+
+	ArchiveHeader_t header;
+	memcpy(header.magic, ARCHIVE_MAGIC, 4);
+	header.version = ARCHIVE_VERSION;
+	header.count = total;
+	header.reserved = 0;
+
+	/* index is written once all offsets are known */
+	ArchiveEntry_t *index = (ArchiveEntry_t *)calloc(total ? total : 1, sizeof(ArchiveEntry_t));
+	fwrite(&header, sizeof(header), 1, out);
+	fwrite(index, sizeof(ArchiveEntry_t), total, out);
+	uint64 offset = sizeof(header) + (uint64)sizeof(ArchiveEntry_t) * total;
+
+	uchar *packed = NULL;
+	int packedCap = 0, n = 0;
+	bool ok = true;
+	for(int p = 0; p < numPoses && ok; p++){
+		const int label = atoi(poseNames[p]);
+		dataset_path(dir, root, poseNames[p]);
+
+		for(int i = 0; i < counts[p]; i++){
+			dataset_path(fn, dir, names[p][i]);
+			IplImage *img = cvLoadImage(fn, CV_LOAD_IMAGE_GRAYSCALE);
+			if(!img){
+				fprintf(stderr, "Error: Couldn't open %s, skipped!\n", fn);
+				continue;
+			}
+
+			/* rows without padding */
+			const int rawSize = img->width * img->height;
+			if(packedCap < 2 * rawSize){
+				packedCap = 2 * rawSize;
+				packed = (uchar *)realloc(packed, packedCap);
+			}
+			for(int y = 0; y < img->height; y++)
+				memcpy(packed + y * img->width, img->imageData + y * img->widthStep, img->width);
+
+			ArchiveEntry_t *e = &index[n++];
+			e->label = (unsigned short)label;
+			e->frame = dataset_frameNumber(names[p][i]);
+			e->width = (unsigned short)img->width;
+			e->height = (unsigned short)img->height;
+			e->offset = offset;
+			e->compression = ARCHIVE_RAW;
+			e->size = rawSize;
+
+			const uchar *data = packed;
+			if(compress){
+				int size = archive_packBits(packed, rawSize, packed + rawSize);
+				if(size < rawSize){
+					e->compression = ARCHIVE_PACKBITS;
+					e->size = size;
+					data = packed + rawSize;
+				}
+			}
+			ok = fwrite(data, 1, e->size, out) == e->size;
+			offset += e->size;
+			cvReleaseImage(&img);
+		}
+		dataset_freeList(names[p], counts[p]);
+	}
+
+	/* frames that failed to load leave the count short */
+	header.count = n;
+	qsort(index, n, sizeof(ArchiveEntry_t), &archive_sortEntries);
+	fseek(out, 0, SEEK_SET);
+	ok = ok && fwrite(&header, sizeof(header), 1, out) == 1 &&
+		 fwrite(index, sizeof(ArchiveEntry_t), n, out) == (size_t)n;
+	ok = fclose(out) == 0 && ok;
+
+	free(packed);
+	free(index);
+	free(counts);
+	free(names);
+	if(!ok){
+		fprintf(stderr, "Error: Couldn't write %s!\n", path);
+		remove(path);
+		return -1;
+	}
+	printf("%s: %d frames, %.1f MB\n", path, n, offset / (1024. * 1024.));
+	return n;
+}
+
+/*
+archive_open:
+	Maps an archive read-only
+
+	@return: false if the file is missing or not an archive
+*/
+static bool archive_open(DatasetArchive_t *ar, const char *path)
+{
+	memset(ar, 0, sizeof(*ar));
+#if defined(_WIN32)
+	ar->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+						   FILE_FLAG_RANDOM_ACCESS, NULL);
+	if(ar->file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	GetFileSizeEx(ar->file, &size);
+	ar->size = (size_t)size.QuadPart;
+	ar->mapping = CreateFileMappingA(ar->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	ar->base = ar->mapping ? (const uchar *)MapViewOfFile(ar->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if(!ar->base){
+		if(ar->mapping)
+			CloseHandle(ar->mapping);
+		CloseHandle(ar->file);
+		return false;
+	}
+#else
+	struct stat st;
+	if((ar->fd = open(path, O_RDONLY)) < 0)
+		return false;
+	fstat(ar->fd, &st);
+	ar->size = st.st_size;
+	void *base = mmap(NULL, ar->size, PROT_READ, MAP_SHARED, ar->fd, 0);
+	if(base == MAP_FAILED){
+		close(ar->fd);
+		return false;
+	}
+	madvise(base, ar->size, MADV_RANDOM);
+	ar->base = (const uchar *)base;
+#endif
+
+	ar->header = (const ArchiveHeader_t *)ar->base;
+	ar->index = (const ArchiveEntry_t *)(ar->base + sizeof(ArchiveHeader_t));
+	if(ar->size < sizeof(ArchiveHeader_t) || memcmp(ar->header->magic, ARCHIVE_MAGIC, 4) ||
+	   ar->header->version != ARCHIVE_VERSION ||
+	   ar->size < sizeof(ArchiveHeader_t) + (size_t)ar->header->count * sizeof(ArchiveEntry_t)){
+		fprintf(stderr, "Error: %s is not a posture archive!\n", path);
+		archive_close(ar);
+		return false;
+	}
+	return true;
+}
+
+static void archive_close(DatasetArchive_t *ar)
+{
+	if(!ar->base)
+		return;
+#if defined(_WIN32)
+	UnmapViewOfFile(ar->base);
+	CloseHandle(ar->mapping);
+	CloseHandle(ar->file);
+#else
+	munmap((void *)ar->base, ar->size);
+	close(ar->fd);
+#endif
+	ar->base = NULL;
+}
+
+static inline int archive_count(const DatasetArchive_t *ar)
+{
+	return ar->header->count;
+}
+
+static inline const ArchiveEntry_t * archive_entry(const DatasetArchive_t *ar, int i)
+{
+	assert(i >= 0 && i < archive_count(ar));
+	return &ar->index[i];
+}
+
+/* archive_find: @return: index of frame @frame of pose @label, -1 if absent */
+static int archive_find(const DatasetArchive_t *ar, int label, int frame)
+{
+	int lo = 0, hi = archive_count(ar) - 1;
+	while(lo <= hi){
+		int mid = (lo + hi) / 2;
+		const ArchiveEntry_t *e = &ar->index[mid];
+		int d = e->label != label ? (int)e->label - label : (int)e->frame - frame;
+		if(d == 0)
+			return mid;
+		if(d < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+/* archive_countLabel: number of frames of pose @label */
+static int archive_countLabel(const DatasetArchive_t *ar, int label)
+{
+	int n = 0;
+	for(int i = 0; i < archive_count(ar); i++)
+		n += ar->index[i].label == label;
+	return n;
+}
+
+/*
+archive_read:
+	Decodes a frame into an 8-bit single channel image of the frame's size
+
+	@return: false if the image doesn't match or the frame is corrupt
+*/
+static bool archive_read(const DatasetArchive_t *ar, int i, IplImage *dst)
+{
+	const ArchiveEntry_t *e = archive_entry(ar, i);
+	if(dst->width != e->width || dst->height != e->height || dst->nChannels != 1 ||
+	   dst->depth != IPL_DEPTH_8U || e->offset + e->size > ar->size)
+		return false;
+
+	const uchar *src = ar->base + e->offset;
+	if(e->compression == ARCHIVE_RAW){
+		for(int y = 0; y < e->height; y++)
+			memcpy(dst->imageData + y * dst->widthStep, src + y * e->width, e->width);
+		return true;
+	}
+	if(dst->widthStep == dst->width)
+		return archive_unpackBits(src, e->size, (uchar *)dst->imageData, e->width * e->height);
+
+	uchar *tmp = (uchar *)malloc(e->width * e->height);
+	bool ok = archive_unpackBits(src, e->size, tmp, e->width * e->height);
+	for(int y = 0; ok && y < e->height; y++)
+		memcpy(dst->imageData + y * dst->widthStep, tmp + y * e->width, e->width);
+	free(tmp);
+	return ok;
+}
+
+/* archive_load: like cvLoadImage(..., 0), caller releases the image */
+static IplImage * archive_load(const DatasetArchive_t *ar, int i)
+{
+	if(i < 0 || i >= archive_count(ar))
+		return NULL;
+	const ArchiveEntry_t *e = archive_entry(ar, i);
+	IplImage *img = cvCreateImage(cvSize(e->width, e->height), IPL_DEPTH_8U, 1);
+	if(!archive_read(ar, i, img))
+		cvReleaseImage(&img);
+	return img;
+}
+
+#endif
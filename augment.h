@@ -0,0 +1,379 @@
+/* Streaming Data Augmentation
+   Generates shifted, rotated, scaled and intensity-jittered variants of the
+   posture frames on worker threads and hands them to the trainers in batches,
+   nothing is written to disk.
+
+   The source frames are decoded once and kept in memory. Each variant is a
+   single cvWarpAffine (shift, rotation, scale and the resize to the training
+   size folded into one matrix) followed by a single cvConvertScale (gain, bias
+   and the 1/255 upscale), written straight into its row of the batch. A
+   trainer fed from a pyramid level gets its variants warped at that level's
+   full resolution size and reduced through the same pyramid, so they are
+   filtered like the frames it sees at runtime.
+
+   Poses are drawn round robin so every batch is balanced no matter how many
+   frames were captured per pose. A few batches are kept in flight: workers
+   fill the next ones while the trainer consumes the current one.
+
+   Idris Soule
+*/
+
+#ifndef AUGMENT_H
+#define AUGMENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <cv.h>
+
+#include "dataset.h"
+#include "archive.h"
+#include "pyramid.h"
+
+#define AUGMENT_BATCHES 3 //batches in flight
+
+typedef struct {
+	float maxShift;          //pixels in the source frame
+	float maxAngle;          //degrees
+	float minScale, maxScale;
+	float maxGain;           //intensity *= 1 +/- maxGain
+	float maxBias;           //intensity += +/- maxBias (0-255 units)
+}AugmentParams_t;
+
+typedef enum {AUGMENT_FREE = 0, AUGMENT_FILLING, AUGMENT_READY, AUGMENT_IN_USE} augmentBatchState_t;
+
+typedef struct {
+	CvMat *data;   //batchSize x (width * height) 32FC1 on [0,1]
+	CvMat *labels; //batchSize x 1 32SC1 pose [0, numClasses)
+	augmentBatchState_t state;
+	int claimed, done;
+}AugmentBatch_t;
+
+struct Augmenter_t;
+
+typedef struct {
+	struct Augmenter_t *aug;
+	int index;
+	CvRNG rng;
+	IplImage *warped; //training size << level scratch
+	ImagePyramid_t pyr;
+}AugmentWorker_t;
+
+typedef struct Augmenter_t {
+	IplImage **images; //source frames, 8-bit single channel
+	int **byClass, *classCount, numClasses;
+	AugmentParams_t params;
+	CvSize size;
+	int level; //pyramid level the variants are reduced to
+	int batchSize;
+	long drawn; //samples claimed so far, picks the pose round robin
+
+	AugmentBatch_t batches[AUGMENT_BATCHES];
+	int fill, read; //batch being claimed / next batch for the trainer
+
+	pthread_t *threads;
+	AugmentWorker_t *workers;
+	int numThreads;
+	pthread_mutex_t lock;
+	pthread_cond_t spaceCond; //a batch was released (or shutdown)
+	pthread_cond_t readyCond; //a batch was completed
+	bool shutdown;
+}Augmenter_t;
+
+/* augment_defaultParams: variants that stay recognizable as the same posture */
+static AugmentParams_t augment_defaultParams(void)
+{
+	AugmentParams_t p;
+	p.maxShift = 12.0f;
+	p.maxAngle = 10.0f;
+	p.minScale = 0.9f;
+	p.maxScale = 1.1f;
+	p.maxGain = 0.2f;
+	p.maxBias = 15.0f;
+	return p;
+}
+
+static inline float augment_uniform(CvRNG *rng, float lo, float hi)
+{
+	return lo + (hi - lo) * (float)cvRandReal(rng);
+}
+
+/* augment_sample: renders one variant of @src into row @row of @data */
+static void augment_sample(AugmentWorker_t *w, const IplImage *src, CvMat *data, int row)
+{
+	const AugmentParams_t *p = &w->aug->params;
+	const CvSize size = w->aug->size;
+	const int level = w->aug->level;
+	float m[6];
+	CvMat map = cvMat(2, 3, CV_32FC1, m);
+
+	float angle = augment_uniform(&w->rng, -p->maxAngle, p->maxAngle);
+	float scale = augment_uniform(&w->rng, p->minScale, p->maxScale);
+	cv2DRotationMatrix(cvPoint2D32f(src->width * 0.5f, src->height * 0.5f), angle, scale, &map);
+	m[2] += augment_uniform(&w->rng, -p->maxShift, p->maxShift);
+	m[5] += augment_uniform(&w->rng, -p->maxShift, p->maxShift);
+
+	/* fold the resize to the full resolution of the training level into the same warp */
+	const float sx = (float)(size.width << level) / src->width, sy = (float)(size.height << level) / src->height;
+	m[0] *= sx, m[1] *= sx, m[2] *= sx;
+	m[3] *= sy, m[4] *= sy, m[5] *= sy;
+	cvWarpAffine(src, w->warped, &map, CV_INTER_LINEAR + CV_WARP_FILL_OUTLIERS, cvScalarAll(0)); //IR background is black
+	pyramid_build(&w->pyr, w->warped, level + 1); //level 0 is the warp itself
+
+	float gain = 1.0f + augment_uniform(&w->rng, -p->maxGain, p->maxGain);
+	float bias = augment_uniform(&w->rng, -p->maxBias, p->maxBias);
+	CvMat dst = cvMat(size.height, size.width, CV_32FC1, data->data.fl + row * (size.width * size.height));
+	cvConvertScale(w->pyr.level[level], &dst, gain / 255., bias / 255.);
+	cvMaxS(&dst, 0, &dst);
+	cvMinS(&dst, 1, &dst);
+}
+
+static void * augment_worker(void *arg)
+{
+	AugmentWorker_t *w = (AugmentWorker_t *)arg;
+	Augmenter_t *aug = w->aug;
+
+	pthread_mutex_lock(&aug->lock);
+	for(;;){
+		AugmentBatch_t *b = &aug->batches[aug->fill];
+		/* with every batch in flight fill wraps onto one still being rendered */
+		while(!aug->shutdown && b->state != AUGMENT_FREE &&
+			  !(b->state == AUGMENT_FILLING && b->claimed < aug->batchSize)){
+			pthread_cond_wait(&aug->spaceCond, &aug->lock);
+			b = &aug->batches[aug->fill];
+		}
+		if(aug->shutdown)
+			break;
+
+		if(b->state == AUGMENT_FREE){
+			b->state = AUGMENT_FILLING;
+			b->claimed = b->done = 0;
+		}
+		const int row = b->claimed++;
+		if(b->claimed == aug->batchSize) //later claims go to the next batch
+			aug->fill = (aug->fill + 1) % AUGMENT_BATCHES;
+		const int c = (int)(aug->drawn++ % aug->numClasses);
+		pthread_mutex_unlock(&aug->lock);
+
+		const int s = aug->byClass[c][cvRandInt(&w->rng) % aug->classCount[c]];
+		augment_sample(w, aug->images[s], b->data, row);
+		b->labels->data.i[row] = c;
+
+		pthread_mutex_lock(&aug->lock);
+		if(++b->done == aug->batchSize){
+			b->state = AUGMENT_READY;
+			pthread_cond_broadcast(&aug->readyCond);
+		}
+	}
+	pthread_mutex_unlock(&aug->lock);
+	return NULL;
+}
+
+/*
+augment_initialize:
+	Starts the workers, they begin filling batches right away
+
+	@images: source frames (8-bit single channel), must outlive the augmenter
+	@labels: pose of each frame [0, numClasses), every pose needs a frame
+	@size: size of the generated samples i.e cvSize(W, H)
+	@level: pyramid level the trainer is fed at runtime, the variants are
+			warped at (@size << @level) and reduced to it (0 warps to @size)
+	@numThreads: workers (<= 0 uses one per processor)
+	@seed: seeds the per-worker generators
+	@return: status of initialization
+*/
+static bool augment_initialize(Augmenter_t *aug, IplImage **images, const int *labels, int n, int numClasses,
+							   const AugmentParams_t *params, CvSize size, int level, int batchSize, int numThreads,
+							   uint64 seed)
+{
+	assert(aug && images && labels && n > 0 && numClasses > 0 && batchSize > 0);
+	assert(level >= 0 && level < PYRAMID_MAX_LEVELS);
+	memset(aug, 0, sizeof(*aug));
+
+	aug->images = images;
+	aug->numClasses = numClasses;
+	aug->classCount = (int *)calloc(numClasses, sizeof(int));
+	aug->byClass = (int **)calloc(numClasses, sizeof(int *));
+	for(int i = 0; i < n; i++){
+		assert(labels[i] >= 0 && labels[i] < numClasses && images[i]->nChannels == 1);
+		aug->classCount[labels[i]]++;
+	}
+	for(int c = 0; c < numClasses; c++){
+		if(!aug->classCount[c]){
+			fprintf(stderr, "Error: No frames of pose %d to augment!\n", c + 1);
+			for(int k = 0; k < c; k++)
+				free(aug->byClass[k]);
+			free(aug->byClass), free(aug->classCount);
+			return false;
+		}
+		aug->byClass[c] = (int *)malloc(sizeof(int) * aug->classCount[c]);
+		aug->classCount[c] = 0;
+	}
+	for(int i = 0; i < n; i++)
+		aug->byClass[labels[i]][aug->classCount[labels[i]]++] = i;
+
+	aug->params = params ? *params : augment_defaultParams();
+	aug->size = size;
+	aug->level = level;
+	aug->batchSize = batchSize;
+	for(int i = 0; i < AUGMENT_BATCHES; i++){
+		aug->batches[i].data = cvCreateMat(batchSize, size.width * size.height, CV_32FC1);
+		aug->batches[i].labels = cvCreateMat(batchSize, 1, CV_32SC1);
+		aug->batches[i].state = AUGMENT_FREE;
+	}
+
+	pthread_mutex_init(&aug->lock, NULL);
+	pthread_cond_init(&aug->spaceCond, NULL);
+	pthread_cond_init(&aug->readyCond, NULL);
+
+	if(numThreads <= 0)
+		numThreads = pool_num_processors();
+	aug->threads = (pthread_t *)malloc(sizeof(pthread_t) * numThreads);
+	aug->workers = (AugmentWorker_t *)malloc(sizeof(AugmentWorker_t) * numThreads);
+	for(int i = 0; i < numThreads; i++){
+		AugmentWorker_t *w = &aug->workers[i];
+		w->aug = aug;
+		w->index = i;
+		w->rng = cvRNG(seed * 0x9E3779B97F4A7C15ULL + i + 1);
+		w->warped = cvCreateImage(cvSize(size.width << level, size.height << level), IPL_DEPTH_8U, 1);
+		pyramid_initialize(&w->pyr);
+		if(pthread_create(&aug->threads[i], NULL, augment_worker, w)){
+			printf("AUGMENT::%s: Couldn't create worker-thread %d!\n", __FUNCTION__, i);
+			cvReleaseImage(&w->warped);
+			break;
+		}
+		aug->numThreads++;
+	}
+	return aug->numThreads == numThreads;
+}
+
+/*
+augment_next:
+	Blocks until the next batch is complete
+
+	@return: the batch, hand it back with augment_release once trained on
+*/
+static AugmentBatch_t * augment_next(Augmenter_t *aug)
+{
+	pthread_mutex_lock(&aug->lock);
+	AugmentBatch_t *b = &aug->batches[aug->read];
+	while(b->state != AUGMENT_READY)
+		pthread_cond_wait(&aug->readyCond, &aug->lock);
+	b->state = AUGMENT_IN_USE;
+	pthread_mutex_unlock(&aug->lock);
+	return b;
+}
+
+/* augment_release: the batch may be refilled */
+static void augment_release(Augmenter_t *aug, AugmentBatch_t *b)
+{
+	pthread_mutex_lock(&aug->lock);
+	assert(b == &aug->batches[aug->read] && b->state == AUGMENT_IN_USE);
+	b->state = AUGMENT_FREE;
+	aug->read = (aug->read + 1) % AUGMENT_BATCHES;
+	pthread_cond_broadcast(&aug->spaceCond);
+	pthread_mutex_unlock(&aug->lock);
+}
+
+/* augment_destroy: stops the workers, the source frames are left to the caller */
+static void augment_destroy(Augmenter_t *aug)
+{
+	pthread_mutex_lock(&aug->lock);
+	aug->shutdown = true;
+	pthread_cond_broadcast(&aug->spaceCond);
+	pthread_mutex_unlock(&aug->lock);
+
+	/* a worker may still be rendering into a batch, join before freeing */
+	for(int i = 0; i < aug->numThreads; i++){
+		pthread_join(aug->threads[i], NULL);
+		cvReleaseImage(&aug->workers[i].warped);
+		pyramid_destroy(&aug->workers[i].pyr);
+	}
+	for(int i = 0; i < AUGMENT_BATCHES; i++){
+		cvReleaseMat(&aug->batches[i].data);
+		cvReleaseMat(&aug->batches[i].labels);
+	}
+	for(int c = 0; c < aug->numClasses; c++)
+		free(aug->byClass[c]);
+	free(aug->byClass);
+	free(aug->classCount);
+	free(aug->workers);
+	free(aug->threads);
+	pthread_cond_destroy(&aug->readyCond);
+	pthread_cond_destroy(&aug->spaceCond);
+	pthread_mutex_destroy(&aug->lock);
+}
+
+/*
+augment_loadPoses:
+	Decodes the source frames of each pose, from the archive when given,
+	otherwise from <root>\<pose>
+
+	@perPose: frames per pose at most (<= 0 for all)
+	@images, @labels: receive the frames and their pose [0, numPoses),
+					  release with augment_freePoses
+	@return: number of frames loaded
+*/
+static int augment_loadPoses(const DatasetArchive_t *ar, const char *root, const char **poseNames, int numPoses,
+							 int perPose, IplImage ***images, int **labels)
+{
+	char dir[DATASET_PATH_LEN], path[DATASET_PATH_LEN];
+	int n = 0, cap = 256;
+	*images = (IplImage **)malloc(sizeof(IplImage *) * cap);
+	*labels = (int *)malloc(sizeof(int) * cap);
+
+	for(int p = 0; p < numPoses; p++){
+		const int label = atoi(poseNames[p]);
+		char **names = NULL;
+		int count = 0, listed = 0, first = 0;
+		if(ar){
+			/* entries of a pose are contiguous and sorted by frame */
+			while(first < archive_count(ar) && archive_entry(ar, first)->label != label)
+				first++;
+			count = archive_countLabel(ar, label);
+		}
+		else {
+			dataset_path(dir, root, poseNames[p]);
+			if((listed = count = dataset_list(dir, &names)) < 0){
+				fprintf(stderr, "Error: Couldn't read directory %s!\n", dir);
+				continue;
+			}
+		}
+		if(perPose > 0 && count > perPose)
+			count = perPose;
+
+		for(int i = 0; i < count; i++){
+			IplImage *img;
+			if(ar)
+				img = archive_load(ar, first + i);
+			else {
+				dataset_path(path, dir, names[i]);
+				img = cvLoadImage(path, CV_LOAD_IMAGE_GRAYSCALE);
+			}
+			if(!img)
+				continue;
+			if(n == cap){
+				cap *= 2;
+				*images = (IplImage **)realloc(*images, sizeof(IplImage *) * cap);
+				*labels = (int *)realloc(*labels, sizeof(int) * cap);
+			}
+			(*images)[n] = img;
+			(*labels)[n++] = p;
+		}
+		if(names)
+			dataset_freeList(names, listed);
+	}
+	return n;
+}
+
+static void augment_freePoses(IplImage **images, int *labels, int n)
+{
+	for(int i = 0; i < n; i++)
+		cvReleaseImage(&images[i]);
+	free(images);
+	free(labels);
+}
+
+#endif
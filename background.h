@@ -0,0 +1,136 @@
+/* Running-Average Background Model
+   Reflections and fixed objects in the view are learnt into a per-pixel
+   running average and removed before threshold and labeling, only what
+   moves (the hand) reaches the blob and contour stages.
+
+   The average is kept in 8.8 fixed point (16 bits per pixel) and updated
+   with shifts, bg += (src - bg) >> k, 8 pixels per step with SSE2. Pixels
+   classified as foreground are learnt with a slower rate so a hand held
+   still isn't absorbed right away while a new fixed object eventually is.
+
+   Idris Soule
+*/
+
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <cv.h>
+#include <emmintrin.h>
+
+typedef struct {
+	unsigned short *bg; //8.8 fixed point average, stride bytes per row / 2
+	int width, height, stride;
+	int fastShift;      //rate 2^-fastShift for background pixels
+	int slowShift;      //rate 2^-slowShift for foreground pixels
+	int margin;         //grey levels above the background to be foreground
+	bool learnt;
+}BackgroundModel_t;
+
+/*
+background_initialize:
+	@fastShift: i.e 5 (1/32 per frame, ~1 s at 30 fps)
+	@slowShift: i.e 9 (1/512 per frame)
+	@margin: i.e 15
+*/
+static void background_initialize(BackgroundModel_t *bm, CvSize size, int fastShift, int slowShift, int margin)
+{
+	assert(fastShift > 0 && fastShift <= slowShift && slowShift < 16 && margin >= 0 && margin < 256);
+	bm->width = size.width;
+	bm->height = size.height;
+	bm->stride = (size.width + 7) & ~7;
+	bm->bg = (unsigned short *)malloc(sizeof(unsigned short) * bm->stride * size.height);
+	bm->fastShift = fastShift;
+	bm->slowShift = slowShift;
+	bm->margin = margin;
+	bm->learnt = false;
+}
+
+/* background_reset: the next frame becomes the background */
+static void background_reset(BackgroundModel_t *bm)
+{
+	bm->learnt = false;
+}
+
+/* background_learnRow: bg = src << 8 */
+static void background_learnRow(unsigned short *bg, const uchar *src, int n)
+{
+	for(int x = 0; x < n; x++)
+		bg[x] = (unsigned short)(src[x] << 8);
+}
+
+/*
+background_apply:
+	Removes the background from a frame and learns the frame into it
+
+	@src: 8-bit single channel frame
+	@dst: receives src where it is brighter than the background by more than
+		  the margin, 0 elsewhere (may be src)
+*/
+static void background_apply(BackgroundModel_t *bm, const IplImage *src, IplImage *dst)
+{
+	assert(src->width == bm->width && src->height == bm->height && src->nChannels == 1 &&
+		   dst->width == bm->width && dst->height == bm->height && dst->nChannels == 1);
+
+	if(!bm->learnt){
+		for(int y = 0; y < bm->height; y++)
+			background_learnRow(bm->bg + y * bm->stride, (const uchar *)src->imageData + y * src->widthStep, bm->width);
+		bm->learnt = true;
+		cvZero(dst); //nothing moved yet
+		return;
+	}
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i margin = _mm_set1_epi8((char)bm->margin);
+	const __m128i fast = _mm_cvtsi32_si128(bm->fastShift), slow = _mm_cvtsi32_si128(bm->slowShift);
+
+	for(int y = 0; y < bm->height; y++){
+		const uchar *p = (const uchar *)src->imageData + y * src->widthStep;
+		uchar *q = (uchar *)dst->imageData + y * dst->widthStep;
+		unsigned short *bg = bm->bg + y * bm->stride;
+		int x = 0;
+		for(; x + 16 <= bm->width; x += 16){
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+			__m128i b0 = _mm_loadu_si128((const __m128i *)(bg + x));
+			__m128i b1 = _mm_loadu_si128((const __m128i *)(bg + x + 8));
+
+			/* foreground: src - bg - margin > 0 (saturating) */
+			__m128i bg8 = _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8));
+			__m128i fg = _mm_subs_epu8(_mm_subs_epu8(v, bg8), margin);
+			__m128i mask = _mm_xor_si128(_mm_cmpeq_epi8(fg, zero), _mm_set1_epi8(-1));
+			_mm_storeu_si128((__m128i *)(q + x), _mm_and_si128(v, mask));
+
+			/* bg += (src << 8 - bg) >> k with k per pixel, up and down
+			   are split so the unsigned 16-bit arithmetic never wraps */
+			__m128i halves[2] = {b0, b1};
+			for(int h = 0; h < 2; h++){
+				__m128i s16 = _mm_slli_epi16(h ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero), 8);
+				__m128i m16 = h ? _mm_unpackhi_epi8(mask, mask) : _mm_unpacklo_epi8(mask, mask);
+				__m128i up = _mm_subs_epu16(s16, halves[h]);
+				__m128i down = _mm_subs_epu16(halves[h], s16);
+				__m128i upK = _mm_or_si128(_mm_and_si128(m16, _mm_srl_epi16(up, slow)),
+										   _mm_andnot_si128(m16, _mm_srl_epi16(up, fast)));
+				__m128i downK = _mm_or_si128(_mm_and_si128(m16, _mm_srl_epi16(down, slow)),
+											 _mm_andnot_si128(m16, _mm_srl_epi16(down, fast)));
+				_mm_storeu_si128((__m128i *)(bg + x + 8 * h), _mm_sub_epi16(_mm_add_epi16(halves[h], upK), downK));
+			}
+		}
+		for(; x < bm->width; x++){
+			const int s16 = p[x] << 8, b = bg[x];
+			const bool fore = p[x] - (b >> 8) > bm->margin;
+			const int k = fore ? bm->slowShift : bm->fastShift;
+			q[x] = fore ? p[x] : 0;
+			bg[x] = (unsigned short)(s16 > b ? b + ((s16 - b) >> k) : b - ((b - s16) >> k));
+		}
+	}
+}
+
+static void background_destroy(BackgroundModel_t *bm)
+{
+	free(bm->bg);
+	bm->bg = NULL;
+}
+
+#endif
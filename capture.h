@@ -0,0 +1,220 @@
+/* Asynchronous Capture Writer
+   Frames for the training sets are copied into a fixed set of preallocated
+   slots and handed to background writers, the camera thread never waits on a
+   JPEG encode or a disk write. Writers take whole batches of frames from the
+   queue per wake-up. When every slot is busy the frame is dropped (and counted)
+   rather than stalling acquisition.
+
+   Idris Soule
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <cv.h>
+#include <highgui.h>
+
+#define CAPTURE_NAME_LEN 110
+
+typedef struct {
+	IplImage *image; //preallocated on first use, reused afterwards
+	char name[CAPTURE_NAME_LEN];
+}CaptureSlot_t;
+
+typedef struct {
+	long submitted, written, dropped, failed;
+	int depth, maxDepth; //frames queued (or being written) now / at most
+}CaptureStats_t;
+
+typedef struct CaptureWriter_t {
+	CaptureSlot_t *slots;
+	int capacity;
+	int *ready, readyHead, readyCount; //circular queue of slots to write
+	int *freeSlots, freeCount;         //stack of unused slots
+	int batchSize;
+
+	pthread_t *threads;
+	int numThreads;
+	pthread_mutex_t lock;
+	pthread_cond_t frameCond; //frames were queued (or shutdown)
+	pthread_cond_t idleCond;  //every slot is free again
+	bool shutdown;
+
+	CaptureStats_t stats;
+}CaptureWriter_t;
+
+static void * capture_worker(void *arg)
+{
+	CaptureWriter_t *cw = (CaptureWriter_t *)arg;
+	int *batch = (int *)malloc(sizeof(int) * cw->batchSize);
+
+	pthread_mutex_lock(&cw->lock);
+	for(;;){
+		while(cw->readyCount == 0 && !cw->shutdown)
+			pthread_cond_wait(&cw->frameCond, &cw->lock);
+		if(cw->readyCount == 0) //shutdown and drained
+			break;
+
+		/* take a whole batch per wake-up */
+		int n = 0;
+		for(; n < cw->batchSize && cw->readyCount; n++){
+			batch[n] = cw->ready[cw->readyHead];
+			cw->readyHead = (cw->readyHead + 1) % cw->capacity;
+			cw->readyCount--;
+		}
+		pthread_mutex_unlock(&cw->lock);
+
+		int failed = 0;
+		for(int i = 0; i < n; i++){
+			CaptureSlot_t *slot = &cw->slots[batch[i]];
+			if(!cvSaveImage(slot->name, slot->image)){ //JPEG encode + disk write
+				fprintf(stderr, "Error: Couldn't write %s!\n", slot->name);
+				failed++;
+			}
+		}
+
+		pthread_mutex_lock(&cw->lock);
+		for(int i = 0; i < n; i++)
+			cw->freeSlots[cw->freeCount++] = batch[i];
+		cw->stats.written += n - failed;
+		cw->stats.failed += failed;
+		cw->stats.depth -= n;
+		if(cw->freeCount == cw->capacity)
+			pthread_cond_broadcast(&cw->idleCond);
+	}
+	pthread_mutex_unlock(&cw->lock);
+	free(batch);
+	return NULL;
+}
+
+/*
+capture_initialize:
+	Allocates the slots and starts the writers
+
+	@capacity: frames that can be queued before frames are dropped
+	@numThreads: writer threads
+	@batchSize: frames a writer takes per wake-up
+	@return: status of initialization
+*/
+static bool capture_initialize(CaptureWriter_t *cw, int capacity, int numThreads, int batchSize)
+{
+	assert(cw && capacity > 0 && numThreads > 0 && batchSize > 0);
+
+	cw->slots = (CaptureSlot_t *)calloc(capacity, sizeof(CaptureSlot_t));
+	cw->ready = (int *)malloc(sizeof(int) * capacity);
+	cw->freeSlots = (int *)malloc(sizeof(int) * capacity);
+	cw->threads = (pthread_t *)malloc(sizeof(pthread_t) * numThreads);
+	cw->capacity = capacity;
+	cw->batchSize = batchSize;
+	cw->readyHead = cw->readyCount = 0;
+	cw->freeCount = capacity;
+	for(int i = 0; i < capacity; i++)
+		cw->freeSlots[i] = capacity - 1 - i;
+	cw->shutdown = false;
+	memset(&cw->stats, 0, sizeof(cw->stats));
+
+	pthread_mutex_init(&cw->lock, NULL);
+	pthread_cond_init(&cw->frameCond, NULL);
+	pthread_cond_init(&cw->idleCond, NULL);
+
+	cw->numThreads = 0;
+	for(int i = 0; i < numThreads; i++){
+		if(pthread_create(&cw->threads[i], NULL, capture_worker, cw)){
+			printf("CAPTURE::%s: Couldn't create writer-thread %d!\n", __FUNCTION__, i);
+			break;
+		}
+		cw->numThreads++;
+	}
+	return cw->numThreads == numThreads;
+}
+
+/*
+capture_submit:
+	Copies a frame into a free slot and queues it for writing, never blocks on I/O
+
+	@img: frame to save, copied so the caller may overwrite it right away
+	@name: file to write
+	@return: false if the frame was dropped (every slot busy)
+*/
+static bool capture_submit(CaptureWriter_t *cw, const IplImage *img, const char *name)
+{
+	pthread_mutex_lock(&cw->lock);
+	cw->stats.submitted++;
+	if(cw->freeCount == 0){
+		cw->stats.dropped++;
+		pthread_mutex_unlock(&cw->lock);
+		return false;
+	}
+	int s = cw->freeSlots[--cw->freeCount];
+	pthread_mutex_unlock(&cw->lock);
+
+	/* the slot is ours until queued, copy outside the lock */
+	CaptureSlot_t *slot = &cw->slots[s];
+	if(!slot->image || slot->image->width != img->width || slot->image->height != img->height ||
+	   slot->image->nChannels != img->nChannels || slot->image->depth != img->depth){
+		cvReleaseImage(&slot->image);
+		slot->image = cvCreateImage(cvGetSize(img), img->depth, img->nChannels);
+	}
+	cvCopy(img, slot->image);
+	strncpy(slot->name, name, CAPTURE_NAME_LEN - 1);
+	slot->name[CAPTURE_NAME_LEN - 1] = '\0';
+
+	pthread_mutex_lock(&cw->lock);
+	cw->ready[(cw->readyHead + cw->readyCount) % cw->capacity] = s;
+	cw->readyCount++;
+	if(++cw->stats.depth > cw->stats.maxDepth)
+		cw->stats.maxDepth = cw->stats.depth;
+	pthread_cond_signal(&cw->frameCond);
+	pthread_mutex_unlock(&cw->lock);
+	return true;
+}
+
+/* capture_stats: snapshot of the dropped-frame and queue-depth counters */
+static CaptureStats_t capture_stats(CaptureWriter_t *cw)
+{
+	pthread_mutex_lock(&cw->lock);
+	CaptureStats_t stats = cw->stats;
+	pthread_mutex_unlock(&cw->lock);
+	return stats;
+}
+
+/* capture_flush: blocks until every queued frame is on disk */
+static void capture_flush(CaptureWriter_t *cw)
+{
+	pthread_mutex_lock(&cw->lock);
+	while(cw->freeCount != cw->capacity)
+		pthread_cond_wait(&cw->idleCond, &cw->lock);
+	pthread_mutex_unlock(&cw->lock);
+}
+
+/*
+capture_destroy:
+	Writes out the queued frames, joins the writers and frees the slots
+*/
+static void capture_destroy(CaptureWriter_t *cw)
+{
+	pthread_mutex_lock(&cw->lock);
+	cw->shutdown = true;
+	pthread_cond_broadcast(&cw->frameCond);
+	pthread_mutex_unlock(&cw->lock);
+
+	for(int i = 0; i < cw->numThreads; i++)
+		pthread_join(cw->threads[i], NULL);
+
+	for(int i = 0; i < cw->capacity; i++)
+		cvReleaseImage(&cw->slots[i].image);
+	pthread_cond_destroy(&cw->idleCond);
+	pthread_cond_destroy(&cw->frameCond);
+	pthread_mutex_destroy(&cw->lock);
+	free(cw->threads);
+	free(cw->freeSlots);
+	free(cw->ready);
+	free(cw->slots);
+}
+
+#endif
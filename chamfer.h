@@ -0,0 +1,467 @@
+/* Chamfer Template Matching
+   A third posture classifier next to the Haar cascades and the MLP: edge
+   templates cut from exemplar frames of each pose are slid over the
+   distance transform of the frame's edges, the mean distance under a
+   template's edge points is its chamfer score (0 = every edge point lies on
+   an edge of the frame).
+
+   Per frame the edges and their truncated L2 distance transform are built
+   once per pyramid level and shared by all templates. A template is first
+   placed at every position of the coarsest level, the best candidates are
+   then refined level by level around twice their position. Scores are summed
+   for 4 neighbouring x positions at once with SSE (one unaligned load per
+   edge point) and a placement is dropped as soon as its partial sums pass
+   the rejection bound, checked every CHAMFER_BLOCK points.
+
+   Templates are independent jobs on the worker pool (pool.h), each worker
+   keeps its candidates in its own scratch so no locking is involved.
+
+   Idris Soule
+*/
+
+#ifndef CHAMFER_H
+#define CHAMFER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <assert.h>
+#include <cv.h>
+#include <emmintrin.h>
+
+#include "pool.h"
+#include "pyramid.h"
+
+#define CHAMFER_LEVELS         3   //level 2 = 1/16 of the pixels for the full scan
+#define CHAMFER_MAX_POINTS     256 //edge points kept per template at level 0, halved per level
+#define CHAMFER_MIN_POINTS     24
+#define CHAMFER_TRUNCATE       12.0f //distances are clipped, a missing edge costs at most this
+#define CHAMFER_BLOCK          16  //points summed between rejection checks
+#define CHAMFER_MAX_CANDIDATES 32  //coarse placements refined per template
+#define CHAMFER_PAD            4   //extra columns so 4 positions can be loaded past the last one
+
+typedef struct {
+	short x, y;
+}ChamferPoint_t;
+
+typedef struct {
+	ChamferPoint_t *points[CHAMFER_LEVELS]; //relative to the template's top left corner
+	int *offsets[CHAMFER_LEVELS];           //points as offsets into the distance map
+	int count[CHAMFER_LEVELS];
+	int width[CHAMFER_LEVELS], height[CHAMFER_LEVELS];
+	int label;
+}ChamferTemplate_t;
+
+typedef struct {
+	float *d;       //truncated distance to the nearest edge
+	int width, height, stride;
+}ChamferMap_t;
+
+typedef struct {
+	int x, y;       //top left corner of the template, level 0
+	float score;    //mean distance in level 0 pixels, FLT_MAX if rejected
+	int index;      //template
+}ChamferHit_t;
+
+struct ChamferMatcher_t;
+
+typedef struct {
+	struct ChamferMatcher_t *m;
+	int index;
+}ChamferJob_t;
+
+typedef struct ChamferMatcher_t {
+	ChamferTemplate_t *templates;
+	ChamferJob_t *jobs;
+	ChamferHit_t *results;      //best placement of each template for the last frame
+	int count, capacity;
+
+	ChamferMap_t maps[CHAMFER_LEVELS];
+	int offsetStride[CHAMFER_LEVELS]; //map stride the template offsets were computed for
+	IplImage *edges[CHAMFER_LEVELS], *dist[CHAMFER_LEVELS];
+	ImagePyramid_t pyr;
+
+	double cannyLow, cannyHigh;
+	float rejectScore;          //mean distance (level 0 pixels) above which a placement is dropped
+
+	WorkerPool_t pool;
+	ChamferHit_t *scratch;      //CHAMFER_MAX_CANDIDATES per worker
+}ChamferMatcher_t;
+
+/*
+chamfer_initialize:
+	@numThreads: scoring workers (<= 0 uses one per processor)
+	@cannyLow, cannyHigh: hysteresis thresholds of the edge detector i.e 50, 150
+	@rejectScore: mean edge distance in pixels accepted as a match i.e 3
+	@return: status of initialization
+*/
+static bool chamfer_initialize(ChamferMatcher_t *m, int numThreads, double cannyLow, double cannyHigh,
+							   float rejectScore)
+{
+	memset(m, 0, sizeof(*m));
+	m->capacity = 64;
+	m->templates = (ChamferTemplate_t *)calloc(m->capacity, sizeof(ChamferTemplate_t));
+	m->cannyLow = cannyLow;
+	m->cannyHigh = cannyHigh;
+	m->rejectScore = rejectScore;
+	pyramid_initialize(&m->pyr);
+	if(numThreads <= 0)
+		numThreads = pool_num_processors();
+	m->scratch = (ChamferHit_t *)malloc(sizeof(ChamferHit_t) * CHAMFER_MAX_CANDIDATES * numThreads);
+	return pool_initialize(&m->pool, numThreads, 2 * numThreads);
+}
+
+/* chamfer_edges: Canny edges of every level of @pyr into m->edges */
+static void chamfer_edges(ChamferMatcher_t *m, const ImagePyramid_t *pyr)
+{
+	for(int l = 0; l < pyr->levels; l++){
+		IplImage *src = pyr->level[l];
+		if(!m->edges[l] || m->edges[l]->width != src->width || m->edges[l]->height != src->height){
+			cvReleaseImage(&m->edges[l]);
+			cvReleaseImage(&m->dist[l]);
+			m->edges[l] = cvCreateImage(cvGetSize(src), IPL_DEPTH_8U, 1);
+			m->dist[l] = cvCreateImage(cvGetSize(src), IPL_DEPTH_32F, 1);
+		}
+		cvCanny(src, m->edges[l], m->cannyLow, m->cannyHigh, 3);
+	}
+}
+
+/*
+chamfer_addTemplate:
+	Cuts the edges of an exemplar frame into a template of every level
+
+	@gray: 8-bit single channel exemplar, the pose should fill most of the edges
+	@return: false if the exemplar has too few edges
+*/
+static bool chamfer_addTemplate(ChamferMatcher_t *m, IplImage *gray, int label)
+{
+	ImagePyramid_t pyr;
+	pyramid_initialize(&pyr);
+	pyramid_build(&pyr, gray, CHAMFER_LEVELS);
+	chamfer_edges(m, &pyr);
+
+	/* bounding box of the level 0 edges, the other levels use the same box scaled */
+	const IplImage *e0 = m->edges[0];
+	int x0 = e0->width, y0 = e0->height, x1 = -1, y1 = -1;
+	for(int y = 0; y < e0->height; y++){
+		const uchar *row = (const uchar *)e0->imageData + y * e0->widthStep;
+		for(int x = 0; x < e0->width; x++)
+			if(row[x]){
+				x0 = MIN(x0, x), x1 = MAX(x1, x);
+				y0 = MIN(y0, y), y1 = MAX(y1, y);
+			}
+	}
+
+	ChamferTemplate_t t;
+	memset(&t, 0, sizeof(t));
+	t.label = label;
+	bool ok = x1 >= 0;
+	for(int l = 0; l < CHAMFER_LEVELS && ok; l++){
+		const IplImage *e = m->edges[l];
+		const int bx = x0 >> l, by = y0 >> l;
+		const int bw = MIN((x1 >> l) + 1, e->width) - bx, bh = MIN((y1 >> l) + 1, e->height) - by;
+		int total = 0;
+		for(int y = by; y < by + bh; y++)
+			for(int x = bx; x < bx + bw; x++)
+				total += ((const uchar *)e->imageData)[y * e->widthStep + x] != 0;
+
+		/* keep an evenly spread subset along the scan order */
+		const int keep = MIN(total, MAX(CHAMFER_MAX_POINTS >> l, CHAMFER_MIN_POINTS));
+		if(keep < CHAMFER_MIN_POINTS){
+			ok = false;
+			break;
+		}
+		t.points[l] = (ChamferPoint_t *)malloc(sizeof(ChamferPoint_t) * keep);
+		t.offsets[l] = (int *)malloc(sizeof(int) * keep);
+		t.width[l] = bw;
+		t.height[l] = bh;
+		int seen = 0;
+		for(int y = by; y < by + bh; y++)
+			for(int x = bx; x < bx + bw; x++){
+				if(!((const uchar *)e->imageData)[y * e->widthStep + x])
+					continue;
+				/* point i of total is kept when it crosses the next multiple of total / keep */
+				if((long)seen * keep / total != (long)(seen + 1) * keep / total){
+					ChamferPoint_t *p = &t.points[l][t.count[l]++];
+					p->x = (short)(x - bx);
+					p->y = (short)(y - by);
+				}
+				seen++;
+			}
+	}
+	pyramid_destroy(&pyr);
+
+	if(!ok){
+		for(int l = 0; l < CHAMFER_LEVELS; l++){
+			free(t.points[l]);
+			free(t.offsets[l]);
+		}
+		return false;
+	}
+	if(m->count == m->capacity){
+		m->capacity *= 2;
+		m->templates = (ChamferTemplate_t *)realloc(m->templates, sizeof(ChamferTemplate_t) * m->capacity);
+	}
+	m->templates[m->count++] = t;
+	memset(m->offsetStride, 0, sizeof(m->offsetStride)); //offsets of the new template are due
+	return true;
+}
+
+/*
+chamfer_addPoses:
+	@images, @labels: frames of every pose, i.e from augment_loadPoses
+	@perPose: exemplars taken per label, evenly spread over its frames
+	@return: templates added
+*/
+static int chamfer_addPoses(ChamferMatcher_t *m, IplImage **images, const int *labels, int n,
+							int numLabels, int perPose)
+{
+	int added = 0;
+	for(int c = 0; c < numLabels; c++){
+		int count = 0;
+		for(int i = 0; i < n; i++)
+			count += labels[i] == c;
+		int k = 0, taken = 0;
+		for(int i = 0; i < n && taken < perPose; i++){
+			if(labels[i] != c)
+				continue;
+			if((long)k++ * perPose / count < (long)taken)
+				continue;
+			taken++;
+			added += chamfer_addTemplate(m, images[i], c);
+		}
+	}
+	return added;
+}
+
+/* chamfer_distanceMaps: truncated distance transform of every edge level, padded */
+static void chamfer_distanceMaps(ChamferMatcher_t *m)
+{
+	for(int l = 0; l < m->pyr.levels; l++){
+		IplImage *e = m->edges[l];
+		ChamferMap_t *map = &m->maps[l];
+		const int stride = (e->width + CHAMFER_PAD + 3) & ~3;
+		if(map->stride != stride || map->height != e->height){
+			free(map->d);
+			map->d = (float *)malloc(sizeof(float) * stride * e->height);
+			map->stride = stride;
+		}
+		map->width = e->width;
+		map->height = e->height;
+
+		cvNot(e, e); //distance to the nearest zero pixel, edges become 0
+		cvDistTransform(e, m->dist[l], CV_DIST_L2, 3);
+
+		const __m128 clip = _mm_set1_ps(CHAMFER_TRUNCATE);
+		for(int y = 0; y < e->height; y++){
+			const float *src = (const float *)(m->dist[l]->imageData + y * m->dist[l]->widthStep);
+			float *dst = map->d + y * stride;
+			int x = 0;
+			for(; x + 4 <= e->width; x += 4)
+				_mm_storeu_ps(dst + x, _mm_min_ps(_mm_loadu_ps(src + x), clip));
+			for(; x < e->width; x++)
+				dst[x] = MIN(src[x], CHAMFER_TRUNCATE);
+			for(; x < stride; x++)
+				dst[x] = CHAMFER_TRUNCATE;
+		}
+	}
+}
+
+/*
+chamfer_score4:
+	Sums of the distances under the template placed at (x .. x + 3, y)
+
+	@reject: sum above which a placement is dropped, scoring stops early once
+			 all four placements are past it (the sums returned are then partial)
+*/
+static inline __m128 chamfer_score4(const float *base, const int *offsets, int n, float reject)
+{
+	const __m128 bound = _mm_set1_ps(reject);
+	__m128 acc = _mm_setzero_ps();
+	for(int i = 0; i < n; ){
+		const int end = MIN(i + CHAMFER_BLOCK, n);
+		for(; i < end; i++)
+			acc = _mm_add_ps(acc, _mm_loadu_ps(base + offsets[i]));
+		if(_mm_movemask_ps(_mm_cmplt_ps(acc, bound)) == 0)
+			break;
+	}
+	return acc;
+}
+
+/* chamfer_keep: inserts a placement into the list sorted by score, the worst falls off a full list */
+static void chamfer_keep(ChamferHit_t *list, int *n, int x, int y, float score)
+{
+	if(*n == CHAMFER_MAX_CANDIDATES && score >= list[*n - 1].score)
+		return;
+	int i = *n < CHAMFER_MAX_CANDIDATES ? (*n)++ : *n - 1;
+	for(; i > 0 && list[i - 1].score > score; i--)
+		list[i] = list[i - 1];
+	list[i].x = x;
+	list[i].y = y;
+	list[i].score = score;
+}
+
+/* chamfer_scan: every placement of a template at level @l, best ones into @list */
+static int chamfer_scan(const ChamferMap_t *map, const ChamferTemplate_t *t, int l, float reject,
+						ChamferHit_t *list)
+{
+	const int n = t->count[l], xMax = map->width - t->width[l], yMax = map->height - t->height[l];
+	int kept = 0;
+	for(int y = 0; y <= yMax; y++){
+		const float *row = map->d + y * map->stride;
+		for(int x = 0; x <= xMax; x += 4){
+			/* the bound tightens to the worst kept placement once the list is full */
+			const float bound = kept == CHAMFER_MAX_CANDIDATES ? MIN(reject, list[kept - 1].score) : reject;
+			CV_DECL_ALIGNED(16) float sums[4];
+			_mm_store_ps(sums, chamfer_score4(row + x, t->offsets[l], n, bound));
+			for(int i = 0; i < 4 && x + i <= xMax; i++)
+				if(sums[i] < bound)
+					chamfer_keep(list, &kept, x + i, y, sums[i]);
+		}
+	}
+	return kept;
+}
+
+/* chamfer_refine: best placement in the 4x3 neighbourhood of (x, y) at level @l */
+static float chamfer_refine(const ChamferMap_t *map, const ChamferTemplate_t *t, int l, float reject,
+							int *px, int *py)
+{
+	const int n = t->count[l], xMax = map->width - t->width[l], yMax = map->height - t->height[l];
+	if(xMax < 0 || yMax < 0)
+		return FLT_MAX;
+	const int x0 = MAX(0, MIN(*px - 1, xMax - 3)), cy = *py;
+	float best = reject;
+	bool found = false;
+	for(int y = MAX(0, cy - 1); y <= MIN(yMax, cy + 1); y++){
+		CV_DECL_ALIGNED(16) float sums[4];
+		_mm_store_ps(sums, chamfer_score4(map->d + y * map->stride + x0, t->offsets[l], n, best));
+		for(int i = 0; i < 4 && x0 + i <= xMax; i++)
+			if(sums[i] < best){
+				best = sums[i];
+				*px = x0 + i, *py = y;
+				found = true;
+			}
+	}
+	return found ? best : FLT_MAX;
+}
+
+/* chamfer_matchTemplate: coarse to fine search of one template */
+static void chamfer_matchTemplate(ChamferMatcher_t *m, int index, int worker)
+{
+	const ChamferTemplate_t *t = &m->templates[index];
+	ChamferHit_t *list = m->scratch + worker * CHAMFER_MAX_CANDIDATES;
+	ChamferHit_t *result = &m->results[index];
+	const int top = m->pyr.levels - 1;
+	result->score = FLT_MAX;
+	result->index = index;
+
+	if(t->width[top] > m->maps[top].width || t->height[top] > m->maps[top].height)
+		return;
+	/* scores are sums, the bound is the accepted mean scaled to the level and point count */
+	int kept = chamfer_scan(&m->maps[top], t, top, m->rejectScore / (1 << top) * t->count[top], list);
+
+	for(int l = top - 1; l >= 0; l--){
+		const float reject = m->rejectScore / (1 << l) * t->count[l];
+		int survivors = 0;
+		for(int i = 0; i < kept; i++){
+			int x = list[i].x * 2, y = list[i].y * 2;
+			/* at level 0 only the best placement so far matters */
+			const float bound = l == 0 && result->score != FLT_MAX ?
+								MIN(reject, result->score * t->count[0]) : reject;
+			const float score = chamfer_refine(&m->maps[l], t, l, bound, &x, &y);
+			if(score == FLT_MAX)
+				continue;
+			if(l == 0){
+				result->x = x, result->y = y;
+				result->score = score / t->count[0];
+			}
+			else{
+				list[survivors].x = x, list[survivors].y = y;
+				list[survivors++].score = score;
+			}
+		}
+		kept = survivors;
+	}
+	if(top == 0 && kept){
+		result->x = list[0].x, result->y = list[0].y;
+		result->score = list[0].score / t->count[0];
+	}
+}
+
+static void chamfer_worker(void *arg, int worker)
+{
+	ChamferJob_t *job = (ChamferJob_t *)arg;
+	chamfer_matchTemplate(job->m, job->index, worker);
+}
+
+/*
+chamfer_match:
+	Scores every template against a frame
+
+	@gray: 8-bit single channel frame, at least as large as the templates
+	@hit: receives the best placement (level 0) and its template, may be NULL
+	@return: label of the best template, -1 if no template scored under rejectScore
+*/
+static int chamfer_match(ChamferMatcher_t *m, IplImage *gray, ChamferHit_t *hit)
+{
+	assert(gray->nChannels == 1 && gray->depth == IPL_DEPTH_8U);
+	pyramid_build(&m->pyr, gray, CHAMFER_LEVELS);
+	chamfer_edges(m, &m->pyr);
+	chamfer_distanceMaps(m);
+
+	for(int l = 0; l < m->pyr.levels; l++){
+		if(m->offsetStride[l] == m->maps[l].stride)
+			continue;
+		for(int i = 0; i < m->count; i++){
+			ChamferTemplate_t *t = &m->templates[i];
+			for(int j = 0; j < t->count[l]; j++)
+				t->offsets[l][j] = t->points[l][j].y * m->maps[l].stride + t->points[l][j].x;
+		}
+		m->offsetStride[l] = m->maps[l].stride;
+	}
+
+	m->jobs = (ChamferJob_t *)realloc(m->jobs, sizeof(ChamferJob_t) * (m->count ? m->count : 1));
+	m->results = (ChamferHit_t *)realloc(m->results, sizeof(ChamferHit_t) * (m->count ? m->count : 1));
+	for(int i = 0; i < m->count; i++){
+		m->jobs[i].m = m;
+		m->jobs[i].index = i;
+		pool_submit(&m->pool, chamfer_worker, &m->jobs[i]);
+	}
+	pool_wait(&m->pool);
+
+	int best = -1;
+	for(int i = 0; i < m->count; i++)
+		if(m->results[i].score < m->rejectScore && (best < 0 || m->results[i].score < m->results[best].score))
+			best = i;
+	if(hit){
+		if(best >= 0)
+			*hit = m->results[best];
+		else
+			hit->score = FLT_MAX, hit->index = -1;
+	}
+	return best >= 0 ? m->templates[best].label : -1;
+}
+
+static void chamfer_destroy(ChamferMatcher_t *m)
+{
+	pool_destroy(&m->pool);
+	for(int i = 0; i < m->count; i++)
+		for(int l = 0; l < CHAMFER_LEVELS; l++){
+			free(m->templates[i].points[l]);
+			free(m->templates[i].offsets[l]);
+		}
+	for(int l = 0; l < CHAMFER_LEVELS; l++){
+		free(m->maps[l].d);
+		cvReleaseImage(&m->edges[l]);
+		cvReleaseImage(&m->dist[l]);
+	}
+	pyramid_destroy(&m->pyr);
+	free(m->templates);
+	free(m->jobs);
+	free(m->results);
+	free(m->scratch);
+	m->count = 0;
+}
+
+#endif
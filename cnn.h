@@ -0,0 +1,589 @@
+/* Convolutional Network
+   A compact alternative to the {40000, 500, 500, 4} MLP: a few convolution /
+   max-pool layers learn the spatial structure of the hand on a 50x50 frame
+   (pyramid level 2) and a small dense head picks the posture. The posture
+   network (cnn_postureNet) needs ~1.1M multiply-adds and ~12K weights per
+   frame where the MLP needs ~20M of both.
+
+   Inference runs on one core. A convolution is lowered to a matrix product,
+   im2col lays every k x k patch of the input out as a column and the filters
+   (one per row) multiply the columns with a cache-blocked GEMM whose inner
+   kernel keeps a 4x8 block of the result in SSE registers. Dense layers are
+   SSE dot products.
+
+   Training is plain mini-batch SGD with momentum on the softmax cross
+   entropy, the gradients of a convolution reuse the same GEMM on transposed
+   operands. It is run offline by ConvNet.cpp.
+
+   Idris Soule
+*/
+
+#ifndef CNN_H
+#define CNN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+#include <cv.h>
+#include <emmintrin.h>
+
+#define CNN_MAX_LAYERS 8
+#define CNN_MAGIC      "WMGC"
+#define CNN_GEMM_KC    128 //depth of a block, 4 rows of A and KC x 8 of B stay in L1
+#define CNN_GEMM_NC    512 //columns of a block
+
+typedef enum {CNN_CONV = 0, CNN_POOL, CNN_DENSE} cnnLayerType_t;
+
+typedef struct {
+	cnnLayerType_t type;
+	int inC, inH, inW;
+	int outC, outH, outW;
+	int k;            //kernel (conv) or window (pool) size
+	int relu;
+	int fanIn;        //weights per output, inC * k * k or inputs
+	float *w, *b;     //conv: outC x (inC * k * k), dense: outC x inputs
+	float *dw, *db;   //gradients, training only
+	float *vw, *vb;   //momentum, training only
+	int *argmax;      //pool: input index of each output's maximum
+}CnnLayer_t;
+
+typedef struct {
+	CnnLayer_t layers[CNN_MAX_LAYERS];
+	int numLayers;
+	int inC, inH, inW;
+	int numClasses;
+	bool training;
+
+	float *act[CNN_MAX_LAYERS + 1];  //act[0] is the input, act[l + 1] the output of layer l
+	float *grad[CNN_MAX_LAYERS + 1]; //d loss / d act, training only
+	float *prob;                     //softmax of the last layer
+	float *col, *colT, *wT;          //im2col and transpose scratch
+}CnnNet_t;
+
+static void cnn_destroy(CnnNet_t *net);
+
+/*
+cnn_gemm:
+	C (M x N) = A (M x K) * B (K x N), or C += A * B when @accumulate,
+	all row major with leading dimensions lda, ldb, ldc
+*/
+static void cnn_gemm(int M, int N, int K, const float *A, int lda, const float *B, int ldb,
+					 float *C, int ldc, bool accumulate)
+{
+	if(!accumulate)
+		for(int i = 0; i < M; i++)
+			memset(C + i * ldc, 0, sizeof(float) * N);
+
+	for(int kk = 0; kk < K; kk += CNN_GEMM_KC){
+		const int kEnd = MIN(kk + CNN_GEMM_KC, K);
+		for(int jj = 0; jj < N; jj += CNN_GEMM_NC){
+			const int jEnd = MIN(jj + CNN_GEMM_NC, N), j8 = jj + ((jEnd - jj) & ~7);
+			int i = 0;
+			for(; i + 4 <= M; i += 4){
+				float *c0 = C + i * ldc, *c1 = c0 + ldc, *c2 = c1 + ldc, *c3 = c2 + ldc;
+				const float *a0 = A + i * lda, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+				for(int j = jj; j < j8; j += 8){
+					__m128 r00 = _mm_loadu_ps(c0 + j), r01 = _mm_loadu_ps(c0 + j + 4);
+					__m128 r10 = _mm_loadu_ps(c1 + j), r11 = _mm_loadu_ps(c1 + j + 4);
+					__m128 r20 = _mm_loadu_ps(c2 + j), r21 = _mm_loadu_ps(c2 + j + 4);
+					__m128 r30 = _mm_loadu_ps(c3 + j), r31 = _mm_loadu_ps(c3 + j + 4);
+					for(int k = kk; k < kEnd; k++){
+						const __m128 b0 = _mm_loadu_ps(B + k * ldb + j), b1 = _mm_loadu_ps(B + k * ldb + j + 4);
+						__m128 a = _mm_set1_ps(a0[k]);
+						r00 = _mm_add_ps(r00, _mm_mul_ps(a, b0)), r01 = _mm_add_ps(r01, _mm_mul_ps(a, b1));
+						a = _mm_set1_ps(a1[k]);
+						r10 = _mm_add_ps(r10, _mm_mul_ps(a, b0)), r11 = _mm_add_ps(r11, _mm_mul_ps(a, b1));
+						a = _mm_set1_ps(a2[k]);
+						r20 = _mm_add_ps(r20, _mm_mul_ps(a, b0)), r21 = _mm_add_ps(r21, _mm_mul_ps(a, b1));
+						a = _mm_set1_ps(a3[k]);
+						r30 = _mm_add_ps(r30, _mm_mul_ps(a, b0)), r31 = _mm_add_ps(r31, _mm_mul_ps(a, b1));
+					}
+					_mm_storeu_ps(c0 + j, r00), _mm_storeu_ps(c0 + j + 4, r01);
+					_mm_storeu_ps(c1 + j, r10), _mm_storeu_ps(c1 + j + 4, r11);
+					_mm_storeu_ps(c2 + j, r20), _mm_storeu_ps(c2 + j + 4, r21);
+					_mm_storeu_ps(c3 + j, r30), _mm_storeu_ps(c3 + j + 4, r31);
+				}
+			}
+			/* rows past the last 4 and columns past the last 8 */
+			for(int r = 0; r < M; r++){
+				const int j0 = r < i ? j8 : jj;
+				for(int k = kk; k < kEnd; k++){
+					const float a = A[r * lda + k];
+					for(int j = j0; j < jEnd; j++)
+						C[r * ldc + j] += a * B[k * ldb + j];
+				}
+			}
+		}
+	}
+}
+
+/* cnn_dot: SSE dot product */
+static inline float cnn_dot(const float *a, const float *b, int n)
+{
+	__m128 acc = _mm_setzero_ps();
+	int i = 0;
+	for(; i + 4 <= n; i += 4)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+	CV_DECL_ALIGNED(16) float s[4];
+	_mm_store_ps(s, acc);
+	float sum = (s[0] + s[1]) + (s[2] + s[3]);
+	for(; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+/* cnn_transpose: dst (cols x rows) = src (rows x cols)' */
+static void cnn_transpose(const float *src, int rows, int cols, float *dst)
+{
+	for(int r = 0; r < rows; r++)
+		for(int c = 0; c < cols; c++)
+			dst[c * rows + r] = src[r * cols + c];
+}
+
+/* cnn_im2col: (C x H x W) => (C * k * k) x (outH * outW), valid convolution with stride 1 */
+static void cnn_im2col(const float *src, int C, int H, int Wd, int k, float *col)
+{
+	const int outH = H - k + 1, outW = Wd - k + 1;
+	for(int c = 0; c < C; c++)
+		for(int ky = 0; ky < k; ky++)
+			for(int kx = 0; kx < k; kx++){
+				float *dst = col + ((c * k + ky) * k + kx) * outH * outW;
+				for(int y = 0; y < outH; y++)
+					memcpy(dst + y * outW, src + (c * H + y + ky) * Wd + kx, sizeof(float) * outW);
+			}
+}
+
+/* cnn_col2im: adds the columns back onto their pixels, the adjoint of cnn_im2col */
+static void cnn_col2im(const float *col, int C, int H, int Wd, int k, float *dst)
+{
+	const int outH = H - k + 1, outW = Wd - k + 1;
+	for(int c = 0; c < C; c++)
+		for(int ky = 0; ky < k; ky++)
+			for(int kx = 0; kx < k; kx++){
+				const float *src = col + ((c * k + ky) * k + kx) * outH * outW;
+				for(int y = 0; y < outH; y++){
+					float *row = dst + (c * H + y + ky) * Wd + kx;
+					for(int x = 0; x < outW; x++)
+						row[x] += src[y * outW + x];
+				}
+			}
+}
+
+/* cnn_initialize: an empty network taking C x H x W inputs */
+static void cnn_initialize(CnnNet_t *net, int C, int H, int Wd)
+{
+	memset(net, 0, sizeof(*net));
+	net->inC = C, net->inH = H, net->inW = Wd;
+}
+
+static CnnLayer_t * cnn_addLayer(CnnNet_t *net, cnnLayerType_t type)
+{
+	assert(net->numLayers < CNN_MAX_LAYERS);
+	CnnLayer_t *l = &net->layers[net->numLayers];
+	memset(l, 0, sizeof(*l));
+	l->type = type;
+	if(net->numLayers){
+		const CnnLayer_t *prev = l - 1;
+		l->inC = prev->outC, l->inH = prev->outH, l->inW = prev->outW;
+	}
+	else
+		l->inC = net->inC, l->inH = net->inH, l->inW = net->inW;
+	net->numLayers++;
+	return l;
+}
+
+/* cnn_addConv: @filters k x k valid convolutions followed by a ReLU */
+static void cnn_addConv(CnnNet_t *net, int filters, int k)
+{
+	CnnLayer_t *l = cnn_addLayer(net, CNN_CONV);
+	l->k = k;
+	l->outC = filters, l->outH = l->inH - k + 1, l->outW = l->inW - k + 1;
+	l->fanIn = l->inC * k * k;
+	l->relu = 1;
+}
+
+/* cnn_addPool: non-overlapping @size x @size max pooling */
+static void cnn_addPool(CnnNet_t *net, int size)
+{
+	CnnLayer_t *l = cnn_addLayer(net, CNN_POOL);
+	l->k = size;
+	l->outC = l->inC, l->outH = l->inH / size, l->outW = l->inW / size;
+}
+
+/* cnn_addDense: fully connected, the last one gives the class scores (no ReLU) */
+static void cnn_addDense(CnnNet_t *net, int outputs, bool relu)
+{
+	CnnLayer_t *l = cnn_addLayer(net, CNN_DENSE);
+	l->fanIn = l->inC * l->inH * l->inW;
+	l->outC = outputs, l->outH = l->outW = 1;
+	l->relu = relu;
+}
+
+static inline int cnn_size(int c, int h, int w) { return c * h * w; }
+
+static int cnn_weightCount(const CnnLayer_t *l)
+{
+	return l->type == CNN_POOL ? 0 : l->outC * l->fanIn;
+}
+
+/*
+cnn_allocate:
+	Allocates the buffers once the layers are added, weights are drawn He
+	uniform from @seed (a loaded model overwrites them)
+
+	@training: also allocates gradients and momentum
+*/
+static void cnn_allocate(CnnNet_t *net, bool training, uint64 seed)
+{
+	CvRNG rng = cvRNG(seed);
+	int colSize = 1, wSize = 1;
+	net->training = training;
+	net->act[0] = (float *)calloc(cnn_size(net->inC, net->inH, net->inW), sizeof(float));
+	if(training)
+		net->grad[0] = (float *)calloc(cnn_size(net->inC, net->inH, net->inW), sizeof(float));
+
+	for(int i = 0; i < net->numLayers; i++){
+		CnnLayer_t *l = &net->layers[i];
+		const int outSize = cnn_size(l->outC, l->outH, l->outW), n = cnn_weightCount(l);
+		net->act[i + 1] = (float *)calloc(outSize, sizeof(float));
+		if(training)
+			net->grad[i + 1] = (float *)calloc(outSize, sizeof(float));
+		if(l->type == CNN_POOL){
+			l->argmax = (int *)calloc(outSize, sizeof(int));
+			continue;
+		}
+		l->w = (float *)malloc(sizeof(float) * n);
+		l->b = (float *)calloc(l->outC, sizeof(float));
+		const double limit = sqrt(6.0 / l->fanIn);
+		for(int j = 0; j < n; j++)
+			l->w[j] = (float)((2 * cvRandReal(&rng) - 1) * limit);
+		if(training){
+			l->dw = (float *)calloc(n, sizeof(float));
+			l->db = (float *)calloc(l->outC, sizeof(float));
+			l->vw = (float *)calloc(n, sizeof(float));
+			l->vb = (float *)calloc(l->outC, sizeof(float));
+		}
+		if(l->type == CNN_CONV){
+			colSize = MAX(colSize, l->fanIn * l->outH * l->outW);
+			wSize = MAX(wSize, n);
+		}
+	}
+	net->numClasses = net->layers[net->numLayers - 1].outC;
+	net->prob = (float *)calloc(net->numClasses, sizeof(float));
+	net->col = (float *)malloc(sizeof(float) * colSize);
+	if(training){
+		net->colT = (float *)malloc(sizeof(float) * colSize);
+		net->wT = (float *)malloc(sizeof(float) * wSize);
+	}
+}
+
+/*
+cnn_postureNet:
+	50x50 frame => conv 5x5 x8, pool 2 => conv 3x3 x16, pool 2 => conv 3x3 x16,
+	pool 2 => dense 32 => dense @numClasses
+*/
+static void cnn_postureNet(CnnNet_t *net, int numClasses, bool training, uint64 seed)
+{
+	cnn_initialize(net, 1, 50, 50);
+	cnn_addConv(net, 8, 5);  //8 x 46 x 46
+	cnn_addPool(net, 2);     //8 x 23 x 23
+	cnn_addConv(net, 16, 3); //16 x 21 x 21
+	cnn_addPool(net, 2);     //16 x 10 x 10
+	cnn_addConv(net, 16, 3); //16 x 8 x 8
+	cnn_addPool(net, 2);     //16 x 4 x 4
+	cnn_addDense(net, 32, true);
+	cnn_addDense(net, numClasses, false);
+	cnn_allocate(net, training, seed);
+}
+
+/* cnn_cost: multiply-adds of a forward pass and number of parameters */
+static void cnn_cost(const CnnNet_t *net, long *macs, long *params)
+{
+	*macs = *params = 0;
+	for(int i = 0; i < net->numLayers; i++){
+		const CnnLayer_t *l = &net->layers[i];
+		*macs += (long)cnn_weightCount(l) * (l->type == CNN_CONV ? l->outH * l->outW : 1);
+		*params += cnn_weightCount(l) + (l->type == CNN_POOL ? 0 : l->outC);
+	}
+}
+
+static void cnn_forwardLayer(CnnNet_t *net, int i)
+{
+	CnnLayer_t *l = &net->layers[i];
+	const float *in = net->act[i];
+	float *out = net->act[i + 1];
+	const int N = l->outH * l->outW;
+
+	switch(l->type){
+		case CNN_CONV:
+			cnn_im2col(in, l->inC, l->inH, l->inW, l->k, net->col);
+			cnn_gemm(l->outC, N, l->fanIn, l->w, l->fanIn, net->col, N, out, N, false);
+			for(int c = 0; c < l->outC; c++)
+				for(int j = 0; j < N; j++)
+					out[c * N + j] = MAX(out[c * N + j] + l->b[c], 0.0f);
+			break;
+		case CNN_POOL:
+			for(int c = 0; c < l->outC; c++)
+				for(int y = 0; y < l->outH; y++)
+					for(int x = 0; x < l->outW; x++){
+						int best = (c * l->inH + y * l->k) * l->inW + x * l->k;
+						for(int dy = 0; dy < l->k; dy++)
+							for(int dx = 0; dx < l->k; dx++){
+								const int j = (c * l->inH + y * l->k + dy) * l->inW + x * l->k + dx;
+								if(in[j] > in[best])
+									best = j;
+							}
+						const int o = (c * l->outH + y) * l->outW + x;
+						out[o] = in[best];
+						l->argmax[o] = best;
+					}
+			break;
+		case CNN_DENSE:
+			for(int o = 0; o < l->outC; o++){
+				const float v = cnn_dot(l->w + o * l->fanIn, in, l->fanIn) + l->b[o];
+				out[o] = l->relu ? MAX(v, 0.0f) : v;
+			}
+			break;
+	}
+}
+
+/*
+cnn_forward:
+	@input: inC x inH x inW floats, i.e a frame on [0,1]
+	@return: class probabilities (softmax), valid until the next call
+*/
+static const float * cnn_forward(CnnNet_t *net, const float *input)
+{
+	memcpy(net->act[0], input, sizeof(float) * cnn_size(net->inC, net->inH, net->inW));
+	for(int i = 0; i < net->numLayers; i++)
+		cnn_forwardLayer(net, i);
+
+	const float *z = net->act[net->numLayers];
+	float top = -FLT_MAX, sum = 0;
+	for(int c = 0; c < net->numClasses; c++)
+		top = MAX(top, z[c]);
+	for(int c = 0; c < net->numClasses; c++)
+		sum += net->prob[c] = expf(z[c] - top);
+	for(int c = 0; c < net->numClasses; c++)
+		net->prob[c] /= sum;
+	return net->prob;
+}
+
+/* cnn_predict: @return: most probable class of the input */
+static int cnn_predict(CnnNet_t *net, const float *input)
+{
+	const float *p = cnn_forward(net, input);
+	int best = 0;
+	for(int c = 1; c < net->numClasses; c++)
+		if(p[c] > p[best])
+			best = c;
+	return best;
+}
+
+/* cnn_frameInput: 8-bit frame of the input size => floats on [0,1] */
+static void cnn_frameInput(const IplImage *img, float *input)
+{
+	for(int y = 0; y < img->height; y++){
+		const uchar *row = (const uchar *)img->imageData + y * img->widthStep;
+		for(int x = 0; x < img->width; x++)
+			input[y * img->width + x] = row[x] * (1.0f / 255);
+	}
+}
+
+static void cnn_backwardLayer(CnnNet_t *net, int i)
+{
+	CnnLayer_t *l = &net->layers[i];
+	const float *in = net->act[i], *out = net->act[i + 1];
+	float *dOut = net->grad[i + 1], *dIn = net->grad[i];
+	const int N = l->outH * l->outW, inSize = cnn_size(l->inC, l->inH, l->inW);
+	const bool needInput = i > 0;
+
+	if(l->relu)
+		for(int j = 0; j < l->outC * N; j++)
+			if(out[j] <= 0)
+				dOut[j] = 0;
+	if(needInput)
+		memset(dIn, 0, sizeof(float) * inSize);
+
+	switch(l->type){
+		case CNN_CONV:
+			/* dW += dOut (outC x N) * col' (N x fanIn), dCol = W' (fanIn x outC) * dOut */
+			cnn_im2col(in, l->inC, l->inH, l->inW, l->k, net->col);
+			cnn_transpose(net->col, l->fanIn, N, net->colT);
+			cnn_gemm(l->outC, l->fanIn, N, dOut, N, net->colT, l->fanIn, l->dw, l->fanIn, true);
+			for(int c = 0; c < l->outC; c++)
+				for(int j = 0; j < N; j++)
+					l->db[c] += dOut[c * N + j];
+			if(needInput){
+				cnn_transpose(l->w, l->outC, l->fanIn, net->wT);
+				cnn_gemm(l->fanIn, N, l->outC, net->wT, l->outC, dOut, N, net->col, N, false);
+				cnn_col2im(net->col, l->inC, l->inH, l->inW, l->k, dIn);
+			}
+			break;
+		case CNN_POOL:
+			for(int j = 0; j < l->outC * N; j++)
+				dIn[l->argmax[j]] += dOut[j];
+			break;
+		case CNN_DENSE:
+			for(int o = 0; o < l->outC; o++){
+				const float g = dOut[o];
+				if(g == 0)
+					continue;
+				float *dw = l->dw + o * l->fanIn;
+				const float *w = l->w + o * l->fanIn;
+				for(int j = 0; j < l->fanIn; j++)
+					dw[j] += g * in[j];
+				l->db[o] += g;
+				if(needInput)
+					for(int j = 0; j < l->fanIn; j++)
+						dIn[j] += g * w[j];
+			}
+			break;
+	}
+}
+
+/*
+cnn_backward:
+	Accumulates the gradients of the cross entropy of the last cnn_forward
+
+	@label: true class of the input
+	@return: the loss, -log p(label)
+*/
+static float cnn_backward(CnnNet_t *net, int label)
+{
+	assert(net->training && label >= 0 && label < net->numClasses);
+	float *dz = net->grad[net->numLayers];
+	for(int c = 0; c < net->numClasses; c++)
+		dz[c] = net->prob[c] - (c == label);
+	for(int i = net->numLayers - 1; i >= 0; i--)
+		cnn_backwardLayer(net, i);
+	return -logf(MAX(net->prob[label], 1e-12f));
+}
+
+/*
+cnn_step:
+	SGD with momentum over the gradients accumulated since the last step, clears them
+
+	@batch: samples accumulated, the gradients are averaged
+*/
+static void cnn_step(CnnNet_t *net, float rate, float momentum, float decay, int batch)
+{
+	const float scale = 1.0f / batch;
+	for(int i = 0; i < net->numLayers; i++){
+		CnnLayer_t *l = &net->layers[i];
+		if(l->type == CNN_POOL)
+			continue;
+		const int n = cnn_weightCount(l);
+		for(int j = 0; j < n; j++){
+			l->vw[j] = momentum * l->vw[j] - rate * (l->dw[j] * scale + decay * l->w[j]);
+			l->w[j] += l->vw[j];
+		}
+		for(int j = 0; j < l->outC; j++){
+			l->vb[j] = momentum * l->vb[j] - rate * l->db[j] * scale;
+			l->b[j] += l->vb[j];
+		}
+		memset(l->dw, 0, sizeof(float) * n);
+		memset(l->db, 0, sizeof(float) * l->outC);
+	}
+}
+
+/*
+cnn_save:
+	Layer shapes then the weights and biases of every layer
+	@return: false on I/O error
+*/
+static bool cnn_save(const CnnNet_t *net, const char *path)
+{
+	FILE *out = fopen(path, "wb");
+	if(!out){
+		perror(path);
+		return false;
+	}
+	int header[4] = {net->numLayers, net->inC, net->inH, net->inW};
+	bool ok = fwrite(CNN_MAGIC, 4, 1, out) == 1 && fwrite(header, sizeof(header), 1, out) == 1;
+	for(int i = 0; i < net->numLayers && ok; i++){
+		const CnnLayer_t *l = &net->layers[i];
+		int spec[4] = {l->type, l->outC, l->k, l->relu};
+		ok = fwrite(spec, sizeof(spec), 1, out) == 1;
+	}
+	for(int i = 0; i < net->numLayers && ok; i++){
+		const CnnLayer_t *l = &net->layers[i];
+		const int n = cnn_weightCount(l);
+		if(n)
+			ok = fwrite(l->w, sizeof(float), n, out) == (size_t)n &&
+				 fwrite(l->b, sizeof(float), l->outC, out) == (size_t)l->outC;
+	}
+	ok = fclose(out) == 0 && ok;
+	if(!ok)
+		fprintf(stderr, "Error: Couldn't write %s!\n", path);
+	return ok;
+}
+
+/*
+cnn_load:
+	Rebuilds the network saved by cnn_save
+	@return: false if missing or not a network
+*/
+static bool cnn_load(CnnNet_t *net, const char *path, bool training)
+{
+	FILE *in = fopen(path, "rb");
+	if(!in)
+		return false;
+	char magic[4];
+	int header[4];
+	bool ok = fread(magic, 4, 1, in) == 1 && !memcmp(magic, CNN_MAGIC, 4) &&
+			  fread(header, sizeof(header), 1, in) == 1 && header[0] > 0 && header[0] <= CNN_MAX_LAYERS;
+	if(ok){
+		cnn_initialize(net, header[1], header[2], header[3]);
+		for(int i = 0; i < header[0] && ok; i++){
+			int spec[4];
+			if(!(ok = fread(spec, sizeof(spec), 1, in) == 1))
+				break;
+			if(spec[0] == CNN_CONV)
+				cnn_addConv(net, spec[1], spec[2]);
+			else if(spec[0] == CNN_POOL)
+				cnn_addPool(net, spec[2]);
+			else
+				cnn_addDense(net, spec[1], spec[3] != 0);
+		}
+	}
+	const bool allocated = ok;
+	if(ok){
+		cnn_allocate(net, training, 1);
+		for(int i = 0; i < net->numLayers && ok; i++){
+			CnnLayer_t *l = &net->layers[i];
+			const int n = cnn_weightCount(l);
+			if(n)
+				ok = fread(l->w, sizeof(float), n, in) == (size_t)n &&
+					 fread(l->b, sizeof(float), l->outC, in) == (size_t)l->outC;
+		}
+	}
+	fclose(in);
+	if(!ok){
+		fprintf(stderr, "Error: %s is not a posture network!\n", path);
+		if(allocated)
+			cnn_destroy(net);
+	}
+	return ok;
+}
+
+static void cnn_destroy(CnnNet_t *net)
+{
+	for(int i = 0; i < net->numLayers; i++){
+		CnnLayer_t *l = &net->layers[i];
+		free(l->w), free(l->b), free(l->dw), free(l->db), free(l->vw), free(l->vb);
+		free(l->argmax);
+	}
+	for(int i = 0; i <= net->numLayers; i++){
+		free(net->act[i]);
+		free(net->grad[i]);
+	}
+	free(net->prob);
+	free(net->col), free(net->colT), free(net->wT);
+	memset(net, 0, sizeof(*net));
+}
+
+#endif
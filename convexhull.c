@@ -20,6 +20,8 @@
 #define KEY_ESC 27
 #define KEY_NOTPRESSED 0
 #define MAX_NUM_CAMERAS 3
+#define POSTURE_INDEX "postures.kdt" //DatasetTool shapes
+#define POSTURE_K 5
 
 #pragma warning(disable:4716) //disable missing return from function error 
 
@@ -27,6 +29,9 @@ int key = KEY_NOTPRESSED;
 pthread_mutex_t keyMutex;
 
 OpenCV_Test tsuite;
+AdaptiveThreshold_t contourThreshold; //camera 2 frames, level follows the IR illumination
+BackgroundModel_t contourBackground;  //static reflections of camera 2
+ShapeIndex_t postureIndex;            //Hu descriptors of the captured postures
 
 typedef struct {
 	unsigned int i;
@@ -76,30 +81,21 @@ IplImage * compute_ContourTree(IplImage *img_8uc1)
 	CvSeq *ptSeq = NULL; //point sequence
 	CvMemStorage *storage = cvCreateMemStorage(); //storage for contours creation
 	
-	cvThreshold(img_8uc1, img_edge, 128, 255, CV_THRESH_BINARY);
-
+	/* the largest contour is the whole hand, found as in the posture index build */
 	CvSeq *c, *first_contour = NULL;
-	CvSeq *biggestContour = NULL;
-	int numContours = cvFindContours(img_edge,storage,&first_contour, sizeof(CvContour), CV_RETR_LIST);
+	CvSeq *biggestContour = shape_handContour(&contourThreshold, img_8uc1, img_edge, storage, &first_contour);
 
-	if(numContours == 0)
+	if(first_contour == NULL)
 		return NULL;
-	/*
-	double result1, result2;
-	result1 = result2 = 0;
-
-	// find the largest contour 
-	  // this is the whole hand
-	
-	for(c = first_contour; c != NULL; c=c->h_next){
-		result1 = cvContourArea(c,CV_WHOLE_SEQ);
-		
-		if(result1 > result2){
-			result2 = result1;
-			biggestContour = c;
-		}
+	int posture = SHAPE_NONE;
+	float descriptor[SHAPE_DIMS];
+	if(biggestContour && postureIndex.count){
+		CvMemStorage *scratch = cvCreateChildMemStorage(storage);
+		if(shape_describeContour(biggestContour, scratch, descriptor))
+			posture = shape_classify(&postureIndex, descriptor, POSTURE_K);
+		cvReleaseMemStorage(&scratch);
 	}
-	*/
+
 	for(c = first_contour; c != NULL; c=c->h_next){
 	cvCvtColor(img_8uc1, img_8uc3, CV_GRAY2BGR);
 	cvDrawContours(img_8uc3,c,CVX_RED,CVX_BLUE, 1,1,8); //note define (CVX...) if not including ocv.h
@@ -116,6 +112,14 @@ IplImage * compute_ContourTree(IplImage *img_8uc1)
 	}
 	cvShowImage("CONVEX WINDOW", img_8uc3);
 	}
+
+	if(posture != SHAPE_NONE){
+		char text[16];
+		CvFont font;
+		cvInitFont(&font, CV_FONT_HERSHEY_SIMPLEX, 1.0, 1.0);
+		sprintf(text, "%dpose", posture);
+		cvPutText(img_8uc3, text, cvPoint(10, 30), &font, CV_RGB(255, 255, 0));
+	}
 	
 	/*Convexctx_t *retCtx = (Convexctx_t *)malloc(sizeof(*retCtx));
 	retCtx->image = img_8uc3;
@@ -167,6 +171,7 @@ void *showCameraWindow(void *arg)
 	CameraData_t *myCam = (CameraData_t *)arg; 
 	Convexctx_t *cameraCtx;
 	IplImage *img = NULL;
+	IplImage *foreground = cvCreateImage(cvSize(W,H), IPL_DEPTH_8U, 1);
 	const char *windowName = TT_CameraName(myCam->i);
 
 	cvNamedWindow(windowName,CV_WINDOW_AUTOSIZE);
@@ -176,7 +181,8 @@ void *showCameraWindow(void *arg)
 		
 		pthread_mutex_lock(&keyMutex);
 		if(myCam->i == 2){
-		img = compute_ContourTree(myCam->displayImage);
+		background_apply(&contourBackground, myCam->displayImage, foreground);
+		img = compute_ContourTree(foreground);
 		if(img)
 			cvShowImage(windowName, img);
 		else
@@ -190,6 +196,7 @@ void *showCameraWindow(void *arg)
 			cvShowImage(windowName, myCam->displayImage);
 		pthread_mutex_unlock(&keyMutex);
 	}
+	cvReleaseImage(&foreground);
 	cvReleaseImage(&myCam->displayImage);
 	pthread_exit(NULL);
 }
@@ -208,6 +215,11 @@ int main()
 	pthread_t threads[MAX_NUM_CAMERAS]; 
 	
 	assert(MAX_NUM_CAMERAS == cameraCount);
+	shape_thresholdInitialize(&contourThreshold);
+	background_initialize(&contourBackground, cvSize(W,H), 5, 9, SHAPE_BG_MARGIN);
+	shape_indexInitialize(&postureIndex);
+	if(shape_indexLoad(&postureIndex, POSTURE_INDEX))
+		printf("Posture index: %d shapes\n", postureIndex.count);
 
 	TT_SetCameraSettings(0, NPVIDEOTYPE_PRECISION,300, 150, 15);
 	TT_SetCameraSettings(1, NPVIDEOTYPE_PRECISION,300, 150, 15);
@@ -244,6 +256,8 @@ int main()
 		pthread_join(threads[i], NULL);
 	
 	pthread_mutex_destroy(&keyMutex);
+	background_destroy(&contourBackground);
+	shape_indexDestroy(&postureIndex);
 	cvDestroyAllWindows();
 	TT_Shutdown();
 	TT_FinalCleanup();
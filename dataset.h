@@ -0,0 +1,338 @@
+/* Posture Dataset Utilities
+   Walking a pose directory (Postures/<n>pose) and bulk preprocessing of its
+   frames on the worker pool.
+
+   dataset_convertGray decodes, converts and re-encodes every frame in parallel
+   with at most three frames per worker in flight (being loaded, being encoded
+   and one queued). Each finished frame is recorded in a journal inside the
+   directory so an interrupted run resumes where it stopped. Frames are written
+   to a temporary file and renamed over the original, so a crash never leaves a
+   truncated JPEG behind, the next conversion deletes such leftovers first.
+
+   Idris Soule
+*/
+
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <cv.h>
+#include <highgui.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#define PATH_SEP '\\'
+#else
+#include <dirent.h>
+#define PATH_SEP '/'
+#endif
+
+#include "pool.h"
+
+#define DATASET_PATH_LEN 260
+#define DATASET_JOURNAL  "convert.done"
+#define DATASET_TEMP     ".tmp"     //<frame>.tmp<worker>.jpg while it is encoded
+
+typedef struct {
+	long converted, skipped, failed;
+	double seconds;
+}DatasetReport_t;
+
+/* dataset_path: joins a directory and a file name */
+static void dataset_path(char *path, const char *dir, const char *name)
+{
+	size_t n = strlen(dir);
+	if(n && (dir[n - 1] == '\\' || dir[n - 1] == '/'))
+		sprintf(path, "%s%s", dir, name);
+	else
+		sprintf(path, "%s%c%s", dir, PATH_SEP, name);
+}
+
+/* dataset_frameNumber: <pose>-<n>.jpg => n, frames are ordered by it */
+static int dataset_frameNumber(const char *name)
+{
+	const char *dash = strrchr(name, '-');
+	return dash ? atoi(dash + 1) : 0;
+}
+
+static int dataset_sortFrames(const void *a, const void *b)
+{
+	const char *x = *(const char **)a, *y = *(const char **)b;
+	int d = dataset_frameNumber(x) - dataset_frameNumber(y);
+	return d ? d : strcmp(x, y);
+}
+
+/* dataset_isTemp: a frame being re-encoded, or left over by an interrupted conversion */
+static bool dataset_isTemp(const char *name)
+{
+	return strstr(name, DATASET_TEMP) != NULL;
+}
+
+static bool dataset_isFrame(const char *name)
+{
+	size_t n = strlen(name);
+	return n > 4 && (!strcmp(name + n - 4, ".jpg") || !strcmp(name + n - 4, ".JPG")) &&
+		   !dataset_isTemp(name);
+}
+
+/*
+dataset_list:
+	Lists the frames (*.jpg) of a pose directory ordered by frame number,
+	anything else (Thumbs.db, journals, temporary frames) is ignored
+
+	@names: receives the file names, release with dataset_freeList
+	@return: number of frames, -1 if the directory can't be read
+*/
+static int dataset_list(const char *dir, char ***names)
+{
+	int n = 0, cap = 1024;
+	*names = (char **)malloc(sizeof(char *) * cap);
+
+#if defined(_WIN32)
+	char pattern[DATASET_PATH_LEN];
+	WIN32_FIND_DATAA fd;
+	dataset_path(pattern, dir, "*.jpg");
+	HANDLE h = FindFirstFileA(pattern, &fd);
+	if(h == INVALID_HANDLE_VALUE){
+		free(*names);
+		*names = NULL;
+		return GetLastError() == ERROR_FILE_NOT_FOUND ? 0 : -1;
+	}
+	do {
+		const char *name = fd.cFileName;
+#else
+	DIR *d = opendir(dir);
+	if(!d){
+		free(*names);
+		*names = NULL;
+		return -1;
+	}
+	for(struct dirent *e; (e = readdir(d)) != NULL; ){
+		const char *name = e->d_name;
+#endif
+		if(dataset_isFrame(name)){
+			if(n == cap)
+				*names = (char **)realloc(*names, sizeof(char *) * (cap *= 2));
+			(*names)[n++] = strdup(name);
+		}
+#if defined(_WIN32)
+	} while(FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	}
+	closedir(d);
+#endif
+
+	qsort(*names, n, sizeof(char *), &dataset_sortFrames);
+	return n;
+}
+
+static void dataset_freeList(char **names, int n)
+{
+	for(int i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+}
+
+/* dataset_replace: renames tmp over path */
+static bool dataset_replace(const char *tmp, const char *path)
+{
+#if defined(_WIN32)
+	return MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(tmp, path) == 0;
+#endif
+}
+
+/* state shared by the conversion tasks */
+typedef struct {
+	const char *dir;
+	FILE *journal;
+	pthread_mutex_t lock;
+	DatasetReport_t report;
+	int64 start;
+	long reportEvery;
+}DatasetConvert_t;
+
+typedef struct {
+	DatasetConvert_t *job;
+	char name[DATASET_PATH_LEN];
+}DatasetFrame_t;
+
+static void dataset_grayTask(void *arg, int worker)
+{
+	DatasetFrame_t *frame = (DatasetFrame_t *)arg;
+	DatasetConvert_t *job = frame->job;
+	char path[DATASET_PATH_LEN], tmp[DATASET_PATH_LEN + 16];
+	enum {CONVERTED, SKIPPED, FAILED} result = FAILED;
+
+	dataset_path(path, job->dir, frame->name);
+	sprintf(tmp, "%s" DATASET_TEMP "%d.jpg", path, worker); //keep the extension for the encoder
+
+	IplImage *src = cvLoadImage(path, CV_LOAD_IMAGE_UNCHANGED);
+	if(!src)
+		fprintf(stderr, "Error: Couldn't open %s!\n", path);
+	else if(src->nChannels == 1)
+		result = SKIPPED; //already grey, don't re-encode
+	else {
+		IplImage *dst = cvCreateImage(cvGetSize(src), IPL_DEPTH_8U, 1);
+		cvCvtColor(src, dst, src->nChannels == 4 ? CV_BGRA2GRAY : CV_BGR2GRAY);
+		if(cvSaveImage(tmp, dst) && dataset_replace(tmp, path))
+			result = CONVERTED;
+		else {
+			fprintf(stderr, "Error: Couldn't write %s!\n", path);
+			remove(tmp);
+		}
+		cvReleaseImage(&dst);
+	}
+	cvReleaseImage(&src);
+
+	pthread_mutex_lock(&job->lock);
+	if(result == FAILED)
+		job->report.failed++;
+	else {
+		if(result == CONVERTED)
+			job->report.converted++;
+		else
+			job->report.skipped++;
+		fprintf(job->journal, "%s\n", frame->name);
+	}
+	long done = job->report.converted + job->report.skipped + job->report.failed;
+	if(job->reportEvery && done % job->reportEvery == 0){
+		double s = (cvGetTickCount() - job->start) / (cvGetTickFrequency() * 1e6);
+		printf("%s: %ld frames, %.1f frames/s\n", job->dir, done, done / s);
+	}
+	pthread_mutex_unlock(&job->lock);
+	free(frame);
+}
+
+/* dataset_loadJournal: names of frames finished by a previous run */
+static int dataset_loadJournal(const char *dir, char ***done)
+{
+	char path[DATASET_PATH_LEN], line[DATASET_PATH_LEN];
+	int n = 0, cap = 256;
+
+	dataset_path(path, dir, DATASET_JOURNAL);
+	*done = (char **)malloc(sizeof(char *) * cap);
+	FILE *in = fopen(path, "r");
+	if(!in)
+		return 0;
+	while(fgets(line, sizeof(line), in)){
+		line[strcspn(line, "\r\n")] = '\0';
+		if(!*line)
+			continue;
+		if(n == cap)
+			*done = (char **)realloc(*done, sizeof(char *) * (cap *= 2));
+		(*done)[n++] = strdup(line);
+	}
+	fclose(in);
+	qsort(*done, n, sizeof(char *), &dataset_sortFrames);
+	return n;
+}
+
+/* dataset_removeTemps: deletes the temporary frames an interrupted conversion left in @dir */
+static void dataset_removeTemps(const char *dir)
+{
+	char path[DATASET_PATH_LEN];
+#if defined(_WIN32)
+	WIN32_FIND_DATAA fd;
+	dataset_path(path, dir, "*" DATASET_TEMP "*");
+	HANDLE h = FindFirstFileA(path, &fd);
+	if(h == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		const char *name = fd.cFileName;
+#else
+	DIR *d = opendir(dir);
+	if(!d)
+		return;
+	for(struct dirent *e; (e = readdir(d)) != NULL; ){
+		const char *name = e->d_name;
+#endif
+		if(dataset_isTemp(name)){
+			dataset_path(path, dir, name);
+			remove(path);
+		}
+#if defined(_WIN32)
+	} while(FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	}
+	closedir(d);
+#endif
+}
+
+/*
+dataset_convertGray:
+	Converts every frame of a pose directory to 8-bit grey in place
+
+	@dir: pose directory i.e "Postures\\1pose"
+	@numThreads: workers (<= 0 uses one per processor)
+	@report: receives the counts and the time taken (may be NULL)
+	@return: false if the directory couldn't be read or a frame failed
+*/
+static bool dataset_convertGray(const char *dir, int numThreads, DatasetReport_t *report)
+{
+	char **names, **done;
+	char path[DATASET_PATH_LEN];
+	dataset_removeTemps(dir); //no task of this run exists yet
+	int n = dataset_list(dir, &names);
+	if(n < 0){
+		fprintf(stderr, "Error: Couldn't read directory %s!\n", dir);
+		return false;
+	}
+	int ndone = dataset_loadJournal(dir, &done);
+
+	DatasetConvert_t job;
+	job.dir = dir;
+	job.reportEvery = 1000;
+	memset(&job.report, 0, sizeof(job.report));
+	pthread_mutex_init(&job.lock, NULL);
+	dataset_path(path, dir, DATASET_JOURNAL);
+	job.journal = fopen(path, "a");
+	if(!job.journal){
+		perror(path);
+		dataset_freeList(names, n);
+		dataset_freeList(done, ndone);
+		return false;
+	}
+
+	WorkerPool_t pool;
+	pool_initialize(&pool, numThreads, 2 * (numThreads > 0 ? numThreads : pool_num_processors()));
+	job.start = cvGetTickCount();
+
+	long resumed = 0;
+	for(int i = 0; i < n; i++){
+		if(bsearch(&names[i], done, ndone, sizeof(char *), &dataset_sortFrames)){
+			resumed++;
+			continue;
+		}
+		DatasetFrame_t *frame = (DatasetFrame_t *)malloc(sizeof(DatasetFrame_t));
+		frame->job = &job;
+		strncpy(frame->name, names[i], DATASET_PATH_LEN - 1);
+		frame->name[DATASET_PATH_LEN - 1] = '\0';
+		pool_submit(&pool, dataset_grayTask, frame); //blocks while the queue is full
+	}
+	pool_wait(&pool);
+	pool_destroy(&pool);
+
+	job.report.skipped += resumed;
+	job.report.seconds = (cvGetTickCount() - job.start) / (cvGetTickFrequency() * 1e6);
+	fclose(job.journal);
+	pthread_mutex_destroy(&job.lock);
+	dataset_freeList(names, n);
+	dataset_freeList(done, ndone);
+
+	printf("%s: %ld converted, %ld skipped (%ld resumed), %ld failed in %.2f s (%.1f frames/s)\n",
+		   dir, job.report.converted, job.report.skipped, resumed, job.report.failed, job.report.seconds,
+		   (job.report.converted + job.report.skipped - resumed) / (job.report.seconds > 0 ? job.report.seconds : 1));
+	if(report)
+		*report = job.report;
+	return job.report.failed == 0;
+}
+
+#endif
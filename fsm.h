@@ -3,10 +3,35 @@
    The a priori info allows a single previous state to be identified and determine
    which gesture was recognized.
 
-   Events are emitted to a executor thread (similar to executor pattern), appropriate
-   event threads are started depending on what postures are read from the bounded queue.
-   Event threads only package payload data (mouse events) and the main event_track thread
-   fires the said mouse events by-way of SendInput.
+   Events are emitted to a executor thread (similar to executor pattern), each posture
+   read from the bounded queue is looked up in fsmTable with the current state (the
+   previous posture), the action found there runs inline on that thread and the entry
+   names the next state. Actions mostly package payload data (mouse events), a TRACK
+   fires the said mouse events by-way of the output sink (sink.h), the FSM never calls
+   the OS itself. The FSM thread owns currState, the payload, the timers and the sink,
+   so none of them is locked.
+
+   Every event carries the cursor position at emit time. Consecutive TRACK events
+   are coalesced by the consumer, only the latest position of a run reaches
+   the table so a backlog never replays stale motion. Discrete events (LEFT, RIGHT,
+   DRAG, ZOOM, QUIT) are never coalesced and keep their order.
+
+   The time from fsm_queue_emit to the start of its action (dispatch latency) and
+   the time spent in the action are accumulated in fsmStats.
+
+   With the ring empty the FSM thread spins briefly, then parks on waitCond until a
+   producer (or the click timer) wakes it. The spin adapts: it grows while events
+   keep arriving within it and shrinks each time the thread has to park anyway.
+
+   Timers (the click interval) live in fsmTimers, serviced by the FSM thread itself:
+   it sleeps at most until the next deadline and runs the due callbacks on waking.
+
+   Every time stamp comes from fsmClock. A replay (FSMReplay.cpp) swaps in a virtual
+   clock with fsm_setClock, sets the machine up without its thread (fsm_setup) and
+   steps it with fsm_process and fsm_advance, which makes clicks reproducible.
+
+   After QUIT fsm_queue_emit ignores the events of the camera threads still
+   running, the queue is freed by fsm_destroy once they are joined.
 
    Idris Soule
 */
@@ -15,437 +40,628 @@
 #include <assert.h>
 #include <time.h>
 #include <errno.h>
+#if defined(_WIN32)
 #include <windows.h>
+#endif
 #include <pthread.h>
 
+#include "ring.h"
+#include "timers.h"
+#include "sink.h"
+
 #pragma warning(disable:4716) //disable missing return from function error 
 
-#define MAX_QUEUE_ENTRY   256
-#define NUM_STATES         4
+#define MAX_QUEUE_ENTRY   256 //power of two
+#define FSM_QUEUE_POLICY  RING_COALESCE //a full queue sheds stale TRACK events first
+#define FSM_SPIN_MIN      64    //pause iterations before parking, adaptive between
+#define FSM_SPIN_MAX      16384
+#define FSM_MAX_TIMERS    8
+#define FSM_CLICK_INTERVAL 1375000 //us, window for the second click of a double click
+#define FSM_MAX_BUTTONS   4
+#define FSM_BATCH         64 //events per injection of the default sink
+#define FSM_FRAME         16667 //us, longest a buffering sink holds events under load
 
-extern POINT cursor;
+#if !defined(_WIN32)
+typedef struct {long x, y;} POINT;
+#endif
 
-typedef enum {INITIAL = 0x0A, TIMING, ACCEPTING ,FINAL} stateType_t;
 typedef enum {LEFT = 0x01, RIGHT, ZOOM, TRACK, DRAG, QUIT, NOP} stateEvent_t ;
-typedef enum {TIMER_EXPIRED, TIMER_ALIVE, TIMER_RESET} timerState_t;
+#define FSM_NUM_EVENTS (NOP + 1) //fsmTable is indexed by stateEvent_t, 0 is unused
+
+/* actions of the transition table, run by fsm_apply */
+typedef enum {
+	FSM_NONE = 0,
+	FSM_MOVE,       //TRACK after TRACK: move the cursor
+	FSM_CLICK,      //LEFT after TRACK: arm the click timer, double click if it runs
+	FSM_CLICK_FIRE, //TRACK after LEFT: fire the click once it is known
+	FSM_RIGHT,      //RIGHT after TRACK: right click payload
+	FSM_LEFT_RIGHT, //RIGHT after LEFT: left + right click payload (T L R T)
+	FSM_SEND,       //TRACK after RIGHT: fire the payload
+	FSM_DRAG,       //DRAG, or LEFT while dragging: move, press the button once
+	FSM_DROP,       //TRACK after DRAG: release the button
+	FSM_QUIT
+} fsmAction_t;
+
+typedef struct {
+	fsmAction_t action;
+	stateEvent_t next;
+}FSMTransition_t;
+
+typedef unsigned long long fsmTime_t; //microseconds on a monotonic clock
+
+typedef struct {
+	long dispatched;
+	unsigned refused;                 //events turned away by the full queue
+	unsigned discarded;               //queued TRACK events shed to make room
+	fsmTime_t latencySum, latencyMax; //emit => action start
+	fsmTime_t handlerSum, handlerMax; //time spent in the actions
+	long parks;                       //times the FSM thread slept on an empty queue
+	long coalesced;                   //TRACK events superseded by a newer one before dispatch
+}FSMStats_t;
 
 typedef struct FSMState_t {
-	stateType_t   stateType;
-    stateEvent_t  sEvent, prevEvent;
-    void * (*emit)(void *);
+    stateEvent_t  sEvent, prevEvent; //posture being handled, state (previous posture)
+	POINT cursor;                    //position carried by the event
 	/* payload for mouse events */
-	INPUT mouseEvents[5];
+	sinkAction_t buttons[FSM_MAX_BUTTONS];
 	int numEvents;
 }FSMState_t;
 
-static FSMState_t currState; 
-static timerState_t clickTimer; //timer between successive clicks
-
-static pthread_mutex_t eventLock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER;
-static pthread_mutex_t stateLock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER;
-static pthread_mutex_t timerLock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER;
-static pthread_mutex_t queueLock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER;
+static FSMState_t currState;  //FSM thread only
+static unsigned clickTimer; //id of the timer between successive clicks, 0 if none runs
 
 static pthread_t fsmThread;
-static pthread_cond_t timerCond = PTHREAD_COND_INITIALIZER;
 
-/* Bounded buffer for detector to emit posture */
-static stateEvent_t fsm_event_queue[MAX_QUEUE_ENTRY];
-static int *queueHeadr, *queueTail;
+static OutputSink_t *fsmSink;     //FSM thread only once running
+static OutputSink_t defaultSink, defaultTarget; //used when fsm_initialize gets no sink
+static fsmTime_t lastFlush;
+
+/* parking of the FSM thread on an empty queue */
+static pthread_mutex_t waitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waitCond = PTHREAD_COND_INITIALIZER;
+static volatile unsigned consumerParked = 0; //FSM thread is (about to be) waiting on waitCond
+static int spinBudget = FSM_SPIN_MIN;
+
+/* Lock-free ring for the detectors (any number of camera threads) to emit postures */
+static EventRing_t fsmQueue;
+static volatile unsigned fsmQuit = 0; //QUIT processed, emits are ignored until the next fsm_setup
+
+static bool draggable = false;    //FSM thread only
+static bool clickPending = false; //TRACK after LEFT while the click timer runs, FSM thread only
+static TimerQueue_t fsmTimers;    //FSM thread only
+static FSMStats_t fsmStats;       //written by the FSM thread only
+
+/* fsm_monotonic_us: monotonic clock in microseconds, the default fsmClock */
+static fsmTime_t fsm_monotonic_us(void)
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if(!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (fsmTime_t)(now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (fsmTime_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static fsmTime_t (*fsmClock)(void) = fsm_monotonic_us;
 
-static bool draggable = false;
+static inline fsmTime_t fsm_now_us(void)
+{
+	return fsmClock();
+}
 
+/* fsm_setClock: time source of the machine, NULL restores the monotonic clock */
+void fsm_setClock(fsmTime_t (*clock)(void))
+{
+	fsmClock = clock ? clock : fsm_monotonic_us;
+}
 
-/* timer_thread:
-	One-shot timer which allows the machine to distinguish between
-	a single-click and a double-click, 1.375 s is the interval time to re-click
+/* fsm_wake:
+	Producer side, after a push. The fence orders the published slot before the
+	read of consumerParked, fsm_idle orders them the other way around, so either
+	the FSM thread sees the event or the producer sees it parked. Costs no lock
+	while the FSM thread is busy or spinning.
 */
-static void * timer_thread(void *arg)
+static inline void fsm_wake(void)
 {
-	struct timespec tm;
-	tm.tv_sec = (long)time(0) + 1L;
-	tm.tv_nsec =  375000000; 
-
-	/*
-		Single Click constitutes: Timer Expired => Timer beats user to the punch 
-		Double Click constitutes: Timer Reset   => User beats timer to the punch
-	*/
-	pthread_mutex_lock(&timerLock);
-	clickTimer = TIMER_ALIVE;
-	int rt = 0;
-
-    //TODO: prevent spurious wake ups (small amount of jitter)
-	rt = pthread_cond_timedwait(&timerCond, &timerLock, &tm);
-
-	/* condition not signalled in correct amount of time */
-	if(rt == ETIMEDOUT) //mutex has been re-acquired 
-		clickTimer = TIMER_EXPIRED;
-	else if(rt == 0)
-		clickTimer = TIMER_RESET ;//forced reset t < 1.375 s
-	else {
-		perror("pthread_cond_timedwait()");
-		clickTimer = TIMER_RESET;
+	ring_fence();
+	if(ring_load(&consumerParked)){
+		pthread_mutex_lock(&waitLock); //FSM thread is inside pthread_cond_wait once we hold it
+		pthread_cond_signal(&waitCond);
+		pthread_mutex_unlock(&waitLock);
 	}
-	pthread_mutex_unlock(&timerLock);  
-	pthread_exit(NULL);
 }
 
-/* functions for triggered events */
+/* fsm_abstime: the monotonic @deadline as the wall-clock time pthread_cond_timedwait takes */
+static struct timespec fsm_abstime(fsmTime_t deadline)
+{
+	const fsmTime_t now = fsm_now_us();
+	const fsmTime_t wait = deadline > now ? deadline - now : 0;
+	fsmTime_t wall;
+#if defined(_WIN32)
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	wall = (((fsmTime_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10 - 11644473600000000ULL; //1601 => 1970
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wall = (fsmTime_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	wall += wait;
+	struct timespec tm;
+	tm.tv_sec = (time_t)(wall / 1000000);
+	tm.tv_nsec = (long)(wall % 1000000) * 1000;
+	return tm;
+}
 
-static void * event_left_click(void *payload)
+/* fsm_idle:
+	Called by the FSM thread on an empty queue, returns once there may be
+	an event to consume or @deadline (TIMERS_NONE for none) has passed.
+*/
+static void fsm_idle(fsmTime_t deadline)
 {
-	int arg = (int)payload;
-	stateEvent_t eventPrev = (stateEvent_t)arg;
-	pthread_t timerThread;
-
-	/* Three Cases 
-	   1. Starting a timer (single click or double ?)
-	   2. Setting up payload for event_track to fire
-	   3. Drag event 
-   */
-
-	pthread_mutex_lock(&stateLock);
-	if(eventPrev != DRAG)
-		eventPrev = currState.prevEvent;
-	pthread_mutex_unlock(&stateLock);
-
-	switch(eventPrev) {
-		case TRACK:
-			/* assume single-click */
-			if(clickTimer == TIMER_RESET){ //start the timer thread
-				pthread_create(&timerThread, NULL, timer_thread, NULL);
-			}
-			else if(clickTimer == TIMER_ALIVE){ //set double click payload + kill timer
-				pthread_cond_signal(&timerCond);
-				pthread_mutex_lock(&stateLock);
-				
-				static DWORD mouseEvents[4] ={MOUSEEVENTF_LEFTDOWN, MOUSEEVENTF_LEFTUP,
-											  MOUSEEVENTF_LEFTDOWN, MOUSEEVENTF_LEFTUP};
-				ZeroMemory(currState.mouseEvents, sizeof(currState.mouseEvents) * 5);
-				currState.numEvents = 4;
-				for(int i = 0; i < currState.numEvents; i++){
-					currState.mouseEvents[i].type = INPUT_MOUSE;
-					currState.mouseEvents[i].mi.dwFlags = mouseEvents[i];
-				}
-				pthread_mutex_unlock(&stateLock);
-				clickTimer = TIMER_RESET;
-			}
-			else { //clickTimer == TIMER_EXPIRED ... single click payload
-				
-				pthread_mutex_lock(&stateLock);
-				ZeroMemory(currState.mouseEvents, sizeof(currState.mouseEvents) * 5);
-				currState.mouseEvents[0].type = INPUT_MOUSE;
-				currState.mouseEvents[0].mi.dwFlags   = MOUSEEVENTF_LEFTDOWN;
-				currState.mouseEvents[1].type = INPUT_MOUSE;
-				currState.mouseEvents[1].mi.dwFlags   = MOUSEEVENTF_LEFTUP;
-				currState.numEvents = 2;
-				pthread_mutex_unlock(&stateLock);
-				clickTimer = TIMER_RESET; //mutex not needed
+	if(deadline != TIMERS_NONE && fsm_now_us() >= deadline)
+		return;
+	for(int i = 0; i < spinBudget; i++){
+		if(ring_size(&fsmQueue)){
+			if(spinBudget < FSM_SPIN_MAX)
+				spinBudget *= 2; //the spin paid off, keep spinning that long
+			return;
+		}
+		ring_pause();
+	}
+
+	pthread_mutex_lock(&waitLock);
+	ring_store(&consumerParked, 1);
+	ring_fence();
+	while(!ring_size(&fsmQueue)){
+		if(deadline == TIMERS_NONE)
+			pthread_cond_wait(&waitCond, &waitLock);
+		else if(fsm_now_us() >= deadline)
+			break;
+		else {
+			/* the wall clock only converts the timeout, expiry is judged on fsm_now_us */
+			const struct timespec tm = fsm_abstime(deadline);
+			const int rt = pthread_cond_timedwait(&waitCond, &waitLock, &tm);
+			if(rt != 0 && rt != ETIMEDOUT){
+				perror("pthread_cond_timedwait()");
+				break;
 			}
-		break;
+		}
+	}
+	ring_store(&consumerParked, 0);
+	pthread_mutex_unlock(&waitLock);
 
-		/* Special Case: as there is no event_drag 
-		   Input is sent from this state
-		*/
-		case DRAG:
-			SetCursorPos((cursor.x - 40 + 1)*8.95, (cursor.y - 63 + 1)*7.7);
-			if(!draggable){//enter leftdown state only once 
-				pthread_mutex_lock(&stateLock);
-				ZeroMemory(currState.mouseEvents, sizeof(currState.mouseEvents) * 5);
-				currState.mouseEvents[0].type = INPUT_MOUSE;
-				currState.mouseEvents[0].mi.dwFlags = MOUSEEVENTF_LEFTDOWN;
-				currState.mouseEvents[1].type = INPUT_MOUSE;
-				currState.mouseEvents[1].mi.dwFlags = MOUSEEVENTF_LEFTUP;
-				currState.numEvents = 2;
-				//send only LEFTDOWN event, event_track fires its compliment
-				SendInput(1, currState.mouseEvents, sizeof(INPUT));
-				draggable = true;
-				pthread_mutex_unlock(&stateLock);
-			}	
-		break;
+	fsmStats.parks++;
+	if(spinBudget > FSM_SPIN_MIN)
+		spinBudget /= 2;
+}
+
+#define FSM_BAD {FSM_NONE, TRACK} //no such state or posture, back to tracking
+
+/* fsmTable[state][posture]:
+	The state is the previous posture (the a priori info), the posture the one consumed.
+	Constant data laid out by the compiler, fsm_transition is the only reader.
+*/
+static const FSMTransition_t fsmTable[FSM_NUM_EVENTS][FSM_NUM_EVENTS] = {
+/*  posture:    -        LEFT                   RIGHT                   ZOOM              TRACK                    DRAG              QUIT              NOP */
+/* -     */ {FSM_BAD, FSM_BAD,                FSM_BAD,                FSM_BAD,          FSM_BAD,                 FSM_BAD,          FSM_BAD,          FSM_BAD},
+/* LEFT  */ {FSM_BAD, {FSM_NONE, LEFT},       {FSM_LEFT_RIGHT, RIGHT}, {FSM_NONE, ZOOM}, {FSM_CLICK_FIRE, TRACK}, {FSM_DRAG, DRAG}, {FSM_QUIT, LEFT},  FSM_BAD},
+/* RIGHT */ {FSM_BAD, {FSM_NONE, LEFT},       {FSM_NONE, RIGHT},      {FSM_NONE, ZOOM}, {FSM_SEND, TRACK},       {FSM_DRAG, DRAG}, {FSM_QUIT, RIGHT}, FSM_BAD},
+/* ZOOM  */ {FSM_BAD, {FSM_NONE, LEFT},       {FSM_NONE, RIGHT},      {FSM_NONE, ZOOM}, {FSM_NONE, TRACK},       {FSM_DRAG, DRAG}, {FSM_QUIT, ZOOM},  FSM_BAD},
+/* TRACK */ {FSM_BAD, {FSM_CLICK, LEFT},      {FSM_RIGHT, RIGHT},     {FSM_NONE, ZOOM}, {FSM_MOVE, TRACK},       {FSM_DRAG, DRAG}, {FSM_QUIT, TRACK}, FSM_BAD},
+/* DRAG  */ {FSM_BAD, {FSM_DRAG, DRAG},       {FSM_NONE, RIGHT},      {FSM_NONE, ZOOM}, {FSM_DROP, TRACK},       {FSM_DRAG, DRAG}, {FSM_QUIT, DRAG},  FSM_BAD},
+/* QUIT  */ {FSM_BAD, FSM_BAD,                FSM_BAD,                FSM_BAD,          FSM_BAD,                 FSM_BAD,          FSM_BAD,          FSM_BAD},
+/* NOP   */ {FSM_BAD, FSM_BAD,                FSM_BAD,                FSM_BAD,          FSM_BAD,                 FSM_BAD,          FSM_BAD,          FSM_BAD}
+};
 
+/*
+fsm_transition:
+	Pure lookup in fsmTable, no side effect
+
+	@state: current state (previous posture)
+	@posture: posture consumed
+	@return: action to run and the next state
+*/
+static inline FSMTransition_t fsm_transition(stateEvent_t state, stateEvent_t posture)
+{
+	if((unsigned)state >= FSM_NUM_EVENTS || (unsigned)posture >= FSM_NUM_EVENTS){
+		const FSMTransition_t bad = FSM_BAD;
+		return bad;
 	}
-	pthread_mutex_lock(&stateLock);
-	currState.prevEvent = (eventPrev == DRAG) ? DRAG : LEFT;
-	pthread_mutex_unlock(&stateLock);
-	pthread_exit(NULL);
+	return fsmTable[state][posture];
 }
 
+/* mouse button sequences of the payloads */
+static const sinkAction_t singleClick[2]    = {SINK_LEFT_DOWN, SINK_LEFT_UP};
+static const sinkAction_t doubleClick[4]    = {SINK_LEFT_DOWN, SINK_LEFT_UP, SINK_LEFT_DOWN, SINK_LEFT_UP};
+static const sinkAction_t rightClick[2]     = {SINK_RIGHT_DOWN, SINK_RIGHT_UP};
+static const sinkAction_t leftRightClick[4] = {SINK_LEFT_DOWN, SINK_LEFT_UP, SINK_RIGHT_DOWN, SINK_RIGHT_UP};
 
-static void * event_right_click(void *payload)
+/* fsm_payload: loads the @n mouse button events of @buttons as the payload */
+static void fsm_payload(const sinkAction_t *buttons, int n)
 {
-	stateEvent_t eventPrev;
-
-	pthread_mutex_lock(&stateLock);
-	eventPrev = currState.prevEvent;
-	pthread_mutex_unlock(&stateLock);
-
-	/* only care about Track, Left previous state don't care about RIGHT*/
-	switch(eventPrev){
-		case TRACK:
-			/* setup RIGHT single-click payload */
-			pthread_mutex_lock(&stateLock);
-			ZeroMemory(currState.mouseEvents, sizeof(currState.mouseEvents) * 5);
-			currState.mouseEvents[0].type = INPUT_MOUSE;
-			currState.mouseEvents[0].mi.dwFlags   = MOUSEEVENTF_RIGHTDOWN;
-			currState.mouseEvents[1].type = INPUT_MOUSE;
-			currState.mouseEvents[1].mi.dwFlags   = MOUSEEVENTF_RIGHTUP;
-			currState.numEvents = 2;
-			pthread_mutex_unlock(&stateLock);
-		break;
+	assert(n <= FSM_MAX_BUTTONS);
+	memcpy(currState.buttons, buttons, sizeof(sinkAction_t) * n);
+	currState.numEvents = n;
+}
 
-		case LEFT:
-			/* Special case T L R T 
-			Needs to set two payloads
-			*/
-			pthread_mutex_lock(&stateLock);
-			static DWORD mouseEvents[4] ={MOUSEEVENTF_LEFTDOWN, MOUSEEVENTF_LEFTUP,
-										 MOUSEEVENTF_RIGHTDOWN, MOUSEEVENTF_RIGHTUP};
-			ZeroMemory(currState.mouseEvents, sizeof(currState.mouseEvents) * 5);
-			currState.numEvents = 4;
-			for(int i = 0; i < currState.numEvents; i++){
-				currState.mouseEvents[i].type = INPUT_MOUSE;
-				currState.mouseEvents[i].mi.dwFlags = mouseEvents[i];
-			}
-			pthread_mutex_unlock(&stateLock);
-		break;
-	
+/* fsm_screen: camera coordinates of the event to the screen */
+static void fsm_screen(int *x, int *y)
+{
+	*x = (int)((currState.cursor.x - 40 + 1)*8.95);
+	*y = (int)((currState.cursor.y - 63 + 1)*7.7);
+}
+
+/* fsm_buttons: hands @n button events to the sink, at the cursor of the event */
+static void fsm_buttons(const sinkAction_t *buttons, int n)
+{
+	SinkEvent_t events[FSM_MAX_BUTTONS];
+	const fsmTime_t now = fsm_now_us();
+	for(int i = 0; i < n; i++){
+		events[i].action = buttons[i];
+		fsm_screen(&events[i].x, &events[i].y);
+		events[i].time = now;
 	}
+	sink_send(fsmSink, events, n);
+}
 
-	pthread_mutex_lock(&stateLock);
-	currState.prevEvent = RIGHT;
-	pthread_mutex_unlock(&stateLock);
-	pthread_exit(NULL);
+/* fsm_send: fires the payload, once */
+static void fsm_send(void)
+{
+	if(currState.numEvents == 0) //nothing loaded, e.g the machine started in LEFT
+		return;
+	fsm_buttons(currState.buttons, currState.numEvents);
+	currState.numEvents = 0;
 }
 
-static void * event_zoom(void *payload)
+static void fsm_moveCursor(void)
 {
-	
-	
-	
-	
-	pthread_mutex_lock(&stateLock);
-	currState.prevEvent = ZOOM;
-	pthread_mutex_unlock(&stateLock);
-    pthread_exit(NULL);
+	SinkEvent_t e;
+	e.action = SINK_MOVE;
+	fsm_screen(&e.x, &e.y);
+	e.time = fsm_now_us();
+	sink_send(fsmSink, &e, 1);
 }
 
-/* event_track:
-	The initial position, final and tracking (x,y-coord) state
-	Takes care of executing other events based on the states from the queue
-	State information is read to determine previous state.
-	Based on state respective thread is fired and mouse event in that thread is fired.
+/* fsm_clickExpired:
+	Click timer callback, no second LEFT came in time: loads the single click
+	payload and fires it if a TRACK is already waiting for it (clickPending),
+	otherwise the next TRACK does
 */
-static void * event_track(void *arg)
+static void fsm_clickExpired(void * /*arg*/)
 {
-	
-	stateEvent_t eventPrev;
-	/* Two cases to worry about 
-	   1. Moving the cursor
-	   2. Firing an event from the previous state (L, R, Z)
-	*/
-
-	pthread_mutex_lock(&stateLock);
-	eventPrev = currState.prevEvent;
-	pthread_mutex_unlock(&stateLock);
-
-	switch(eventPrev){
-		case TRACK:
-		/* Continuous tracking in action */
-		SetCursorPos((cursor.x - 40 + 1)*8.95, (cursor.y - 63 + 1)*7.7);	
+	clickTimer = 0;
+	fsm_payload(singleClick, 2);
+	if(clickPending)
+		fsm_send();
+	clickPending = false;
+}
+
+/*
+fsm_apply:
+	Runs the action of a transition, FSM thread only.
+	Single or double click is only known once a second LEFT arrives or the
+	click timer runs out (1.375 s), the FSM thread never waits for it.
+*/
+static void fsm_apply(fsmAction_t action)
+{
+	switch(action){
+		case FSM_MOVE: //continuous tracking in action
+			fsm_moveCursor();
 		break;
 
-		case LEFT:
-			while(clickTimer == TIMER_ALIVE)
-				; //wait at most 1.375s
-			/* now either single/double click is ready */
-			pthread_mutex_lock(&stateLock);
-			assert(currState.numEvents > 0);
-			SendInput(currState.numEvents, currState.mouseEvents, sizeof(INPUT));
-			pthread_mutex_unlock(&stateLock);
+		case FSM_CLICK:
+			if(!clickTimer){ //assume single-click, start the click timer
+				clickPending = false;
+				clickTimer = timers_start(&fsmTimers, fsm_now_us() + FSM_CLICK_INTERVAL, fsm_clickExpired, NULL);
+				if(!clickTimer) //no free timer, settle for a single click
+					fsm_clickExpired(NULL);
+			}
+			else { //second click in time, double click payload + cancel the timer
+				timers_cancel(&fsmTimers, clickTimer);
+				clickTimer = 0;
+				clickPending = false;
+				fsm_payload(doubleClick, 4);
+			}
 		break;
 
-		case RIGHT:
-			/* Fire right click or left-right click */
-			pthread_mutex_lock(&stateLock);
-			UINT sendresult;
-			assert(currState.numEvents > 0);
-			sendresult = SendInput(currState.numEvents, currState.mouseEvents, sizeof(INPUT));
-			assert(sendresult == currState.numEvents);
-			pthread_mutex_unlock(&stateLock);
+		case FSM_CLICK_FIRE:
+			if(clickTimer) //fsm_clickExpired fires it
+				clickPending = true;
+			else //double click, or a single click whose timer already ran out
+				fsm_send();
 		break;
 
-		case DRAG:
-			pthread_mutex_lock(&stateLock);
-			draggable = false;
-			assert(currState.numEvents > 0);
-			SendInput(1, currState.mouseEvents + 1, sizeof(INPUT));
-			pthread_mutex_unlock(&stateLock);
+		case FSM_RIGHT:
+			fsm_payload(rightClick, 2);
 		break;
 
-		case ZOOM:
-		/* fire zoom payload */
+		case FSM_LEFT_RIGHT: //the left click is part of this payload, not a first click anymore
+			timers_cancel(&fsmTimers, clickTimer);
+			clickTimer = 0;
+			clickPending = false;
+			fsm_payload(leftRightClick, 4);
 		break;
-		default: // internal error
+
+		case FSM_SEND:
+			fsm_send();
+		break;
+
+		case FSM_DRAG:
+			fsm_moveCursor();
+			if(!draggable){ //enter leftdown state only once
+				fsm_payload(singleClick, 2);
+				//send only LEFTDOWN event, FSM_DROP fires its compliment
+				fsm_buttons(currState.buttons, 1);
+				draggable = true;
+			}
+		break;
+
+		case FSM_DROP:
+			draggable = false;
+			fsm_buttons(currState.buttons + 1, 1);
+			currState.numEvents = 0;
+		break;
+
+		default: //FSM_NONE, FSM_QUIT is handled by fsm_execute
 		break;
 	}
-	
-	pthread_mutex_lock(&stateLock);
-	currState.prevEvent = TRACK;
-	pthread_mutex_unlock(&stateLock);
-    pthread_exit(NULL);
 }
 
 /*
 fsm_queue_emit:
     The given camera thread will call this function
-    to emit the detected posture. Function shall write to 
-    the non-full queue.
+    to emit the detected posture. Never blocks, safe from
+    several camera threads at once.
 
     @id: one of the enumerated states {RIGHT, ZOOM ...}
+    @pos: cursor position (camera coordinates) when the posture was seen
     @return: notification if the state could be written to the queue
-    
+             (false when full, see FSM_QUEUE_POLICY)
  */
-bool fsm_queue_emit(stateEvent_t id)
+bool fsm_queue_emit(stateEvent_t id, POINT pos)
 {
-    if(queueTail >= queueHeadr + MAX_QUEUE_ENTRY)
-        return false; //full queue
-
-	pthread_mutex_lock(&queueLock);
-    *queueTail = id;
-    queueTail++; //one beyond the latest entry
-	pthread_mutex_unlock(&queueLock);
+    if(ring_load(&fsmQuit)) //machine released, camera threads may still be running
+        return false;
+    RingEvent_t e;
+    e.event = id;
+    e.x = pos.x;
+    e.y = pos.y;
+    e.time = fsm_now_us();
+    if(!ring_push(&fsmQueue, &e))
+        return false;
+    fsm_wake();
     return true;
 }
 
 /*
 fsm_queue_consume:
-    Consumes the states from the non-empty buffer
+    Consumes the states from the ring, FSM thread only.
+    A TRACK absorbs the TRACK events queued right behind it, the position
+    of the newest one is returned, a discrete event ends the run.
 
-    @return: event ( of posture)
+    @emitted: receives the emit time of the event
+    @pos: receives the position carried by the event
+    @return: event ( of posture), NOP if the ring is empty
 */
-static stateEvent_t fsm_queue_consume(void)
+static stateEvent_t fsm_queue_consume(fsmTime_t *emitted, POINT *pos)
 {
-    static int i;
-    stateEvent_t state;
-    if(queueHeadr == queueTail){ //empty
-        i = 0;
-        return NOP; //triggers default in fsm_execute
-    }
+    RingEvent_t e, next;
+    if(!ring_pop(&fsmQueue, &e))
+        return NOP; //fsm_execute idles
+    if(e.event == TRACK)
+        while(ring_take(&fsmQueue, &next, true)){ //only pops another TRACK
+            e = next;
+            fsmStats.coalesced++;
+        }
+    *emitted = e.time;
+    pos->x = e.x;
+    pos->y = e.y;
+    return (stateEvent_t)e.event;
+}
 
-	assert(queueHeadr == (int *)&fsm_event_queue);
-    state = (stateEvent_t)queueHeadr[i++];
-	if(queueHeadr + i == queueTail){
-		pthread_mutex_lock(&queueLock);
-        queueTail = queueHeadr;
-		i = 0;
-		pthread_mutex_unlock(&queueLock);
+/* fsm_release: frees what only the FSM thread touches, after QUIT.
+   The queue and the wake-up objects stay until fsm_destroy, producers may
+   still be inside fsm_queue_emit. */
+static void fsm_release(void)
+{
+	ring_store(&fsmQuit, 1);
+	sink_flush(fsmSink);
+	if(fsmSink == &defaultSink){
+		sink_destroy(&defaultSink);
+		sink_destroy(&defaultTarget);
 	}
-    return state;
+	timers_destroy(&fsmTimers);
+}
+
+/*
+fsm_dispatch:
+    Runs one event through the table: its action, then the next state
+
+    @emitted: emit time of the event, for the dispatch latency
+    @return: false on QUIT
+*/
+static bool fsm_dispatch(stateEvent_t sid, POINT pos, fsmTime_t emitted)
+{
+    if(sid < LEFT || sid > QUIT) //illegal event
+        return true; //ignore it
+
+    const FSMTransition_t t = fsm_transition(currState.prevEvent, sid);
+    if(t.action == FSM_QUIT)
+        return false;
+
+    /* NOTE:: Possibility to pass blob analysis as parameter to the action */
+    currState.sEvent = sid;
+    currState.cursor = pos;
+    const fsmTime_t start = fsm_now_us();
+    fsm_apply(t.action);
+    currState.prevEvent = t.next;
+    const fsmTime_t end = fsm_now_us();
+
+    const fsmTime_t latency = start - emitted, handler = end - start;
+    fsmStats.dispatched++;
+    fsmStats.latencySum += latency;
+    fsmStats.handlerSum += handler;
+    if(latency > fsmStats.latencyMax) fsmStats.latencyMax = latency;
+    if(handler > fsmStats.handlerMax) fsmStats.handlerMax = handler;
+
+    if(end - lastFlush >= FSM_FRAME){ //the queue never drains, flush once a frame anyway
+        sink_flush(fsmSink);
+        lastFlush = end;
+    }
+    return true;
 }
 
 /* 
 fsm_execute: 
     The State Machine
-    Once an event is consumed from the queue it is classified.
-    State information is attributed to the event and a thread is created to execute
-    its functionality
+    Once an event is consumed from the queue its transition is looked up,
+    the action is run right away on this thread and the state advanced.
+    Actions never block.
 
-    Fine grain granularity is emplored with the locks to keep the event-loop as live as possible.
+    An empty queue puts the thread to sleep in fsm_idle instead of polling,
+    until the next event or the next timer deadline.
 */
-
-
 static void fsm_execute(void)
 {
     stateEvent_t sid;
-    pthread_t *trackThread;
-    pthread_t eventThread[NUM_STATES];
+    fsmTime_t emitted;
+    POINT pos;
 
-    while(sid = fsm_queue_consume())
+    while((sid = fsm_queue_consume(&emitted, &pos))) //never 0, QUIT ends the thread
     {
-        switch(sid){
-            case LEFT:
-			case DRAG:
-            pthread_mutex_lock(&stateLock);
-            currState.emit = event_left_click;
-            currState.stateType = TIMING;
-            currState.sEvent = LEFT;
-            pthread_mutex_unlock(&stateLock);
-            trackThread = &eventThread[0];
-            break;
-
-            case RIGHT:
-            pthread_mutex_lock(&stateLock);
-            currState.emit = event_right_click;
-            currState.stateType = ACCEPTING;
-            currState.sEvent = RIGHT; 
-            pthread_mutex_unlock(&stateLock);
-            trackThread = &eventThread[1];
-            break;
-
-            case ZOOM:
-            pthread_mutex_lock(&stateLock);
-            currState.emit = event_zoom;
-            currState.stateType = ACCEPTING;
-            currState.sEvent = ZOOM;
-            pthread_mutex_unlock(&stateLock);
-            trackThread = &eventThread[2];
-            break;
-
-            case TRACK:
-            pthread_mutex_lock(&stateLock);
-            currState.emit = event_track;
-            currState.stateType = INITIAL;
-            currState.sEvent = TRACK;
-            pthread_mutex_unlock(&stateLock);
-            trackThread = &eventThread[3];
-            break;
-
-            case QUIT:
-			pthread_cancel(*trackThread);
-			pthread_cond_destroy(&timerCond);
-			pthread_mutex_destroy(&eventLock);
-			pthread_mutex_destroy(&stateLock);
-			pthread_mutex_destroy(&timerLock);
-			pthread_mutex_destroy(&queueLock);
-			pthread_exit(NULL);
-            break;
-
-            /* Illegal event/No event (empty buffer)*/
-            default:
-            continue; //ignore it
-            break;
+        timers_expire(&fsmTimers, fsm_now_us()); //e.g a click interval that ran out meanwhile
+
+        if(sid == NOP){ //no event (empty buffer)
+            sink_flush(fsmSink); //queue drained, the end of a frame
+            lastFlush = fsm_now_us();
+            fsm_idle(timers_next(&fsmTimers)); //wakes for the next timer too
+            continue;
+        }
+        if(!fsm_dispatch(sid, pos, emitted)){
+            fsm_release();
+            pthread_exit(NULL);
         }
-        /* Launch Track thread */
-		/* NOTE:: Possibility to pass blob analysis as parameter to thread */
-        if(pthread_create(trackThread, NULL, currState.emit, (void *)sid)){
-			perror("fsm_execute:: couldn't create thread!");
-			pthread_exit(NULL);
-		}
-		//pthread_join(*trackThread, NULL);
     }
 }
 
+/*
+fsm_process:
+    Step API of a machine set up by fsm_setup (no FSM thread): fires the
+    timers due by now, then runs @id right away on the caller's thread.
+    The queue is bypassed, TRACK events are not coalesced.
+
+    @return: false once QUIT was processed (the machine is released)
+*/
+bool fsm_process(stateEvent_t id, POINT pos)
+{
+    const fsmTime_t now = fsm_now_us();
+    timers_expire(&fsmTimers, now);
+    if(fsm_dispatch(id, pos, now))
+        return true;
+    fsm_release();
+    return false;
+}
+
+/*
+fsm_advance:
+    Step API: what the FSM thread does while idle, fires the timers due
+    by now and flushes the sink
+
+    @return: next timer deadline, TIMERS_NONE if none is pending
+*/
+fsmTime_t fsm_advance(void)
+{
+    timers_expire(&fsmTimers, fsm_now_us());
+    sink_flush(fsmSink);
+    lastFlush = fsm_now_us();
+    return timers_next(&fsmTimers);
+}
+
+/* fsm_stats: dispatch statistics so far (a snapshot, the FSM thread keeps updating them) */
+FSMStats_t fsm_stats(void)
+{
+    FSMStats_t stats = fsmStats;
+    stats.refused = fsmQueue.refused;
+    stats.discarded = fsmQueue.discarded;
+    return stats;
+}
+
+/*
+fsm_destroy:
+    Frees the queue and the wake-up objects of a machine that processed QUIT.
+    Only once the camera threads have been joined (no fsm_queue_emit can run),
+    fsm_setup does it too for the machine it replaces.
+*/
+void fsm_destroy(void)
+{
+	if(!fsmQueue.slots)
+		return;
+	pthread_cond_destroy(&waitCond);
+	pthread_mutex_destroy(&waitLock);
+	ring_destroy(&fsmQueue);
+}
+
 /* 
-fsm_initialize:
-    Initializes the state machine.
+fsm_setup:
+    Initializes the state machine without starting its thread.
     Caller will put the machine in a given state
-    Once called, threads are created for fsm_execute
 
     @initial: initial state of FSM
+    @sink: receives the mouse events, still owned by the caller. NULL for
+           SendInput batched per frame on Windows, a null sink elsewhere
     @return: status of initialization
 */
+bool fsm_setup(stateEvent_t initial, OutputSink_t *sink)
+{
+    memset(&currState, 0, sizeof(currState));
+    currState.prevEvent = initial;
+    currState.sEvent = initial;
+    memset(&fsmStats, 0, sizeof(fsmStats));
+    draggable = false;
+    clickPending = false;
+    spinBudget = FSM_SPIN_MIN;
+    lastFlush = fsm_now_us();
+	fsm_destroy(); //the previous machine, after its QUIT
+	pthread_mutex_init(&waitLock, NULL);
+	pthread_cond_init(&waitCond, NULL);
+	ring_store(&fsmQuit, 0);
+	if(!ring_initialize(&fsmQueue, MAX_QUEUE_ENTRY, FSM_QUEUE_POLICY, 1u << TRACK))
+		return false;
+
+	if(!timers_initialize(&fsmTimers, FSM_MAX_TIMERS))
+		return false;
+	clickTimer = 0;
+
+	fsmSink = sink;
+	if(!fsmSink){
+#if defined(_WIN32)
+		sink_win32(&defaultTarget);
+		SetDoubleClickTime(1375);
+#else
+		sink_null(&defaultTarget);
+#endif
+		if(!sink_batching(&defaultSink, &defaultTarget, FSM_BATCH))
+			return false;
+		fsmSink = &defaultSink;
+	}
+	return true;
+}
 
-bool fsm_initialize(stateEvent_t initial)
+/* 
+fsm_initialize:
+    fsm_setup, then the thread is created for fsm_execute
+*/
+bool fsm_initialize(stateEvent_t initial, OutputSink_t *sink)
 {
-    currState.prevEvent = TRACK;
-    currState.sEvent = TRACK;
-    currState.stateType = INITIAL;
-    currState.emit = event_track;
-	queueHeadr = queueTail = (int *)&fsm_event_queue;
-
-	clickTimer = TIMER_RESET;
-	SetDoubleClickTime(1375);
+	if(!fsm_setup(initial, sink))
+		return false;
 
     const char *fsmErr = "FSM::%s: Couldn't create %s-thread!";
     if(pthread_create(&fsmThread, NULL, 
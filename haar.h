@@ -0,0 +1,496 @@
+/* Scale-Parallel Haar Detection
+   Replacement for cvHaarDetectObjects on live camera frames.
+
+   The integral, squared-integral (and tilted) images are built once per frame
+   into buffers that are kept between frames, the scan over scales is then cut
+   into bands of rows which a fixed pool of workers pulls from. Each worker owns
+   its own copy of the cascade as cvSetImagesForHaarClassifierCascade stores
+   the current scale inside the cascade. Since the integral buffers never move,
+   a copy only needs to be re-set when its worker changes scale.
+
+   Cascades made of stumps are flattened (haarflat.h) and scanned several
+   windows at a time with SIMD instead, laid over the buffers once per scale.
+
+   Idris Soule
+*/
+
+#ifndef HAAR_H
+#define HAAR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <float.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+#include <cv.h>
+
+#include "pool.h"
+#include "haarflat.h"
+
+#define HAAR_MAX_SCALES 64
+#define HAAR_BANDS_PER_WORKER 4 //rows of one scale are split into this many jobs per worker
+
+typedef struct {
+	int scale;  //index into HaarDetector_t::factors
+	int y0, y1; //rows [y0, y1) of the scale's grid scanned by this job
+	int x0, x1; //and its columns [x0, x1), origin i is at cvRound(i * ystep)
+}HaarJob_t;
+
+typedef struct HaarDetector_t {
+	CvHaarClassifierCascade **cascades; //one copy per worker
+	double *cascadeScale;               //scale each copy is currently set for
+	int numWorkers;
+	WorkerPool_t pool;
+
+	double scaleFactor;
+	int minNeighbors;
+	CvSize minSize;
+	bool needTilted;
+
+	HaarFlatCascade_t flat;
+	bool useFlat; //evaluate with haarflat instead of cvRunHaarClassifierCascade
+	HaarFlatScale_t flatScales[HAAR_MAX_SCALES];
+
+	/* per frame buffers, only reallocated when the frame size changes */
+	CvSize frameSize;
+	IplImage *gray;
+	CvMat *sum, *sqsum, *tilted;
+	double factors[HAAR_MAX_SCALES];
+	int numScales;
+
+	HaarJob_t *jobs;
+	int numJobs, maxJobs, nextJob;
+	pthread_mutex_t jobLock;
+	std::vector<cv::Rect> *hits; //raw windows found by each worker
+	std::vector<cv::Rect> merged;
+}HaarDetector_t;
+
+/* haar_hasTilted:
+	@return: true if any feature of the cascade uses the 45 degree integral image
+*/
+static bool haar_hasTilted(const CvHaarClassifierCascade *cascade)
+{
+	for(int s = 0; s < cascade->count; s++){
+		const CvHaarStageClassifier *stage = &cascade->stage_classifier[s];
+		for(int c = 0; c < stage->count; c++)
+			for(int f = 0; f < stage->classifier[c].count; f++)
+				if(stage->classifier[c].haar_feature[f].tilted)
+					return true;
+	}
+	return false;
+}
+
+static void haar_destroy(HaarDetector_t *det);
+
+/*
+haar_initialize:
+	Loads the cascade, flattened if possible, otherwise one copy per worker,
+	and starts the worker pool.
+	Nothing is left to release when it fails, don't call haar_destroy then
+
+	@cascadeName: trained cascade (HandClassifier_1Pose.xml)
+	@numThreads: workers (<= 0 uses one per processor)
+	@scaleFactor, minNeighbors, minSize: as for cvHaarDetectObjects
+	@return: status of initialization
+*/
+static bool haar_initialize(HaarDetector_t *det, const char *cascadeName, int numThreads,
+							double scaleFactor, int minNeighbors, CvSize minSize)
+{
+	assert(det && scaleFactor > 1.0);
+	if(numThreads <= 0)
+		numThreads = pool_num_processors();
+
+	det->scaleFactor = scaleFactor;
+	det->minNeighbors = minNeighbors;
+	det->minSize = minSize;
+	det->frameSize = cvSize(0, 0);
+	det->gray = NULL;
+	det->sum = det->sqsum = det->tilted = NULL;
+	det->numScales = det->numJobs = det->maxJobs = det->nextJob = 0;
+	det->jobs = NULL;
+	det->numWorkers = numThreads;
+
+	det->cascades = (CvHaarClassifierCascade **)calloc(numThreads, sizeof(CvHaarClassifierCascade *));
+	det->cascadeScale = (double *)calloc(numThreads, sizeof(double));
+	det->useFlat = false;
+	for(int i = 0; i < numThreads && !det->useFlat; i++){
+		det->cascades[i] = (CvHaarClassifierCascade *)cvLoad(cascadeName, 0, 0, 0);
+		if(!det->cascades[i]){
+			fprintf(stderr, "Error: Couldn't load cascade %s!\n", cascadeName);
+			for(int j = 0; j < i; j++) //nothing else is set up yet
+				cvReleaseHaarClassifierCascade(&det->cascades[j]);
+			free(det->cascades);
+			free(det->cascadeScale);
+			det->cascades = NULL;
+			det->cascadeScale = NULL;
+			return false;
+		}
+		if(i == 0) //the workers share a flattened cascade, no copy per worker then
+			det->useFlat = haarflat_convert(&det->flat, det->cascades[0]);
+	}
+	det->needTilted = haar_hasTilted(det->cascades[0]);
+	memset(det->flatScales, 0, sizeof(det->flatScales));
+	det->hits = new std::vector<cv::Rect>[numThreads];
+
+	pthread_mutex_init(&det->jobLock, NULL);
+	if(!pool_initialize(&det->pool, numThreads, numThreads)){
+		haar_destroy(det);
+		return false;
+	}
+	return true;
+}
+
+/* haar_resize:
+	(Re)allocates the integral buffers and the scale list for a new frame size
+*/
+static void haar_resize(HaarDetector_t *det, CvSize size)
+{
+	cvReleaseImage(&det->gray);
+	cvReleaseMat(&det->sum);
+	cvReleaseMat(&det->sqsum);
+	cvReleaseMat(&det->tilted);
+
+	det->frameSize = size;
+	det->gray = cvCreateImage(size, IPL_DEPTH_8U, 1);
+	det->sum = cvCreateMat(size.height + 1, size.width + 1, CV_32SC1);
+	det->sqsum = cvCreateMat(size.height + 1, size.width + 1, CV_64FC1);
+	if(det->needTilted)
+		det->tilted = cvCreateMat(size.height + 1, size.width + 1, CV_32SC1);
+
+	/* buffers moved, every cascade copy has to be set again */
+	for(int i = 0; i < det->numWorkers; i++)
+		det->cascadeScale[i] = 0.0;
+
+	const CvSize orig = det->cascades[0]->orig_window_size;
+	det->numScales = 0;
+	for(double factor = 1.0; det->numScales < HAAR_MAX_SCALES; factor *= det->scaleFactor){
+		if(factor * orig.width >= size.width - 10 || factor * orig.height >= size.height - 10)
+			break; //largest scale of cvHaarDetectObjects
+		CvSize win = cvSize(cvRound(orig.width * factor), cvRound(orig.height * factor));
+		if(win.width < det->minSize.width || win.height < det->minSize.height)
+			continue;
+		det->factors[det->numScales++] = factor;
+	}
+
+	if(det->useFlat)
+		for(int s = 0; s < det->numScales; s++)
+			haarflat_setScale(&det->flat, &det->flatScales[s], det->factors[s],
+							  det->sum->step / sizeof(int), det->sqsum->step / sizeof(double));
+
+	/* worst case every scale is cut into HAAR_BANDS_PER_WORKER bands per worker */
+	free(det->jobs);
+	det->maxJobs = det->numScales * det->numWorkers * HAAR_BANDS_PER_WORKER;
+	det->jobs = (HaarJob_t *)malloc(sizeof(HaarJob_t) * (det->maxJobs > 0 ? det->maxJobs : 1));
+}
+
+/* haar_scanJob:
+	Scans one band of one scale with the cascade copy owned by @worker.
+	As in cvHaarDetectObjects a window rejected by the first stage skips the
+	next column of its row: the flat path evaluates whole groups of columns,
+	then keeps only the results of the columns OpenCV visits (next)
+*/
+static void haar_scanJob(HaarDetector_t *det, const HaarJob_t *job, int worker)
+{
+	if(det->useFlat){
+		const HaarFlatScale_t *sc = &det->flatScales[job->scale];
+		const int sumStride = det->sum->step / sizeof(int), sqStride = det->sqsum->step / sizeof(double);
+		int lanes[HAARFLAT_LANES], results[HAARFLAT_LANES];
+
+		for(int iy = job->y0; iy < job->y1; iy++){
+			const int y = cvRound(iy * sc->ystep);
+			const int *p = det->sum->data.i + y * sumStride;
+			const double *pq = det->sqsum->data.db + y * sqStride;
+			int ix = job->x0, next = job->x0;
+
+			for(; ix + HAARFLAT_LANES <= job->x1; ix += HAARFLAT_LANES){
+				const int x = cvRound(ix * sc->ystep);
+				for(int l = 0; l < HAARFLAT_LANES; l++)
+					lanes[l] = cvRound((ix + l) * sc->ystep) - x;
+				haarflat_evalWindows(&det->flat, sc, p + x, pq + x, lanes, results);
+				for(int l = next - ix; l < HAARFLAT_LANES; l = next - ix){
+					if(results[l] > 0)
+						det->hits[worker].push_back(cv::Rect(x + lanes[l], y, sc->win.width, sc->win.height));
+					next += results[l] != 0 ? 1 : 2;
+				}
+			}
+			for(ix = next; ix < job->x1; ){ //tail of the row
+				const int x = cvRound(ix * sc->ystep);
+				const int result = haarflat_evalWindow(&det->flat, sc, p + x, pq + x);
+				if(result > 0)
+					det->hits[worker].push_back(cv::Rect(x, y, sc->win.width, sc->win.height));
+				ix += result != 0 ? 1 : 2;
+			}
+		}
+		return;
+	}
+
+	CvHaarClassifierCascade *cascade = det->cascades[worker];
+	const double factor = det->factors[job->scale];
+
+	if(det->cascadeScale[worker] != factor){
+		cvSetImagesForHaarClassifierCascade(cascade, det->sum, det->sqsum, det->tilted, factor);
+		det->cascadeScale[worker] = factor;
+	}
+
+	const CvSize win = cvSize(cvRound(cascade->orig_window_size.width * factor),
+							  cvRound(cascade->orig_window_size.height * factor));
+	const double ystep = MAX(2., factor); //same grid as cvHaarDetectObjects
+
+	for(int iy = job->y0; iy < job->y1; iy++){
+		const int y = cvRound(iy * ystep);
+		for(int ix = job->x0; ix < job->x1; ){
+			const int x = cvRound(ix * ystep);
+			const int result = cvRunHaarClassifierCascade(cascade, cvPoint(x, y), 0);
+			if(result > 0)
+				det->hits[worker].push_back(cv::Rect(x, y, win.width, win.height));
+			ix += result != 0 ? 1 : 2;
+		}
+	}
+}
+
+static void haar_worker(void *arg, int worker)
+{
+	HaarDetector_t *det = (HaarDetector_t *)arg;
+
+	for(;;){
+		pthread_mutex_lock(&det->jobLock);
+		int j = det->nextJob++;
+		pthread_mutex_unlock(&det->jobLock);
+		if(j >= det->numJobs)
+			break;
+		haar_scanJob(det, &det->jobs[j], worker);
+	}
+}
+
+/* haar_gridFirst: first index of the grid (origins cvRound(i * step)) whose origin is >= @from */
+static int haar_gridFirst(double step, int from)
+{
+	if(from <= 0)
+		return 0;
+	int i = (int)(from / step);
+	while(i > 0 && cvRound((i - 1) * step) >= from)
+		i--;
+	while(cvRound(i * step) < from)
+		i++;
+	return i;
+}
+
+/* haar_planJobs:
+	Cuts the rows of every scale into bands, smallest (most expensive) scales first.
+	Only windows lying inside @roi and scales within [minFactor, maxFactor] are planned,
+	origins stay on the full frame grid so a region scan evaluates the windows of a full scan,
+	only the column skipping after a first stage rejection restarts at the region's edge
+*/
+static void haar_planJobs(HaarDetector_t *det, CvRect roi, double minFactor, double maxFactor)
+{
+	const CvSize orig = det->cascades[0]->orig_window_size;
+	const int bands = det->numWorkers * HAAR_BANDS_PER_WORKER;
+
+	det->numJobs = det->nextJob = 0;
+	for(int s = 0; s < det->numScales; s++){
+		const double factor = det->factors[s];
+		if(factor < minFactor || factor > maxFactor)
+			continue;
+
+		/* grid of cvHaarDetectObjects: (frame - window) / ystep origins per axis */
+		const double ystep = MAX(2., factor);
+		const CvSize win = cvSize(cvRound(orig.width * factor), cvRound(orig.height * factor));
+		const int stopX = MIN(cvRound((det->frameSize.width - win.width) / ystep),
+							  haar_gridFirst(ystep, roi.x + roi.width - win.width + 1));
+		const int stopY = MIN(cvRound((det->frameSize.height - win.height) / ystep),
+							  haar_gridFirst(ystep, roi.y + roi.height - win.height + 1));
+		const int startX = haar_gridFirst(ystep, roi.x);
+		const int startY = haar_gridFirst(ystep, roi.y);
+		if(startX >= stopX || startY >= stopY) //window does not fit the region
+			continue;
+
+		const int rows = stopY - startY;
+		const int rowsPerBand = (rows + bands - 1) / bands;
+
+		for(int r = 0; r < rows; r += rowsPerBand){
+			HaarJob_t *job = &det->jobs[det->numJobs++];
+			job->scale = s;
+			job->x0 = startX;
+			job->x1 = stopX;
+			job->y0 = startY + r;
+			job->y1 = MIN(startY + r + rowsPerBand, stopY);
+		}
+	}
+	assert(det->numJobs <= det->maxJobs);
+}
+
+/* haar_scanOrder: order cvHaarDetectObjects finds windows in, scale, row, column */
+static bool haar_scanOrder(const cv::Rect &a, const cv::Rect &b)
+{
+	if(a.width != b.width)
+		return a.width < b.width;
+	return a.y != b.y ? a.y < b.y : a.x < b.x;
+}
+
+/*
+haar_detectRegion:
+	Detects hands whose window lies inside a search region and scale band
+
+	@img: 8-bit frame, 1 or 3 channels
+	@roi: search region in frame coordinates
+	@minFactor, maxFactor: band of cascade scale factors to scan
+	@hands: receives the grouped detections
+	@maxHands: capacity of hands
+	@return: number of detections written to hands
+*/
+static int haar_detectRegion(HaarDetector_t *det, const IplImage *img, CvRect roi,
+							 double minFactor, double maxFactor, CvRect *hands, int maxHands)
+{
+	assert(det && img && img->depth == IPL_DEPTH_8U);
+	CvSize size = cvGetSize(img);
+	if(size.width != det->frameSize.width || size.height != det->frameSize.height)
+		haar_resize(det, size);
+
+	const IplImage *gray = img;
+	if(img->nChannels != 1){
+		cvCvtColor(img, det->gray, CV_BGR2GRAY);
+		gray = det->gray;
+	}
+	cvIntegral(gray, det->sum, det->sqsum, det->tilted);
+
+	for(int i = 0; i < det->numWorkers; i++)
+		det->hits[i].clear();
+
+	haar_planJobs(det, roi, minFactor, maxFactor);
+	for(int i = 0; i < det->numWorkers; i++)
+		pool_submit(&det->pool, haar_worker, det);
+	pool_wait(&det->pool);
+
+	det->merged.clear();
+	for(int i = 0; i < det->numWorkers; i++)
+		det->merged.insert(det->merged.end(), det->hits[i].begin(), det->hits[i].end());
+	std::sort(det->merged.begin(), det->merged.end(), haar_scanOrder); //whatever worker found them
+	cv::groupRectangles(det->merged, det->minNeighbors, 0.2);
+
+	int n = 0;
+	for(; n < (int)det->merged.size() && n < maxHands; n++)
+		hands[n] = det->merged[n];
+	return n;
+}
+
+/*
+haar_detect:
+	Detects hands in a frame, equivalent to cvHaarDetectObjects without canny pruning
+*/
+static int haar_detect(HaarDetector_t *det, const IplImage *img, CvRect *hands, int maxHands)
+{
+	return haar_detectRegion(det, img, cvRect(0, 0, img->width, img->height),
+							 0.0, DBL_MAX, hands, maxHands);
+}
+
+/* Temporal coherence tracking
+   Between consecutive frames the hand barely moves, so once a hand is found only
+   a window around it and a band of scales around its size are scanned.
+   Every rescanInterval frames (or once the hand is lost) the full frame is
+   scanned again to pick up lost or new hands.
+*/
+typedef struct {
+	CvRect last;        //previous detection
+	bool locked;        //last is valid
+	int frame;          //frames since the last full scan
+	int misses;         //consecutive region scans without a hand
+	int rescanInterval; //full scan every n frames
+	int maxMisses;      //region misses tolerated before falling back to full scans
+	double margin;      //search window grows by margin * hand size on each side
+	double band;        //scales [size / band, size * band] are scanned
+}HaarTracker_t;
+
+static void haar_trackerInit(HaarTracker_t *tr, int rescanInterval)
+{
+	tr->last = cvRect(0, 0, 0, 0);
+	tr->locked = false;
+	tr->frame = tr->misses = 0;
+	tr->rescanInterval = rescanInterval;
+	tr->maxMisses = 2;
+	tr->margin = 0.5;
+	tr->band = 1.25;
+}
+
+/*
+haar_track:
+	Detects hands with the tracker's search window, falls back to a full scan
+	when the tracker is not locked or a periodic rescan is due.
+	The tracker locks onto the detection closest to its previous position.
+
+	@return: number of detections written to hands
+*/
+static int haar_track(HaarDetector_t *det, HaarTracker_t *tr, const IplImage *img,
+					  CvRect *hands, int maxHands)
+{
+	int n;
+	const bool fullScan = !tr->locked || ++tr->frame >= tr->rescanInterval;
+
+	if(fullScan){
+		tr->frame = 0;
+		n = haar_detect(det, img, hands, maxHands);
+	}
+	else {
+		const CvSize orig = det->cascades[0]->orig_window_size;
+		const int mx = cvRound(tr->last.width * tr->margin), my = cvRound(tr->last.height * tr->margin);
+		const double factor = (double)tr->last.width / orig.width;
+		CvRect roi = cvRect(tr->last.x - mx, tr->last.y - my,
+							tr->last.width + 2 * mx, tr->last.height + 2 * my);
+		n = haar_detectRegion(det, img, roi, factor / tr->band, factor * tr->band, hands, maxHands);
+	}
+
+	if(n == 0){
+		if(fullScan || ++tr->misses > tr->maxMisses)
+			tr->locked = false; //lost, scan the full frame next time
+		return 0;
+	}
+
+	/* follow the detection nearest to the previous hand */
+	int best = 0;
+	if(tr->locked){
+		double bestDist = DBL_MAX;
+		for(int i = 0; i < n; i++){
+			double dx = (hands[i].x + hands[i].width / 2) - (tr->last.x + tr->last.width / 2);
+			double dy = (hands[i].y + hands[i].height / 2) - (tr->last.y + tr->last.height / 2);
+			if(dx * dx + dy * dy < bestDist){
+				bestDist = dx * dx + dy * dy;
+				best = i;
+			}
+		}
+	}
+	tr->last = hands[best];
+	tr->locked = true;
+	tr->misses = 0;
+	return n;
+}
+
+/*
+haar_destroy:
+	Stops the workers and frees every cascade copy and buffer
+*/
+static void haar_destroy(HaarDetector_t *det)
+{
+	pool_destroy(&det->pool);
+	for(int i = 0; i < det->numWorkers; i++)
+		if(det->cascades[i])
+			cvReleaseHaarClassifierCascade(&det->cascades[i]);
+	pthread_mutex_destroy(&det->jobLock);
+
+	if(det->useFlat){
+		for(int s = 0; s < HAAR_MAX_SCALES; s++)
+			haarflat_releaseScale(&det->flatScales[s]);
+		haarflat_release(&det->flat);
+	}
+	delete [] det->hits;
+	free(det->cascades);
+	free(det->cascadeScale);
+	free(det->jobs);
+	cvReleaseImage(&det->gray);
+	cvReleaseMat(&det->sum);
+	cvReleaseMat(&det->sqsum);
+	cvReleaseMat(&det->tilted);
+}
+
+#endif
@@ -0,0 +1,400 @@
+/* Flattened Haar Cascade
+   A CvHaarClassifierCascade converted into a flat structure-of-arrays layout
+   (per weak classifier thresholds, alphas, rect count; per rect geometry and
+   weights) that is evaluated on several consecutive windows of a scan row at
+   once with SSE2 (4 windows) or AVX2 (8 windows).
+
+   All lanes walk the stages together, a lane that fails a stage is masked out
+   and the group returns as soon as every lane has been rejected, which for
+   background windows is almost always the first stage. Each window reports
+   the stage that rejected it, the caller applies the column skipping of
+   cvHaarDetectObjects. Feature, threshold and stage sums are doubles as in
+   cvRunHaarClassifierCascade, so both give the same decision on every window.
+
+   Only cascades made of stumps over upright features (the opencv_haartraining
+   default) can be flattened, haarflat_convert refuses anything else so the
+   caller can fall back to cvRunHaarClassifierCascade.
+
+   Idris Soule
+*/
+
+#ifndef HAARFLAT_H
+#define HAARFLAT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <cv.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HAARFLAT_LANES 8
+#else
+#include <emmintrin.h>
+#define HAARFLAT_LANES 4
+#endif
+
+#define HAARFLAT_MAX_RECTS 3
+#define HAARFLAT_STAGE_BIAS 0.0001 //icv_stage_threshold_bias of the OpenCV evaluator
+
+/* scale independent part, built once from the cascade */
+typedef struct {
+	CvSize origWindow;
+	int numStages, numWeak;
+	int *stageEnd;         //one past the last weak classifier of each stage
+	float *stageThreshold;
+
+	/* per weak classifier */
+	float *threshold;
+	float *alphaLeft;      //feature < threshold
+	float *alphaRight;
+	int *numRects;
+
+	/* HAARFLAT_MAX_RECTS per weak classifier */
+	CvRect *rect;
+	float *weight;
+}HaarFlatCascade_t;
+
+/* one scale laid over the integral images, offsets are in elements from the window origin */
+typedef struct {
+	double factor;
+	CvSize win;
+	double ystep; //window origins are rounded multiples of it
+	double invArea;
+	int vofs[4];  //variance window into sum
+	int vqofs[4]; //and into sqsum
+	int *ofs;     //4 corners * HAARFLAT_MAX_RECTS per weak classifier
+	float *w;     //HAARFLAT_MAX_RECTS per weak classifier
+}HaarFlatScale_t;
+
+/*
+haarflat_convert:
+	Flattens a cascade
+
+	@return: false if the cascade holds trees, tilted features or stage trees
+*/
+static bool haarflat_convert(HaarFlatCascade_t *fc, const CvHaarClassifierCascade *cascade)
+{
+	int numWeak = 0;
+	for(int s = 0; s < cascade->count; s++){
+		const CvHaarStageClassifier *stage = &cascade->stage_classifier[s];
+		if(stage->next != -1)
+			return false;
+		for(int c = 0; c < stage->count; c++){
+			const CvHaarClassifier *weak = &stage->classifier[c];
+			if(weak->count != 1 || weak->haar_feature[0].tilted ||
+			   weak->left[0] > 0 || weak->right[0] > 0)
+				return false;
+		}
+		numWeak += stage->count;
+	}
+
+	fc->origWindow = cascade->orig_window_size;
+	fc->numStages = cascade->count;
+	fc->numWeak = numWeak;
+	fc->stageEnd = (int *)malloc(sizeof(int) * fc->numStages);
+	fc->stageThreshold = (float *)malloc(sizeof(float) * fc->numStages);
+	fc->threshold = (float *)malloc(sizeof(float) * numWeak);
+	fc->alphaLeft = (float *)malloc(sizeof(float) * numWeak);
+	fc->alphaRight = (float *)malloc(sizeof(float) * numWeak);
+	fc->numRects = (int *)malloc(sizeof(int) * numWeak);
+	fc->rect = (CvRect *)calloc(numWeak * HAARFLAT_MAX_RECTS, sizeof(CvRect));
+	fc->weight = (float *)calloc(numWeak * HAARFLAT_MAX_RECTS, sizeof(float));
+
+	int j = 0;
+	for(int s = 0; s < cascade->count; s++){
+		const CvHaarStageClassifier *stage = &cascade->stage_classifier[s];
+		for(int c = 0; c < stage->count; c++, j++){
+			const CvHaarClassifier *weak = &stage->classifier[c];
+			const CvHaarFeature *feature = &weak->haar_feature[0];
+
+			fc->threshold[j] = weak->threshold[0];
+			fc->alphaLeft[j] = weak->alpha[-weak->left[0]];
+			fc->alphaRight[j] = weak->alpha[-weak->right[0]];
+
+			int k = 0;
+			for(; k < HAARFLAT_MAX_RECTS && feature->rect[k].r.width != 0; k++){
+				fc->rect[j * HAARFLAT_MAX_RECTS + k] = feature->rect[k].r;
+				fc->weight[j * HAARFLAT_MAX_RECTS + k] = feature->rect[k].weight;
+			}
+			fc->numRects[j] = k;
+		}
+		fc->stageEnd[s] = j;
+		fc->stageThreshold[s] = (float)(stage->threshold - HAARFLAT_STAGE_BIAS);
+	}
+	return true;
+}
+
+/*
+haarflat_setScale:
+	Lays the cascade over integral images of the given strides at one scale,
+	rect rounding and weight correction follow cvSetImagesForHaarClassifierCascade
+
+	@sumStride, sqStride: row length in elements of the sum / sqsum images
+*/
+static void haarflat_setScale(const HaarFlatCascade_t *fc, HaarFlatScale_t *sc, double factor,
+							  int sumStride, int sqStride)
+{
+	sc->factor = factor;
+	sc->win = cvSize(cvRound(fc->origWindow.width * factor), cvRound(fc->origWindow.height * factor));
+	sc->ystep = MAX(2., factor); //same grid as cvHaarDetectObjects
+
+	/* variance is taken over the window shrunk by one (scaled) pixel */
+	CvRect equ;
+	equ.x = equ.y = cvRound(factor);
+	equ.width = cvRound((fc->origWindow.width - 2) * factor);
+	equ.height = cvRound((fc->origWindow.height - 2) * factor);
+	sc->invArea = 1. / (equ.width * equ.height);
+
+	sc->vofs[0] = equ.y * sumStride + equ.x;
+	sc->vofs[1] = equ.y * sumStride + equ.x + equ.width;
+	sc->vofs[2] = (equ.y + equ.height) * sumStride + equ.x;
+	sc->vofs[3] = (equ.y + equ.height) * sumStride + equ.x + equ.width;
+	sc->vqofs[0] = equ.y * sqStride + equ.x;
+	sc->vqofs[1] = equ.y * sqStride + equ.x + equ.width;
+	sc->vqofs[2] = (equ.y + equ.height) * sqStride + equ.x;
+	sc->vqofs[3] = (equ.y + equ.height) * sqStride + equ.x + equ.width;
+
+	free(sc->ofs);
+	free(sc->w);
+	sc->ofs = (int *)calloc(fc->numWeak * HAARFLAT_MAX_RECTS * 4, sizeof(int));
+	sc->w = (float *)calloc(fc->numWeak * HAARFLAT_MAX_RECTS, sizeof(float));
+
+	for(int j = 0; j < fc->numWeak; j++){
+		double sum0 = 0, area0 = 0;
+		for(int k = 0; k < fc->numRects[j]; k++){
+			const CvRect r = fc->rect[j * HAARFLAT_MAX_RECTS + k];
+			CvRect tr = cvRect(cvRound(r.x * factor), cvRound(r.y * factor),
+							   cvRound(r.width * factor), cvRound(r.height * factor));
+			int *o = &sc->ofs[(j * HAARFLAT_MAX_RECTS + k) * 4];
+
+			o[0] = tr.y * sumStride + tr.x;
+			o[1] = tr.y * sumStride + tr.x + tr.width;
+			o[2] = (tr.y + tr.height) * sumStride + tr.x;
+			o[3] = (tr.y + tr.height) * sumStride + tr.x + tr.width;
+
+			float weight = (float)(fc->weight[j * HAARFLAT_MAX_RECTS + k] * sc->invArea);
+			sc->w[j * HAARFLAT_MAX_RECTS + k] = weight;
+			if(k == 0)
+				area0 = tr.width * tr.height;
+			else
+				sum0 += weight * tr.width * tr.height;
+		}
+		/* first rect balances the others so flat regions sum to zero */
+		sc->w[j * HAARFLAT_MAX_RECTS] = (float)(-sum0 / area0);
+	}
+}
+
+/* haarflat_normFactor:
+	Standard deviation of the window at @p/@pq, 1 for degenerate windows
+*/
+static inline double haarflat_normFactor(const HaarFlatScale_t *sc, const int *p, const double *pq)
+{
+	const int *v = sc->vofs, *vq = sc->vqofs;
+	double mean = (p[v[0]] - p[v[1]] - p[v[2]] + p[v[3]]) * sc->invArea;
+	double nf = (pq[vq[0]] - pq[vq[1]] - pq[vq[2]] + pq[vq[3]]) * sc->invArea - mean * mean;
+	return nf >= 0. ? sqrt(nf) : 1.;
+}
+
+/*
+haarflat_evalWindow:
+	Runs the cascade on a single window. The arithmetic is the one of
+	cvRunHaarClassifierCascade: rect sums weighted in float, feature, threshold
+	and stage sums in double
+
+	@p, pq: window origin in the sum / sqsum images
+	@return: 1 if the window passes every stage, else -s for the stage s that
+	         rejected it (0 for the first, cvHaarDetectObjects skips a column then)
+*/
+static int haarflat_evalWindow(const HaarFlatCascade_t *fc, const HaarFlatScale_t *sc,
+							   const int *p, const double *pq)
+{
+	const double nf = haarflat_normFactor(sc, p, pq);
+	const int *o = sc->ofs;
+	const float *w = sc->w;
+
+	for(int s = 0, j = 0; s < fc->numStages; s++){
+		double stageSum = 0.;
+		for(; j < fc->stageEnd[s]; j++, o += 4 * HAARFLAT_MAX_RECTS, w += HAARFLAT_MAX_RECTS){
+			double f = (p[o[0]] - p[o[1]] - p[o[2]] + p[o[3]]) * w[0];
+			f += (p[o[4]] - p[o[5]] - p[o[6]] + p[o[7]]) * w[1];
+			if(fc->numRects[j] == 3)
+				f += (p[o[8]] - p[o[9]] - p[o[10]] + p[o[11]]) * w[2];
+			stageSum += f < fc->threshold[j] * nf ? fc->alphaLeft[j] : fc->alphaRight[j];
+		}
+		if(stageSum < fc->stageThreshold[s])
+			return -s;
+	}
+	return 1;
+}
+
+/* Rect sums are gathered and weighted in float vectors of HAARFLAT_LANES,
+   everything after the weighting runs on two double vectors (lo, hi lanes) */
+#if HAARFLAT_LANES == 8
+typedef __m256  haarflat_vf;
+typedef __m256i haarflat_vi;
+typedef struct { __m256d lo, hi; } haarflat_vd;
+#define HV_SETF(a)       _mm256_set1_ps(a)
+#define HV_MULF(a, b)    _mm256_mul_ps(a, b)
+#define HV_SUBI(a, b)    _mm256_sub_epi32(a, b)
+#define HV_ADDI(a, b)    _mm256_add_epi32(a, b)
+#define HV_CVTI(a)       _mm256_cvtepi32_ps(a)
+#define HD_T             __m256d
+#define HD_SET(a)        _mm256_set1_pd(a)
+#define HD_LOAD(p)       _mm256_loadu_pd(p)
+#define HD_ADD(a, b)     _mm256_add_pd(a, b)
+#define HD_MUL(a, b)     _mm256_mul_pd(a, b)
+#define HD_LT(a, b)      _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define HD_GE(a, b)      _mm256_cmp_pd(a, b, _CMP_GE_OQ)
+#define HD_SEL(m, a, b)  _mm256_blendv_pd(b, a, m) //m ? a : b
+#define HD_MASK(m)       _mm256_movemask_pd(m)
+#define HD_HALF          4
+
+/* float lanes 0-3 and 4-7 widened to double */
+static inline haarflat_vd haarflat_widen(haarflat_vf f)
+{
+	haarflat_vd d;
+	d.lo = _mm256_cvtps_pd(_mm256_castps256_ps128(f));
+	d.hi = _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1));
+	return d;
+}
+
+/* integral values of 8 windows, @lanes elements from @p (a hardware gather) */
+static inline haarflat_vi haarflat_load(const int *p, const int *lanes, bool /*pairs*/)
+{
+	return _mm256_i32gather_epi32(p, _mm256_loadu_si256((const __m256i *)lanes), 4);
+}
+#else
+typedef __m128  haarflat_vf;
+typedef __m128i haarflat_vi;
+typedef struct { __m128d lo, hi; } haarflat_vd;
+#define HV_SETF(a)       _mm_set1_ps(a)
+#define HV_MULF(a, b)    _mm_mul_ps(a, b)
+#define HV_SUBI(a, b)    _mm_sub_epi32(a, b)
+#define HV_ADDI(a, b)    _mm_add_epi32(a, b)
+#define HV_CVTI(a)       _mm_cvtepi32_ps(a)
+#define HD_T             __m128d
+#define HD_SET(a)        _mm_set1_pd(a)
+#define HD_LOAD(p)       _mm_loadu_pd(p)
+#define HD_ADD(a, b)     _mm_add_pd(a, b)
+#define HD_MUL(a, b)     _mm_mul_pd(a, b)
+#define HD_LT(a, b)      _mm_cmplt_pd(a, b)
+#define HD_GE(a, b)      _mm_cmpge_pd(a, b)
+#define HD_SEL(m, a, b)  _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b))
+#define HD_MASK(m)       _mm_movemask_pd(m)
+#define HD_HALF          2
+
+/* float lanes 0-1 and 2-3 widened to double */
+static inline haarflat_vd haarflat_widen(haarflat_vf f)
+{
+	haarflat_vd d;
+	d.lo = _mm_cvtps_pd(f);
+	d.hi = _mm_cvtps_pd(_mm_movehl_ps(f, f));
+	return d;
+}
+
+/* integral values of 4 windows, @lanes elements from @p.
+   SSE2 has no gather: windows 2 apart (@pairs, ystep 2, the small and most
+   scanned scales) take two vector loads and a shuffle, others 4 scalar loads */
+static inline haarflat_vi haarflat_load(const int *p, const int *lanes, bool pairs)
+{
+	if(pairs){
+		__m128 lo = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)p));
+		__m128 hi = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(p + 4)));
+		return _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+	}
+	return _mm_setr_epi32(p[lanes[0]], p[lanes[1]], p[lanes[2]], p[lanes[3]]);
+}
+#endif
+
+static inline haarflat_vd haarflat_addd(haarflat_vd a, haarflat_vd b)
+{
+	a.lo = HD_ADD(a.lo, b.lo);
+	a.hi = HD_ADD(a.hi, b.hi);
+	return a;
+}
+
+/* haarflat_rectSum: sum of one rect over every lane weighted by @w, in float as
+   cvRunHaarClassifierCascade does, then widened */
+static inline haarflat_vd haarflat_rectSum(const int *p, const int *o, const int *lanes, bool pairs, float w)
+{
+	haarflat_vi r = HV_SUBI(haarflat_load(p + o[0], lanes, pairs), haarflat_load(p + o[1], lanes, pairs));
+	r = HV_ADDI(HV_SUBI(r, haarflat_load(p + o[2], lanes, pairs)), haarflat_load(p + o[3], lanes, pairs));
+	return haarflat_widen(HV_MULF(HV_CVTI(r), HV_SETF(w)));
+}
+
+/*
+haarflat_evalWindows:
+	Runs the cascade on HAARFLAT_LANES windows of the same row, with the
+	arithmetic of haarflat_evalWindow. The caller guarantees every window lies
+	inside the image.
+
+	@p, pq: origin of the first window in the sum / sqsum images
+	@lanes: column of each window relative to the first one (lanes[0] is 0),
+	        the rounded grid origins of the scale
+	@results: receive haarflat_evalWindow's result of each window
+	@return: bit i set if window i passes every stage
+*/
+static int haarflat_evalWindows(const HaarFlatCascade_t *fc, const HaarFlatScale_t *sc,
+								const int *p, const double *pq, const int *lanes, int *results)
+{
+	const int all = (1 << HAARFLAT_LANES) - 1;
+	const bool pairs = lanes[HAARFLAT_LANES - 1] == 2 * (HAARFLAT_LANES - 1); //lanes never step by less than 2
+	double nfs[HAARFLAT_LANES];
+	for(int l = 0; l < HAARFLAT_LANES; l++){
+		nfs[l] = haarflat_normFactor(sc, p + lanes[l], pq + lanes[l]);
+		results[l] = 1;
+	}
+	const HD_T nfLo = HD_LOAD(nfs), nfHi = HD_LOAD(nfs + HD_HALF);
+
+	int alive = all;
+	const int *o = sc->ofs;
+	const float *w = sc->w;
+
+	for(int s = 0, j = 0; s < fc->numStages; s++){
+		haarflat_vd stageSum;
+		stageSum.lo = stageSum.hi = HD_SET(0.);
+		for(; j < fc->stageEnd[s]; j++, o += 4 * HAARFLAT_MAX_RECTS, w += HAARFLAT_MAX_RECTS){
+			haarflat_vd f = haarflat_addd(haarflat_rectSum(p, o, lanes, pairs, w[0]),
+										  haarflat_rectSum(p, o + 4, lanes, pairs, w[1]));
+			if(fc->numRects[j] == 3) //uniform across lanes, no divergence
+				f = haarflat_addd(f, haarflat_rectSum(p, o + 8, lanes, pairs, w[2]));
+
+			const HD_T t = HD_SET(fc->threshold[j]);
+			const HD_T left = HD_SET(fc->alphaLeft[j]), right = HD_SET(fc->alphaRight[j]);
+			stageSum.lo = HD_ADD(stageSum.lo, HD_SEL(HD_LT(f.lo, HD_MUL(t, nfLo)), left, right));
+			stageSum.hi = HD_ADD(stageSum.hi, HD_SEL(HD_LT(f.hi, HD_MUL(t, nfHi)), left, right));
+		}
+		const HD_T thr = HD_SET(fc->stageThreshold[s]);
+		const int pass = HD_MASK(HD_GE(stageSum.lo, thr)) | HD_MASK(HD_GE(stageSum.hi, thr)) << HD_HALF;
+		for(int dead = alive & ~pass, l = 0; dead; l++, dead >>= 1)
+			if(dead & 1)
+				results[l] = -s;
+		alive &= pass;
+		if(!alive) //every lane rejected
+			return 0;
+	}
+	return alive;
+}
+
+static void haarflat_releaseScale(HaarFlatScale_t *sc)
+{
+	free(sc->ofs);
+	free(sc->w);
+	sc->ofs = NULL;
+	sc->w = NULL;
+}
+
+static void haarflat_release(HaarFlatCascade_t *fc)
+{
+	free(fc->stageEnd);
+	free(fc->stageThreshold);
+	free(fc->threshold);
+	free(fc->alphaLeft);
+	free(fc->alphaRight);
+	free(fc->numRects);
+	free(fc->rect);
+	free(fc->weight);
+}
+
+#endif
@@ -28,11 +28,29 @@ Help of Yeshua Ha'Mashiach
 #include "NPTrackingTools.h"
 #endif
 
+#include "archive.h"
+#include "augment.h"
+#include "pyramid.h"
+
+#if COMPILED_MODEL
+#include "PostureMLP.h" //ModelCodegen mlp t1.xml PostureMLP.h
+#endif
+
 #define W 200
 #define H 200
+#define FEATURE_LEVEL 0 //pyramid level fed to the network (1 = 100x100 inputs, needs retraining)
+#define FW (W >> FEATURE_LEVEL)
+#define FH (H >> FEATURE_LEVEL)
 #define KEY_ESC 27
 #define KEY_NOTPRESSED 0
 #define MAX_NUM_CAMERAS 3
+#define POSTURE_ARCHIVE "Postures.wmgp" //DatasetTool pack Postures Postures.wmgp
+
+#if AUGMENT
+#define AUGMENT_BATCH_SIZE 256 //samples per training call
+#define AUGMENT_NUM_BATCHES 200
+#define AUGMENT_ITER 20 //backprop iterations per batch
+#endif
 
 #pragma warning(disable:4716) //disable missing return from function error 
 
@@ -99,12 +117,15 @@ CvMat *TMatrix(IplImage *img, IplImage **tmp32)
    copied into the data (input) matrix and the response matrix is filled with
    the correct class for each modulo 500 images
    The directory is commonly "Postures"
+   When @archive is given the frames are decoded from the packed archive instead
 */
-void preprocessANN_Input(CvMat **data, CvMat **responses, const char *dir)
+void preprocessANN_Input(CvMat **data, CvMat **responses, const char *dir,
+                         const DatasetArchive_t *archive = NULL)
 {
     static const char *poseNames[] = {"1pose", "2pose", "3pose", "4pose"};
     IplImage *loadImage, *tmpImage;
-    const int varCount = W * H;
+    ImagePyramid_t pyr;
+    const int varCount = FW * FH;
     CvMat *mat = NULL;
     char **filenames = (char **)malloc(sizeof(char *) * 1200);
     int fcount = 0;
@@ -122,9 +143,19 @@ void preprocessANN_Input(CvMat **data, CvMat **responses, const char *dir)
     *responses = cvCreateMat(4 * 300, 4, CV_32FC1); //(200, 4)
 
     float classKind = 0.0f;
+    pyramid_initialize(&pyr);
     for(int i = 0; i < 1200; i++){ //process rows
-        loadImage = cvLoadImage(filenames[i], 0); //load greyscale
-        mat = TMatrix(loadImage, &tmpImage);
+        if(archive) //pose i / 300 + 1, frame i % 300 + 1
+            loadImage = archive_load(archive, archive_find(archive, i / 300 + 1, i % 300 + 1));
+        else
+            loadImage = cvLoadImage(filenames[i], 0); //load greyscale
+        if(!loadImage){
+            fprintf(stderr, "Error: Couldn't open %s!\n", filenames[i]);
+            exit(-1);
+        }
+        pyramid_build(&pyr, loadImage, FEATURE_LEVEL + 1);
+        mat = TMatrix(pyr.level[FEATURE_LEVEL], &tmpImage);
+        cvReleaseImage(&loadImage);
 
         //fill each row in data with 1D mat
         for(int feature = 0; feature < varCount; feature++){
@@ -145,6 +176,8 @@ void preprocessANN_Input(CvMat **data, CvMat **responses, const char *dir)
         }
     }
 
+    pyramid_destroy(&pyr);
+
     //free storage for filenames
     for(int i = 0; i < 1200; i++){
         free(filenames[i]);
@@ -153,6 +186,18 @@ void preprocessANN_Input(CvMat **data, CvMat **responses, const char *dir)
     free(filenames);
 }
 
+/* Fills the response matrix for a batch of poses [0, 4) with the same
+   class / punishment scheme as preprocessANN_Input
+*/
+void ANN_Responses(const CvMat *labels, CvMat *responses)
+{
+    for(int i = 0; i < labels->rows; i++){
+        float classKind = (float)(labels->data.i[i] + 1);
+        for(int j = 0; j < responses->cols; j++)
+            cvmSet(responses, i, j, classKind == j + 1 ? classKind : -10 * classKind);
+    }
+}
+
 #if WIN_32
 /* thread to execute display of camera frames */
 void *showCameraWindow(void *arg)
@@ -184,20 +229,58 @@ int main()
     const int classCount = 4;
     CvMat *data, *responses, *mlpResponse;
     data = responses = mlpResponse = NULL;
+    DatasetArchive_t archive;
+    bool packed;
 #if TRAIN
+#if !AUGMENT
     printf("Loading samples from the database ...\n");
-    preprocessANN_Input(&data, &responses, "Postures");
+    packed = archive_open(&archive, POSTURE_ARCHIVE); //falls back to the JPEGs
+    preprocessANN_Input(&data, &responses, "Postures", packed ? &archive : NULL);
+    archive_close(&archive);
+#endif
 
 
-    int layer_sz[] = {W*H, 500, 500, classCount};
+    int layer_sz[] = {FW*FH, 500, 500, classCount};
 
     CvMat layer_sizes = cvMat(1, (int)(sizeof(layer_sz) / sizeof(layer_sz[0])), CV_32S, layer_sz);
     mlp.create(&layer_sizes);
 
 	system("echo %date%-%time%");
+#if AUGMENT
+    /* balanced, augmented variants of every captured frame are streamed into the
+       network batch by batch, the weights carry over from one batch to the next */
+    static const char *poseNames[] = {"1pose", "2pose", "3pose", "4pose"};
+    IplImage **sources;
+    int *poses;
+    Augmenter_t augmenter;
+
+    printf("Loading source frames ...\n");
+    packed = archive_open(&archive, POSTURE_ARCHIVE);
+    int numSources = augment_loadPoses(packed ? &archive : NULL, "Postures", poseNames, classCount, 0,
+                                       &sources, &poses);
+    archive_close(&archive);
+    if(!augment_initialize(&augmenter, sources, poses, numSources, classCount, NULL, cvSize(FW, FH),
+                           FEATURE_LEVEL, AUGMENT_BATCH_SIZE, 0, cvGetTickCount()))
+        exit(-1);
+
+    printf("Training the classifier on %d augmented batches of %d ...\n", AUGMENT_NUM_BATCHES, AUGMENT_BATCH_SIZE);
+    responses = cvCreateMat(AUGMENT_BATCH_SIZE, classCount, CV_32FC1);
+    for(int i = 0; i < AUGMENT_NUM_BATCHES; i++){
+        AugmentBatch_t *batch = augment_next(&augmenter); //the next ones are rendered meanwhile
+        ANN_Responses(batch->labels, responses);
+        mlp.train(batch->data, responses, (const CvMat *)0, (const CvMat *)0,
+                  CvANN_MLP_TrainParams(cvTermCriteria(CV_TERMCRIT_ITER, AUGMENT_ITER, 0.01F),
+                                        CvANN_MLP_TrainParams::BACKPROP, 0.001),
+                  i ? CvANN_MLP::UPDATE_WEIGHTS | CvANN_MLP::NO_INPUT_SCALE | CvANN_MLP::NO_OUTPUT_SCALE : 0);
+        augment_release(&augmenter, batch);
+    }
+    augment_destroy(&augmenter);
+    augment_freePoses(sources, poses, numSources);
+#else
     printf("Training the classifier, might take a few minutes (~10min) ...\n");
     mlp.train(data, responses, (const CvMat *)0, (const CvMat *)0, CvANN_MLP_TrainParams(cvTermCriteria(CV_TERMCRIT_ITER, 300, 0.01F),
                                                              CvANN_MLP_TrainParams::BACKPROP, 0.001));
+#endif
 
     printf("Time Taken:\n");
     system("echo %date%-%time%");
@@ -223,15 +306,57 @@ int main()
     cvReleaseMat(&responses);
     cvReleaseMat(&mlpResponse);
 
+#elif COMPILED_MODEL && VERIFY
+    /* cross-check the compiled network against CvANN_MLP::predict on the training set */
+    int mismatches = 0;
+    float maxError = 0.0f, y[POSTURE_MLP_OUTPUTS];
+
+    mlp.load("t1.xml");
+    packed = archive_open(&archive, POSTURE_ARCHIVE); //falls back to the JPEGs
+    preprocessANN_Input(&data, &responses, "Postures", packed ? &archive : NULL);
+    archive_close(&archive);
+    assert(data->cols == POSTURE_MLP_INPUTS && classCount == POSTURE_MLP_OUTPUTS);
+    mlpResponse = cvCreateMat(1, classCount, CV_32F);
+
+    for(int i = 0; i < data->rows; i++){
+        CvMat sample;
+        cvGetRow(data, &sample, i);
+        mlp.predict(&sample, mlpResponse);
+        postureMLP_predict(sample.data.fl, y);
+
+        int expected = 0, actual = 0;
+        for(int j = 0; j < classCount; j++){
+            float e = fabs(mlpResponse->data.fl[j] - y[j]);
+            if(e > maxError)
+                maxError = e;
+            if(mlpResponse->data.fl[j] > mlpResponse->data.fl[expected]) expected = j;
+            if(y[j] > y[actual]) actual = j;
+        }
+        mismatches += expected != actual;
+    }
+    printf("Compiled MLP: %d/%d class mismatches, max |error| = %g\n", mismatches, data->rows, maxError);
+
+    cvReleaseMat(&data);
+    cvReleaseMat(&responses);
+    cvReleaseMat(&mlpResponse);
+
 #elif !RUN
-    mlp.load("t1.xml"/*file.xml*/);
     mlpResponse = cvCreateMat(1, classCount, CV_32F);
 
     IplImage *t = NULL;
     IplImage *img = cvLoadImage(path, 0);
-
-    CvMat *mat = TMatrix(img, &t);
+    ImagePyramid_t pyr;
+
+    pyramid_initialize(&pyr);
+    pyramid_build(&pyr, img, FEATURE_LEVEL + 1);
+    CvMat *mat = TMatrix(pyr.level[FEATURE_LEVEL], &t);
+    pyramid_destroy(&pyr);
+#if COMPILED_MODEL
+    postureMLP_predict(mat->data.fl, mlpResponse->data.fl); //no model file at runtime
+#else
+    mlp.load("t1.xml"/*file.xml*/);
     mlp.predict(mat, mlpResponse);
+#endif
 
     displayMatrix(mlpResponse);
 
@@ -0,0 +1,118 @@
+/* Motion Gate
+   Decides whether a frame differs enough from the last processed one to be
+   worth processing. While the hand is still the blob analysis and the
+   classifiers are skipped and the previous result is re-used.
+
+   Each frame is reduced to a signature of 8x8 block sums with _mm_sad_epu8
+   (a 1/64 downsample in one pass, 16 pixels per instruction) and compared
+   with the signature of the last processed frame. A frame is processed when
+   any block's mean changes by more than the threshold, or when maxSkip
+   frames in a row were skipped so that slow drift is still picked up.
+
+   Idris Soule
+*/
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <cv.h>
+#include <emmintrin.h>
+
+#define MOTION_BLOCK 8
+
+typedef struct {
+	unsigned short *sig; //block sums of the current frame
+	unsigned short *ref; //of the last processed frame
+	int blocksX, blocksY;
+	int threshold;       //block sum change, i.e mean change * 64
+	int maxSkip;
+	int skipped;         //frames skipped since the last processed one
+	bool primed;
+	long processed, skippedTotal;
+}MotionGate_t;
+
+/*
+motion_initialize:
+	@size: frame size, whole 8x8 blocks are compared (a partial last block is ignored)
+	@meanThreshold: mean grey level change of a block that counts as motion i.e 4
+	@maxSkip: frames skipped at most in a row i.e 30
+*/
+static void motion_initialize(MotionGate_t *mg, CvSize size, int meanThreshold, int maxSkip)
+{
+	assert(size.width >= 2 * MOTION_BLOCK && size.height >= MOTION_BLOCK);
+	memset(mg, 0, sizeof(*mg));
+	mg->blocksX = size.width / MOTION_BLOCK;
+	mg->blocksY = size.height / MOTION_BLOCK;
+	mg->sig = (unsigned short *)calloc(mg->blocksX * mg->blocksY, sizeof(unsigned short));
+	mg->ref = (unsigned short *)calloc(mg->blocksX * mg->blocksY, sizeof(unsigned short));
+	mg->threshold = meanThreshold * MOTION_BLOCK * MOTION_BLOCK;
+	mg->maxSkip = maxSkip;
+}
+
+/* motion_signature: 8x8 block sums of an 8-bit frame */
+static void motion_signature(MotionGate_t *mg, const IplImage *img)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const int pairs = mg->blocksX / 2; //two blocks per 16 bytes
+
+	for(int by = 0; by < mg->blocksY; by++){
+		unsigned short *sig = mg->sig + by * mg->blocksX;
+		const uchar *row = (const uchar *)img->imageData + by * MOTION_BLOCK * img->widthStep;
+		for(int bx = 0; bx < pairs; bx++){
+			__m128i acc = zero;
+			for(int y = 0; y < MOTION_BLOCK; y++)
+				acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(row + y * img->widthStep + bx * 16)), zero));
+			sig[2 * bx] = (unsigned short)_mm_cvtsi128_si32(acc);
+			sig[2 * bx + 1] = (unsigned short)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+		}
+		if(mg->blocksX & 1){ //odd block count, last block scalar
+			unsigned int s = 0;
+			for(int y = 0; y < MOTION_BLOCK; y++)
+				for(int x = 0; x < MOTION_BLOCK; x++)
+					s += row[y * img->widthStep + (mg->blocksX - 1) * MOTION_BLOCK + x];
+			sig[mg->blocksX - 1] = (unsigned short)s;
+		}
+	}
+}
+
+/*
+motion_changed:
+	@img: 8-bit single channel frame of the size given to motion_initialize
+	@return: true if the frame must be processed, false if the last result still holds
+*/
+static bool motion_changed(MotionGate_t *mg, const IplImage *img)
+{
+	assert(img->nChannels == 1 && img->width / MOTION_BLOCK == mg->blocksX);
+	motion_signature(mg, img);
+
+	const int n = mg->blocksX * mg->blocksY;
+	bool changed = !mg->primed || mg->skipped >= mg->maxSkip;
+	for(int i = 0; i < n && !changed; i++)
+		changed = abs((int)mg->sig[i] - (int)mg->ref[i]) > mg->threshold;
+
+	if(!changed){
+		mg->skipped++;
+		mg->skippedTotal++;
+		return false;
+	}
+	/* the signature of the processed frame is the new reference */
+	unsigned short *t = mg->ref;
+	mg->ref = mg->sig;
+	mg->sig = t;
+	mg->skipped = 0;
+	mg->primed = true;
+	mg->processed++;
+	return true;
+}
+
+static void motion_destroy(MotionGate_t *mg)
+{
+	free(mg->sig);
+	free(mg->ref);
+	mg->sig = mg->ref = NULL;
+}
+
+#endif
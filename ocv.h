@@ -5,6 +5,13 @@
 #include <highgui.h>
 #include <cv.h>
 
+#include "dataset.h"
+#include "archive.h"
+#include "segment.h"
+#include "threshold.h"
+#include "background.h"
+#include "shape.h"
+
 #if !defined (CVX_RED) && !defined (CVX_BLUE)
 #define CVX_RED		CV_RGB(0xff,0x00,0x00)
 #define CVX_BLUE	CV_RGB(0x00,0x00,0xff)
@@ -19,36 +26,28 @@ class OpenCV_Test {
 public:
 	void showPicture(const char * name);
 	void histogramTest(const char *imageName);
+	void segmentCamera(int index);
 	void drawContour(const char *imageName);
 	void pts2convexhull(void);
 	IplImage* extractContourConvex(IplImage *img_8uc1);
 
-	void RGB_2_GRAY(const char *dir);
+	void RGB_2_GRAY(const char *poseName);
 /**
 ** |------- HAAR Training Stubs -------|
 */ 
 	void generatePositiveSampleData(const char *poseName, int n);
 	void generateNegativeSampleData(void);
+	void generatePositiveSampleData(const DatasetArchive_t *ar, const char *poseName);
+	void generateNegativeSampleData(const DatasetArchive_t *ar);
 
 };
 
+/* converts every frame of Postures\\<poseName> to grey in place, see dataset_convertGray */
 void OpenCV_Test::RGB_2_GRAY(const char *poseName)
 {
-	IplImage *src, *dst;
-	char *fn = (char*)malloc(sizeof(char) * 100);
-	for(int i = 0; i < 8610; i++){
-		sprintf(fn, "Postures\\1pose\\%s-%d.jpg",poseName,i+1);
-		src = cvLoadImage(fn);
-		dst = cvCreateImage(cvSize(src->width, src->height), IPL_DEPTH_8U, 1);
-		cvCvtColor(src, dst, CV_RGB2GRAY);
-		cvSaveImage(fn, dst); //overwrite
-
-		if(i % 2000 == 0 && i != 0)
-			printf("N = %d\a\n", i / 2000);
-		cvReleaseImage(&dst);
-		//cvReleaseImage(&src);
-	}
-	free(fn);
+	char dir[DATASET_PATH_LEN];
+	dataset_path(dir, "Postures", poseName);
+	dataset_convertGray(dir, 0, NULL);
 }
 
 //will generate the idx file for 1st part of HAAR training
@@ -86,6 +85,43 @@ void OpenCV_Test::generateNegativeSampleData(void)
 	fclose(out);
 }
 
+/* same as above but the frames listed are the ones actually packed in the archive
+   (DatasetTool pack Postures ...), no counting or opening of the JPEGs
+*/
+void OpenCV_Test::generatePositiveSampleData(const DatasetArchive_t *ar, const char *poseName)
+{
+	char resultFileName[50];
+	const int label = atoi(poseName);
+	sprintf(resultFileName, "%s.idx",poseName);
+	FILE *out = fopen(resultFileName, "w");
+	if(!out){
+		perror(resultFileName);
+		return;
+	}
+
+	for(int i = 0; i < archive_count(ar); i++){
+		const ArchiveEntry_t *e = archive_entry(ar, i);
+		if(e->label == label)
+			fprintf(out, "Postures\\%s-%u.jpg 1 0 150 380 300\n", poseName, e->frame);
+	}
+	fclose(out);
+}
+
+//@ar: archive of PosturesNegative, replaces the hard-coded image counts
+void OpenCV_Test::generateNegativeSampleData(const DatasetArchive_t *ar)
+{
+	FILE *out = fopen("background.idx", "w");
+	if(!out){
+		perror("background.idx");
+		return;
+	}
+	for(int i = 0; i < archive_count(ar); i++){
+		const ArchiveEntry_t *e = archive_entry(ar, i);
+		fprintf(out, "PosturesNegative\\%dpose-%u.jpg\n", e->label, e->frame);
+	}
+	fclose(out);
+}
+
 /* Operations for HAAR Training */
 
 
@@ -198,7 +234,7 @@ void OpenCV_Test::drawContour(const char *imageName)
 	IplImage *img_edge = cvCreateImage(cvGetSize(img_8uc1), 8, 1);
 	IplImage *img_8uc3 = cvCreateImage(cvGetSize(img_8uc1), 8, 3);
 
-	cvThreshold(img_8uc1, img_edge, 128, 255, CV_THRESH_BINARY);
+	threshold_image(img_8uc1, img_edge); //Otsu instead of a fixed 128
 
 	CvMemStorage *storage = cvCreateMemStorage();
 	CvSeq *first_contour = NULL;
@@ -288,10 +324,65 @@ void OpenCV_Test::histogramTest(const char *imageName)
         cvNamedWindow( "H-S Histogram", 1 );
         cvShowImage( "H-S Histogram", hist_img );
 
+        /* same histogram learnt from the centre of the image and back-projected */
+        HandSegmenter_t seg;
+        IplImage *backProjection = cvCreateImage( cvGetSize(src), 8, 1 );
+        segment_initialize( &seg, 0.05f, 0.1f );
+        segment_learn( &seg, src, cvRect(src->width/4, src->height/4, src->width/2, src->height/2) );
+        segment_frame( &seg, src, backProjection, false, false );
+        cvNamedWindow( "Back Projection", 1 );
+        cvShowImage( "Back Projection", backProjection );
+
         cvWaitKey(0);
+        segment_destroy( &seg );
+        cvReleaseImage( &backProjection );
     }
 }
 
+/* Live hand segmentation on a colour camera
+   'l' learns the hand from the box in the centre of the frame, the model is
+   then updated every frame. ESC quits
+*/
+void OpenCV_Test::segmentCamera(int index)
+{
+	CvCapture *capture = cvCaptureFromCAM(index);
+	if(!capture){
+		fprintf(stderr, "Error: Couldn't open camera %d!\n", index);
+		return;
+	}
+
+	HandSegmenter_t seg;
+	IplImage *mask = NULL;
+	segment_initialize(&seg, 0.05f, 0.1f);
+	cvNamedWindow("Camera", CV_WINDOW_AUTOSIZE);
+	cvNamedWindow("Hand", CV_WINDOW_AUTOSIZE);
+
+	for(int key = 0; key != 27; ){
+		IplImage *frame = cvQueryFrame(capture);
+		if(!frame)
+			break;
+		if(!mask)
+			mask = cvCreateImage(cvGetSize(frame), 8, 1);
+
+		CvRect box = cvRect(frame->width * 3/8, frame->height * 3/8, frame->width/4, frame->height/4);
+		if(key == 'l')
+			segment_learn(&seg, frame, box);
+		if(seg.trained){
+			segment_frame(&seg, frame, mask, true, true);
+			cvShowImage("Hand", mask);
+		}
+		cvRectangle(frame, cvPoint(box.x, box.y), cvPoint(box.x + box.width, box.y + box.height), CVX_RED);
+		cvShowImage("Camera", frame);
+		key = cvWaitKey(10);
+	}
+
+	segment_destroy(&seg);
+	cvReleaseImage(&mask);
+	cvReleaseCapture(&capture);
+	cvDestroyWindow("Camera");
+	cvDestroyWindow("Hand");
+}
+
 
 
 /* AN adaptation from EmguCV (C#) with convex hull done */
@@ -304,11 +395,11 @@ IplImage * OpenCV_Test::extractContourConvex(IplImage *img_8uc1)
 	IplImage *img_edge = cvCreateImage(cvGetSize(img_8uc1), 8,1);
 	IplImage *img_8uc3 = cvCreateImage(cvGetSize(img_8uc1), 8,3);
 
-	//apply thresholding to the image
-	cvThreshold(img_8uc1, img_edge, 128, 255, CV_THRESH_BINARY);
+	//apply thresholding to the image (Otsu instead of a fixed 128)
+	threshold_image(img_8uc1, img_edge);
 
 	int nc;
-	nc = cvFindContours(img_8uc1, storage, &first_contour, sizeof(CvContour), CV_RETR_LIST); 
+	nc = cvFindContours(img_edge, storage, &first_contour, sizeof(CvContour), CV_RETR_LIST); 
 	if(nc == 0)
 		return NULL;
 
@@ -22,6 +22,11 @@
 #include "BlobResult.h"
 
 #include "NPTrackingTools.h"
+#include "threshold.h"
+#include "background.h"
+#include "motion.h"
+#include "pyramid.h"
+#include "morph.h"
 
 #if OCV_DEBUG 
 #include "ocv.h"
@@ -29,6 +34,9 @@
 
 #define W 200
 #define H 200
+#define BLOB_LEVEL 1 //pyramid level of the blob analysis, 1 = quarter resolution
+#define BW (W >> BLOB_LEVEL)
+#define BH (H >> BLOB_LEVEL)
 #define KEY_ESC 27
 #define KEY_NOTPRESSED 0
 #define MAX_NUM_CAMERAS 3
@@ -37,6 +45,9 @@
 
 int key = KEY_NOTPRESSED;
 pthread_mutex_t keyMutex = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER;
+AdaptiveThreshold_t blobThreshold; //replaces the fixed 20 given to CBlobResult
+BackgroundModel_t background; //reflections and fixed objects, removed before labeling
+MotionGate_t motion; //unchanged frames re-use the last posture
 
 typedef struct {
 	unsigned int i;
@@ -86,8 +97,8 @@ CBlobResult * ModifierFilter::modifiers(const CBlobResult *cbr)
 	
 	for(int i = 0; i < numBlobs; i++){
 		CBlob blob = cbr->GetBlob(i);
-		if(blob.MaxY() >= W) //blobs of image width/height
-			m1[i] = W;	
+		if(blob.MaxY() >= BW) //blobs of image width/height
+			m1[i] = BW;	
 		else
 			m1[i] = cbr->GetBlob(i).MinX();
 	}
@@ -97,8 +108,8 @@ CBlobResult * ModifierFilter::modifiers(const CBlobResult *cbr)
 	for(int j = 0; j < numBlobs; j++)
 	{
 		CBlob blob = cbr->GetBlob(j);
-		if(blob.MaxY() >= W) //blobs of image width/height
-			m2[j] = W;	
+		if(blob.MaxY() >= BW) //blobs of image width/height
+			m2[j] = BW;	
 		else
 			m2[j] = cbr->GetBlob(j).MaxX();
 	}
@@ -108,8 +119,8 @@ CBlobResult * ModifierFilter::modifiers(const CBlobResult *cbr)
 	for(int k = 0; k < numBlobs; k++) //RC sphere
 	{
 		CBlob blob = cbr->GetBlob(k);
-		if(blob.MaxY() >= W) //blobs of image width/height
-			m3[k] = W;	
+		if(blob.MaxY() >= BW) //blobs of image width/height
+			m3[k] = BW;	
 		else
 			m3[k] = cbr->GetBlob(k).MinY();
 	}
@@ -141,8 +152,8 @@ CBlob ModifierFilter::keyFeature(const CBlobResult *cbr)
 
 	for(int i = 0; i < numBlobs; i++){
 		CBlob blob = cbr->GetBlob(i);
-		if(blob.MaxY() >= W) //blobs of image width/height
-			m4[i] = -W;	
+		if(blob.MaxY() >= BW) //blobs of image width/height
+			m4[i] = -BW;	
 		else
 			m4[i] = cbr->GetBlob(i).MaxY();
 	}
@@ -161,6 +172,34 @@ CBlob ModifierFilter::keyFeature(const CBlobResult *cbr)
 
 
 
+/* refineCentroid
+
+   Centroid of the pixels above @level inside @roi of the full resolution
+   frame, the blobs themselves are found on a pyramid level
+   @roi: in full resolution coordinates
+   @scratch: 8-bit single channel of the frame size
+   @return: the centroid, the centre of the roi if it holds no pixel
+*/
+POINT refineCentroid(IplImage *frame, IplImage *scratch, CvRect roi, int level)
+{
+	const int x0 = MAX(roi.x - 2, 0), y0 = MAX(roi.y - 2, 0);
+	roi = cvRect(x0, y0, MIN(roi.x + roi.width + 2, frame->width) - x0,
+				 MIN(roi.y + roi.height + 2, frame->height) - y0);
+
+	CvMoments m;
+	cvSetImageROI(frame, roi);
+	cvSetImageROI(scratch, roi);
+	cvThreshold(frame, scratch, level, 255, CV_THRESH_BINARY);
+	cvMoments(scratch, &m, 1);
+	cvResetImageROI(frame);
+	cvResetImageROI(scratch);
+
+	POINT p;
+	p.x = (LONG)(m.m00 > 0 ? roi.x + m.m10 / m.m00 : roi.x + roi.width / 2);
+	p.y = (LONG)(m.m00 > 0 ? roi.y + m.m01 / m.m00 : roi.y + roi.height / 2);
+	return p;
+}
+
 /* thread to execute display of camera frames */
 void *showCameraWindow(void *arg)
 {
@@ -171,6 +210,9 @@ void *showCameraWindow(void *arg)
 	int x  = 0, y  = 0;
 	int lx = 0, ly = 0;
 	int rx = 0, ry = 0;
+	const char *lastPosture = NULL; //result of the last processed frame
+	stateEvent_t lastEvent = NOP;   //and the event it emitted, with its cursor
+	POINT lastCursor = {0, 0};
 
 	enum {EMPTY = 2, DRAG = 4, _ZOOM = 8, _TRACK = 9};
 
@@ -179,23 +221,51 @@ void *showCameraWindow(void *arg)
 	if(myCam->i != 0)
 		pthread_exit(NULL); //use Camera 21 for now
 
+	IplImage *binary = cvCreateImage(cvSize(BW,BH), IPL_DEPTH_8U, 1);
+	IplImage *scratch = cvCreateImage(cvSize(W,H), IPL_DEPTH_8U, 1);
+	ImagePyramid_t pyr;
+	MorphFilter_t morph;
+	pyramid_initialize(&pyr);
+	morph_initialize(&morph, BW);
+
 	for( ;key != KEY_ESC; ){
 		TT_CameraFrameBuffer(myCam->i, W, H, 0, 8, (unsigned char *)myCam->displayImage->imageData);
 		cvFlip(myCam->displayImage, 0, -1);
 		cvShowImage(windowName, myCam->displayImage);
 		
 		pthread_mutex_lock(&keyMutex);
-		hand = new CBlobResult(myCam->displayImage, 0, 20, false);
+		pyramid_build(&pyr, myCam->displayImage, BLOB_LEVEL + 1); //once per frame
+		IplImage *coarse = pyr.level[BLOB_LEVEL];
+		if(!motion_changed(&motion, coarse)){
+			/* hand still: skip the blob analysis and re-emit the cached posture */
+			if(lastPosture)
+				puts(lastPosture);
+			if(lastEvent != NOP)
+				fsm_queue_emit(lastEvent, lastCursor);
+			key = cvWaitKey(50);
+			pthread_mutex_unlock(&keyMutex);
+			continue;
+		}
+		background_apply(&background, coarse, binary); //only the moving hand remains
+		const int level = threshold_apply(&blobThreshold, binary, binary);
+		morph_open(&morph, binary); //sensor specks would count as blobs
+		hand = new CBlobResult(binary, 0, 128, false); //already 0/255
+		lastEvent = NOP;
 		
 		switch(hand->GetNumBlobs()){
 			case EMPTY:
-				puts("Hand not in view!");
+				puts(lastPosture = "Hand not in view!");
 			break;
 		
-			case _ZOOM: puts("ZOOM");
+			case _ZOOM: puts(lastPosture = "ZOOM");
+			{
+				POINT at = {x, y}; //last tracked position
+				fsm_queue_emit(lastEvent = ZOOM, lastCursor = at);
+			}
 			break;
 
                         case _TRACK:
+			lastPosture = "TRACK";
 			do {
 
 			ModifierFilter modFilter;
@@ -207,8 +277,10 @@ void *showCameraWindow(void *arg)
 			CBlobGetXCenter centreX;
 			CBlobGetYCenter centreY;
 
-			cursor.x = (LONG) centreX(keyF);
-			cursor.y = (LONG) centreY(keyF);
+			/* the cursor needs the precise centroid, full resolution inside the key feature only */
+			CvRect roi = cvRect((int)keyF.MinX(), (int)keyF.MinY(),
+								(int)(keyF.MaxX() - keyF.MinX()) + 1, (int)(keyF.MaxY() - keyF.MinY()) + 1);
+			cursor = refineCentroid(myCam->displayImage, scratch, pyramid_toLevel0(roi, BLOB_LEVEL), level);
 
 
 #endif
@@ -217,17 +289,18 @@ void *showCameraWindow(void *arg)
 				y >= cursor.y - 2 && y <= cursor.y + 2) {//some type of click?
 				POINT lSphere, rSphere;
 
-				lSphere.x = (LONG) centreX(filteredHand->GetBlob(1)); //TODO Assert idx 1
-				lSphere.y = (LONG) centreY(filteredHand->GetBlob(1));
+				lSphere.x = (LONG) centreX(filteredHand->GetBlob(1)) << BLOB_LEVEL; //TODO Assert idx 1
+				lSphere.y = (LONG) centreY(filteredHand->GetBlob(1)) << BLOB_LEVEL;
 
-				rSphere.x = (LONG) centreX(filteredHand->GetBlob(0));
-				rSphere.y = (LONG) centreY(filteredHand->GetBlob(0));
+				rSphere.x = (LONG) centreX(filteredHand->GetBlob(0)) << BLOB_LEVEL;
+				rSphere.y = (LONG) centreY(filteredHand->GetBlob(0)) << BLOB_LEVEL;
 
 				const int threshold = 3;
 				if( ly >= (lSphere.y - threshold) && ly <= (lSphere.y + threshold)){ //LEFT CLICK
 						printf("LEFT CLICK \n");
 						lx = lSphere.x;
 						ly = lSphere.y;
+						fsm_queue_emit(lastEvent = LEFT, lastCursor = cursor);
 				}
 				
 			}
@@ -237,6 +310,7 @@ void *showCameraWindow(void *arg)
 
 				x = cursor.x;
 				y = cursor.y;
+				fsm_queue_emit(lastEvent = TRACK, lastCursor = cursor); //coalesced with older positions if the FSM lags
 			}
 
 
@@ -244,13 +318,17 @@ void *showCameraWindow(void *arg)
 			while(0);
 			break;
 			default:
-				puts("<<UNKNOWN>>\n");
+				puts(lastPosture = "<<UNKNOWN>>\n");
 		}
 
 		delete hand;
 		key = cvWaitKey(50); //delay atleast n ms for TT firmware propogation delay
 		pthread_mutex_unlock(&keyMutex);
 	}
+	pyramid_destroy(&pyr);
+	morph_destroy(&morph);
+	cvReleaseImage(&scratch);
+	cvReleaseImage(&binary);
 	cvReleaseImage(&myCam->displayImage);
 	pthread_exit(NULL);
 }
@@ -285,7 +363,10 @@ int main()
     */
 
 	SetPriorityClass(GetCurrentProcess(), NORMAL_PRIORITY_CLASS/*(HIGH)REALTIME_PRIORITY_CLASS*/); 
-	fsm_initialize(TRACK);
+	fsm_initialize(TRACK, NULL); //SendInput, batched per frame
+	threshold_initialize(&blobThreshold, THRESHOLD_OTSU, 0, 8, 20, 235);
+	background_initialize(&background, cvSize(BW,BH), 5, 9, 15);
+	motion_initialize(&motion, cvSize(BW,BH), 4, 30);
 
 	for(int i = 0; i < cameraCount; i++){
 		if(pthread_create(&threads[i], NULL, showCameraWindow, (void*)&cameras[i])){
@@ -308,6 +389,15 @@ int main()
 		pthread_join(threads[i], NULL);
 	
 	pthread_mutex_destroy(&keyMutex);
+	background_destroy(&background);
+	printf("Motion gate: %ld frames processed, %ld skipped\n", motion.processed, motion.skippedTotal);
+	motion_destroy(&motion);
+	{
+		FSMStats_t stats = fsm_stats();
+		printf("FSM: %ld events (%u refused, %u discarded), dispatch latency avg %.1f us max %llu us, handler avg %.1f us max %llu us, %ld parks, %ld TRACK coalesced\n",
+			   stats.dispatched, stats.refused, stats.discarded, stats.dispatched ? (double)stats.latencySum / stats.dispatched : 0., stats.latencyMax,
+			   stats.dispatched ? (double)stats.handlerSum / stats.dispatched : 0., stats.handlerMax, stats.parks, stats.coalesced);
+	}
 	cvDestroyAllWindows();
 	TT_Shutdown();
 	TT_FinalCleanup();
@@ -0,0 +1,198 @@
+/* Fixed Worker Pool
+   A fixed number of threads is created once and pulls tasks from a bounded
+   circular queue, callers submit batches of tasks and wait for them to drain.
+   No thread is created or destroyed while the pool is in use.
+
+   Tasks receive the index of the worker running them [0, numThreads) so that
+   callers can keep per-worker state (scratch buffers, classifier copies...)
+   without locking.
+
+   Idris Soule
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+typedef void (*poolTask_t)(void *arg, int worker);
+
+typedef struct {
+	poolTask_t fn;
+	void *arg;
+}PoolTask_t;
+
+struct WorkerPool_t;
+
+typedef struct {
+	struct WorkerPool_t *pool;
+	int index;
+}PoolWorker_t;
+
+typedef struct WorkerPool_t {
+	pthread_t *threads;
+	PoolWorker_t *workers;
+	int numThreads;
+
+	/* bounded circular task queue */
+	PoolTask_t *tasks;
+	int capacity, head, count;
+	int pending; //queued + running, pool_wait returns once this reaches 0
+	bool shutdown;
+
+	pthread_mutex_t lock;
+	pthread_cond_t taskCond;  //a task was queued (or shutdown)
+	pthread_cond_t spaceCond; //a slot was freed in the queue
+	pthread_cond_t idleCond;  //pending dropped to 0
+}WorkerPool_t;
+
+/* pool_num_processors:
+	@return: number of online processors (at least 1)
+*/
+static int pool_num_processors(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+static void * pool_worker(void *arg)
+{
+	PoolWorker_t *self = (PoolWorker_t *)arg;
+	WorkerPool_t *pool = self->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	for(;;){
+		while(pool->count == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->taskCond, &pool->lock);
+		if(pool->count == 0) //shutdown and drained
+			break;
+
+		PoolTask_t task = pool->tasks[pool->head];
+		pool->head = (pool->head + 1) % pool->capacity;
+		pool->count--;
+		pthread_cond_signal(&pool->spaceCond);
+		pthread_mutex_unlock(&pool->lock);
+
+		task.fn(task.arg, self->index);
+
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->pending == 0)
+			pthread_cond_broadcast(&pool->idleCond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+pool_initialize:
+	Creates the worker threads of the pool
+
+	@numThreads: workers to create (<= 0 uses one per processor)
+	@capacity: maximum number of queued tasks, pool_submit blocks beyond that
+	@return: status of initialization
+*/
+static bool pool_initialize(WorkerPool_t *pool, int numThreads, int capacity)
+{
+	assert(pool && capacity > 0);
+	if(numThreads <= 0)
+		numThreads = pool_num_processors();
+
+	pool->numThreads = 0;
+	pool->capacity = capacity;
+	pool->head = pool->count = pool->pending = 0;
+	pool->shutdown = false;
+	pool->tasks = (PoolTask_t *)malloc(sizeof(PoolTask_t) * capacity);
+	pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * numThreads);
+	pool->workers = (PoolWorker_t *)malloc(sizeof(PoolWorker_t) * numThreads);
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->taskCond, NULL);
+	pthread_cond_init(&pool->spaceCond, NULL);
+	pthread_cond_init(&pool->idleCond, NULL);
+
+	for(int i = 0; i < numThreads; i++){
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+		if(pthread_create(&pool->threads[i], NULL, pool_worker, &pool->workers[i])){
+			printf("POOL::%s: Couldn't create worker-thread %d!\n", __FUNCTION__, i);
+			break;
+		}
+		pool->numThreads++;
+	}
+	return pool->numThreads == numThreads;
+}
+
+/*
+pool_submit:
+	Queues a task, blocks while the queue is full
+
+	@fn: task to run on one of the workers
+	@arg: argument handed to the task
+*/
+static void pool_submit(WorkerPool_t *pool, poolTask_t fn, void *arg)
+{
+	pthread_mutex_lock(&pool->lock);
+	while(pool->count == pool->capacity)
+		pthread_cond_wait(&pool->spaceCond, &pool->lock);
+
+	PoolTask_t *task = &pool->tasks[(pool->head + pool->count) % pool->capacity];
+	task->fn = fn;
+	task->arg = arg;
+	pool->count++;
+	pool->pending++;
+	pthread_cond_signal(&pool->taskCond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+pool_wait:
+	Blocks until every submitted task has finished running
+*/
+static void pool_wait(WorkerPool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while(pool->pending)
+		pthread_cond_wait(&pool->idleCond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+pool_destroy:
+	Runs the remaining tasks, joins the workers and frees the pool
+*/
+static void pool_destroy(WorkerPool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->taskCond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(int i = 0; i < pool->numThreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->idleCond);
+	pthread_cond_destroy(&pool->spaceCond);
+	pthread_cond_destroy(&pool->taskCond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool->threads);
+	free(pool->tasks);
+	pool->numThreads = 0;
+}
+
+#endif
@@ -0,0 +1,226 @@
+/* Lock-Free Event Ring
+   Bounded circular queue of posture events between the camera threads
+   (producers) and the FSM thread (consumer). Neither side ever takes a mutex.
+
+   Every slot carries a sequence number (bounded MPMC queue after D. Vyukov):
+   a producer claims the slot at the enqueue position with a CAS on that
+   position once the slot's sequence says it is free, writes the event and
+   publishes it by bumping the sequence. The consumer does the mirror image
+   at the dequeue position. Positions only grow, the slot is position & mask.
+
+   When the ring is full the overflow policy decides:
+	RING_REJECT      the new event is refused (emit returns false)
+	RING_DROP_OLDEST the oldest queued event is discarded to make room
+	RING_COALESCE    the oldest event is discarded only if it is coalescable
+					 (i.e TRACK) and the event queued right behind it is too,
+					 so a newer position supersedes it and the order of the
+					 discrete events around it is kept, otherwise the new
+					 event is refused
+
+   Idris Soule
+*/
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#define RING_CACHE_LINE 64
+
+typedef enum {RING_REJECT = 0, RING_DROP_OLDEST, RING_COALESCE} ringPolicy_t;
+
+typedef struct {
+	int event;
+	int x, y;                //payload, i.e the cursor position of a TRACK
+	unsigned long long time; //emit time, microseconds
+}RingEvent_t;
+
+typedef struct {
+	volatile unsigned seq;
+	volatile unsigned kind; //data.event, readable before the slot is claimed
+	RingEvent_t data;
+}RingSlot_t;
+
+typedef struct {
+	RingSlot_t *slots;
+	unsigned mask;
+	ringPolicy_t policy;
+	unsigned coalesceMask; //bit (1 << event) set for coalescable events
+	char pad0[RING_CACHE_LINE];
+	volatile unsigned enqueuePos; //producers
+	char pad1[RING_CACHE_LINE];
+	volatile unsigned dequeuePos; //consumer (and producers dropping the oldest)
+	char pad2[RING_CACHE_LINE];
+	volatile unsigned refused;    //new events turned away by a full ring
+	volatile unsigned discarded;  //queued events shed to make room
+}EventRing_t;
+
+/* atomics: acquire loads, release stores and a CAS on 32-bit positions,
+   a full fence (store => load order) and a spin-wait hint */
+#if defined(_WIN32)
+static inline unsigned ring_load(volatile unsigned *p) { return *p; } //volatile is acquire on MSVC
+static inline void ring_store(volatile unsigned *p, unsigned v) { *p = v; } //and release
+static inline bool ring_cas(volatile unsigned *p, unsigned expected, unsigned desired)
+{
+	return InterlockedCompareExchange((volatile LONG *)p, (LONG)desired, (LONG)expected) == (LONG)expected;
+}
+static inline void ring_increment(volatile unsigned *p) { InterlockedIncrement((volatile LONG *)p); }
+static inline void ring_fence(void) { MemoryBarrier(); }
+static inline void ring_pause(void) { YieldProcessor(); }
+#else
+static inline unsigned ring_load(volatile unsigned *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void ring_store(volatile unsigned *p, unsigned v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline bool ring_cas(volatile unsigned *p, unsigned expected, unsigned desired)
+{
+	return __sync_bool_compare_and_swap(p, expected, desired);
+}
+static inline void ring_increment(volatile unsigned *p) { __sync_fetch_and_add(p, 1); }
+static inline void ring_fence(void) { __sync_synchronize(); }
+static inline void ring_pause(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+#endif
+
+/*
+ring_initialize:
+	@capacity: power of two
+	@coalesceMask: (1 << event) of the events RING_COALESCE may discard
+	@return: status of initialization
+*/
+static bool ring_initialize(EventRing_t *ring, unsigned capacity, ringPolicy_t policy, unsigned coalesceMask)
+{
+	assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+	memset(ring, 0, sizeof(*ring));
+	ring->slots = (RingSlot_t *)malloc(sizeof(RingSlot_t) * capacity);
+	if(!ring->slots)
+		return false;
+	for(unsigned i = 0; i < capacity; i++)
+		ring->slots[i].seq = i; //free for position i
+	ring->mask = capacity - 1;
+	ring->policy = policy;
+	ring->coalesceMask = coalesceMask;
+	return true;
+}
+
+/*
+ring_take:
+	Dequeues the oldest event, by the consumer or by a producer making room
+
+	@coalescableOnly: leave the event queued if it isn't coalescable
+	@return: false if the ring is empty (or the head is kept)
+*/
+static bool ring_take(EventRing_t *ring, RingEvent_t *e, bool coalescableOnly)
+{
+	unsigned pos = ring_load(&ring->dequeuePos);
+	for(;;){
+		RingSlot_t *slot = &ring->slots[pos & ring->mask];
+		const int dif = (int)(ring_load(&slot->seq) - (pos + 1));
+		if(dif == 0){
+			if(coalescableOnly && !(ring->coalesceMask & (1u << ring_load(&slot->kind))))
+				return false;
+			if(ring_cas(&ring->dequeuePos, pos, pos + 1)){
+				/* claimed, no producer writes the slot before it is released below */
+				*e = slot->data;
+				ring_store(&slot->seq, pos + ring->mask + 1); //free for the next lap
+				return true;
+			}
+			pos = ring_load(&ring->dequeuePos);
+		}
+		else if(dif < 0)
+			return false; //empty
+		else
+			pos = ring_load(&ring->dequeuePos); //taken by another thread meanwhile
+	}
+}
+
+/*
+ring_discardHead:
+	Producer side, full ring under RING_COALESCE: drops the oldest event if it
+	and the event behind it are coalescable, the latter supersedes it
+
+	@return: false if the head has to stay
+*/
+static bool ring_discardHead(EventRing_t *ring)
+{
+	for(;;){
+		const unsigned pos = ring_load(&ring->dequeuePos);
+		RingSlot_t *slot = &ring->slots[pos & ring->mask];
+		RingSlot_t *next = &ring->slots[(pos + 1) & ring->mask];
+		if(ring_load(&slot->seq) != pos + 1 || ring_load(&next->seq) != pos + 2)
+			return false; //head or its successor not published (or already taken)
+		if(!(ring->coalesceMask & (1u << ring_load(&slot->kind))) ||
+		   !(ring->coalesceMask & (1u << ring_load(&next->kind))))
+			return false;
+		/* the successor can't be taken before the head, it stays behind it */
+		if(ring_cas(&ring->dequeuePos, pos, pos + 1)){
+			ring_store(&slot->seq, pos + ring->mask + 1);
+			return true;
+		}
+	}
+}
+
+/* ring_pop: consumer side, @return: false if the ring is empty */
+static inline bool ring_pop(EventRing_t *ring, RingEvent_t *e)
+{
+	return ring_take(ring, e, false);
+}
+
+/*
+ring_push:
+	Producer side, safe from any number of threads
+
+	@return: false if the event was refused (full ring, see the policy)
+*/
+static bool ring_push(EventRing_t *ring, const RingEvent_t *e)
+{
+	unsigned pos = ring_load(&ring->enqueuePos);
+	for(;;){
+		RingSlot_t *slot = &ring->slots[pos & ring->mask];
+		const int dif = (int)(ring_load(&slot->seq) - pos);
+		if(dif == 0){
+			if(ring_cas(&ring->enqueuePos, pos, pos + 1)){
+				slot->data = *e;
+				ring_store(&slot->kind, (unsigned)e->event);
+				ring_store(&slot->seq, pos + 1); //publish
+				return true;
+			}
+			pos = ring_load(&ring->enqueuePos);
+		}
+		else if(dif < 0){ //full
+			RingEvent_t old;
+			const bool room = ring->policy == RING_DROP_OLDEST ? ring_take(ring, &old, false) :
+							  ring->policy == RING_COALESCE ? ring_discardHead(ring) : false;
+			if(!room){
+				ring_increment(&ring->refused);
+				return false;
+			}
+			ring_increment(&ring->discarded);
+			pos = ring_load(&ring->enqueuePos);
+		}
+		else
+			pos = ring_load(&ring->enqueuePos); //claimed by another producer meanwhile
+	}
+}
+
+/* ring_size: events queued, approximate while producers are active */
+static inline unsigned ring_size(EventRing_t *ring)
+{
+	return ring_load(&ring->enqueuePos) - ring_load(&ring->dequeuePos);
+}
+
+static void ring_destroy(EventRing_t *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+#endif
@@ -0,0 +1,232 @@
+/* Hand Segmentation by Histogram Back-Projection
+   A 30x32 H-S histogram of the hand (the layout of histogramTest) is learnt
+   once from a region of a frame and then back-projected on every frame. The
+   pixels of the hand mask, dilated by a few pixels, are accumulated and
+   blended into the model with a decay factor, so the model follows lighting
+   drift without ever being rebuilt from scratch. The dilation is what lets
+   it grow: skin whose bins are still below the cut sits right next to the
+   pixels already classified as hand.
+
+   Per frame: one colour conversion, one plane split, then a single pass
+   computing the bin of 16 pixels at a time with SSE2 followed by a table
+   lookup (back-projection and threshold folded into one table). When the
+   model is updated the bins of the frame are kept, and after the dilation
+   a second pass accumulates them into four interleaved histograms (no
+   store-to-load stalls on runs of the same bin).
+
+   Idris Soule
+*/
+
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <cv.h>
+#include <emmintrin.h>
+
+#define SEGMENT_H_BINS 30
+#define SEGMENT_S_BINS 32
+#define SEGMENT_BINS   (SEGMENT_H_BINS * SEGMENT_S_BINS)
+#define SEGMENT_BANKS  4
+#define SEGMENT_GROW   2 //dilations of the hand mask before it is learnt
+
+typedef struct {
+	float model[SEGMENT_BINS];  //normalized H-S histogram of the hand
+	uchar lut[SEGMENT_BINS];    //back-projection, model scaled to 0-255
+	uchar maskLut[SEGMENT_BINS];//back-projection thresholded to 0/255
+	unsigned int counts[SEGMENT_BANKS][SEGMENT_BINS];
+	float decay;                //weight of the newest frame in the model
+	float threshold;            //fraction of the peak bin classified as hand
+	bool trained;
+
+	/* scratch, reallocated when the frame size changes */
+	IplImage *hsv, *h, *s, *v;
+	IplImage *grown;            //dilated hand mask, the pixels learnt from
+	unsigned short *bins;       //bins of the whole frame
+}HandSegmenter_t;
+
+/*
+segment_initialize:
+	@decay: weight of each new frame in the model i.e 0.05 (0 freezes the model)
+	@threshold: a bin is hand if it holds at least this fraction of the peak bin
+*/
+static void segment_initialize(HandSegmenter_t *seg, float decay, float threshold)
+{
+	assert(decay >= 0 && decay <= 1 && threshold > 0 && threshold <= 1);
+	memset(seg, 0, sizeof(*seg));
+	seg->decay = decay;
+	seg->threshold = threshold;
+}
+
+/* segment_prepare: converts a BGR frame into the H and S planes */
+static void segment_prepare(HandSegmenter_t *seg, const IplImage *bgr)
+{
+	assert(bgr->nChannels == 3 && bgr->depth == IPL_DEPTH_8U);
+	if(!seg->hsv || seg->hsv->width != bgr->width || seg->hsv->height != bgr->height){
+		cvReleaseImage(&seg->hsv), cvReleaseImage(&seg->h);
+		cvReleaseImage(&seg->s), cvReleaseImage(&seg->v);
+		cvReleaseImage(&seg->grown);
+		seg->hsv = cvCreateImage(cvGetSize(bgr), IPL_DEPTH_8U, 3);
+		seg->h = cvCreateImage(cvGetSize(bgr), IPL_DEPTH_8U, 1);
+		seg->s = cvCreateImage(cvGetSize(bgr), IPL_DEPTH_8U, 1);
+		seg->v = cvCreateImage(cvGetSize(bgr), IPL_DEPTH_8U, 1);
+		seg->grown = cvCreateImage(cvGetSize(bgr), IPL_DEPTH_8U, 1);
+		free(seg->bins);
+		seg->bins = (unsigned short *)malloc(sizeof(unsigned short) * bgr->width * bgr->height);
+	}
+	cvCvtColor(bgr, seg->hsv, CV_BGR2HSV); //8-bit hue is [0, 180)
+	cvSplit(seg->hsv, seg->h, seg->s, seg->v, 0);
+}
+
+/* segment_rowBins: bin = (h / 6) * 32 + s / 8 for a row, 16 pixels per step */
+static void segment_rowBins(const uchar *h, const uchar *s, int n, unsigned short *bins)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i sixth = _mm_set1_epi16(10923); //(h * 10923) >> 16 == h / 6 for h < 180
+	int x = 0;
+	for(; x + 16 <= n; x += 16){
+		__m128i hv = _mm_loadu_si128((const __m128i *)(h + x));
+		__m128i sv = _mm_loadu_si128((const __m128i *)(s + x));
+		__m128i hlo = _mm_mulhi_epu16(_mm_unpacklo_epi8(hv, zero), sixth);
+		__m128i hhi = _mm_mulhi_epu16(_mm_unpackhi_epi8(hv, zero), sixth);
+		__m128i slo = _mm_srli_epi16(_mm_unpacklo_epi8(sv, zero), 3);
+		__m128i shi = _mm_srli_epi16(_mm_unpackhi_epi8(sv, zero), 3);
+		_mm_storeu_si128((__m128i *)(bins + x), _mm_or_si128(_mm_slli_epi16(hlo, 5), slo));
+		_mm_storeu_si128((__m128i *)(bins + x + 8), _mm_or_si128(_mm_slli_epi16(hhi, 5), shi));
+	}
+	for(; x < n; x++)
+		bins[x] = (unsigned short)((h[x] / 6) * SEGMENT_S_BINS + (s[x] >> 3));
+}
+
+/* segment_rebuildLut: back-projection tables from the model, 960 entries */
+static void segment_rebuildLut(HandSegmenter_t *seg)
+{
+	float peak = 0;
+	for(int b = 0; b < SEGMENT_BINS; b++)
+		if(seg->model[b] > peak)
+			peak = seg->model[b];
+	const float scale = peak > 0 ? 255.0f / peak : 0;
+	const float cut = peak * seg->threshold;
+	for(int b = 0; b < SEGMENT_BINS; b++){
+		seg->lut[b] = (uchar)cvRound(seg->model[b] * scale);
+		seg->maskLut[b] = peak > 0 && seg->model[b] >= cut ? 255 : 0;
+	}
+}
+
+/* segment_blend: model = (1 - alpha) * model + alpha * counts / total, clears the counts */
+static void segment_blend(HandSegmenter_t *seg, float alpha)
+{
+	unsigned int total = 0;
+	for(int k = 0; k < SEGMENT_BANKS; k++)
+		for(int b = 0; b < SEGMENT_BINS; b++)
+			total += seg->counts[k][b];
+	if(total){
+		const float w = alpha / total;
+		for(int b = 0; b < SEGMENT_BINS; b++){
+			unsigned int c = seg->counts[0][b] + seg->counts[1][b] + seg->counts[2][b] + seg->counts[3][b];
+			seg->model[b] = (1 - alpha) * seg->model[b] + w * c;
+		}
+		segment_rebuildLut(seg);
+	}
+	memset(seg->counts, 0, sizeof(seg->counts));
+}
+
+/*
+segment_learn:
+	(Re)learns the hand model from a region known to hold only the hand
+
+	@bgr: 8-bit 3 channel frame
+	@roi: region of the hand
+*/
+static void segment_learn(HandSegmenter_t *seg, const IplImage *bgr, CvRect roi)
+{
+	segment_prepare(seg, bgr);
+	memset(seg->counts, 0, sizeof(seg->counts));
+	for(int y = roi.y; y < roi.y + roi.height; y++){
+		const uchar *h = (const uchar *)seg->h->imageData + y * seg->h->widthStep + roi.x;
+		const uchar *s = (const uchar *)seg->s->imageData + y * seg->s->widthStep + roi.x;
+		segment_rowBins(h, s, roi.width, seg->bins);
+		for(int x = 0; x < roi.width; x++)
+			seg->counts[x & (SEGMENT_BANKS - 1)][seg->bins[x]]++;
+	}
+	segment_blend(seg, 1.0f); //replaces the model
+	seg->trained = true;
+}
+
+/*
+segment_frame:
+	Back-projects the hand model on a frame and, when @update is set, blends
+	the pixels of the dilated hand mask into the model
+
+	@bgr: 8-bit 3 channel frame
+	@dst: 8-bit single channel, 255 for hand pixels, 0 elsewhere
+		  (or the 0-255 hand likelihood if @binary is false)
+	@return: number of hand pixels (before the dilation)
+*/
+static int segment_frame(HandSegmenter_t *seg, const IplImage *bgr, IplImage *dst, bool binary, bool update)
+{
+	assert(seg->trained && dst->nChannels == 1 && dst->width == bgr->width && dst->height == bgr->height);
+	segment_prepare(seg, bgr);
+	update = update && seg->decay > 0;
+
+	const uchar *lut = binary ? seg->maskLut : seg->lut;
+	const uchar *mask = seg->maskLut;
+	int hand = 0;
+	for(int y = 0; y < bgr->height; y++){
+		const uchar *h = (const uchar *)seg->h->imageData + y * seg->h->widthStep;
+		const uchar *s = (const uchar *)seg->s->imageData + y * seg->s->widthStep;
+		uchar *out = (uchar *)dst->imageData + y * dst->widthStep;
+		unsigned short *bins = seg->bins + (update ? y * bgr->width : 0); //kept for the update
+		segment_rowBins(h, s, bgr->width, bins);
+
+		if(update){
+			uchar *grown = (uchar *)seg->grown->imageData + y * seg->grown->widthStep;
+			for(int x = 0; x < bgr->width; x++){
+				out[x] = lut[bins[x]];
+				grown[x] = mask[bins[x]];
+				hand += grown[x] >> 7;
+			}
+		}
+		else {
+			for(int x = 0; x < bgr->width; x++){
+				out[x] = lut[bins[x]];
+				hand += mask[bins[x]] >> 7;
+			}
+		}
+	}
+
+	if(update){
+		/* learning only the bins already above the cut would never widen the
+		   model, the border of the hand brings in the skin it misses */
+		cvDilate(seg->grown, seg->grown, NULL, SEGMENT_GROW);
+		for(int y = 0; y < bgr->height; y++){
+			const uchar *grown = (const uchar *)seg->grown->imageData + y * seg->grown->widthStep;
+			const unsigned short *bins = seg->bins + y * bgr->width;
+			int x = 0;
+			for(; x + SEGMENT_BANKS <= bgr->width; x += SEGMENT_BANKS){
+				/* grown is 0 or 255, >> 7 gives the increment without a branch */
+				seg->counts[0][bins[x]] += grown[x] >> 7;
+				seg->counts[1][bins[x + 1]] += grown[x + 1] >> 7;
+				seg->counts[2][bins[x + 2]] += grown[x + 2] >> 7;
+				seg->counts[3][bins[x + 3]] += grown[x + 3] >> 7;
+			}
+			for(; x < bgr->width; x++)
+				seg->counts[0][bins[x]] += grown[x] >> 7;
+		}
+		segment_blend(seg, seg->decay);
+	}
+	return hand;
+}
+
+static void segment_destroy(HandSegmenter_t *seg)
+{
+	cvReleaseImage(&seg->hsv), cvReleaseImage(&seg->h);
+	cvReleaseImage(&seg->s), cvReleaseImage(&seg->v);
+	cvReleaseImage(&seg->grown);
+	free(seg->bins);
+	seg->bins = NULL;
+}
+
+#endif
@@ -0,0 +1,468 @@
+/* Shape Descriptors and Nearest-Neighbour Posture Index
+   A lightweight alternative to the 40000 input MLP: the largest contour of
+   the hand is reduced to its seven Hu moments and a few hull statistics
+   (solidity, deep convexity defects, aspect of the minimum area box) and
+   classified by the k nearest descriptors of the captured postures.
+
+   The descriptors live in a KD-tree. The offline build (DatasetTool shapes)
+   balances it by median splits, new samples are simply inserted as leaves
+   so nothing is ever retrained. A lookup visits a handful of nodes.
+
+   Descriptors are stored pre-weighted (shape_weights) so that plain
+   Euclidean distance in the tree is the distance we want: Hu moments are
+   log scaled, the higher orders are noisier and weigh less.
+
+   The live contour stage and the offline build find the hand the same way
+   (shape_handContour: adaptive threshold, largest of all the contours), so
+   the index holds the silhouettes the classifier is shown.
+
+   Idris Soule
+*/
+
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+#include <cv.h>
+
+#include "archive.h"
+#include "threshold.h"
+
+#define SHAPE_DIMS   10
+#define SHAPE_MAX_K  16
+#define SHAPE_MAGIC  "WMGS"
+#define SHAPE_NONE   -1
+
+/* silhouette preprocessing, the live camera and the offline build alike */
+#define SHAPE_THRESHOLD_HYSTERESIS 8
+#define SHAPE_THRESHOLD_MIN        20
+#define SHAPE_THRESHOLD_MAX        235
+#define SHAPE_BG_MARGIN            15 //grey levels above the background to be foreground
+
+static const float shape_weights[SHAPE_DIMS] = {
+	1.0f, 1.0f, 0.5f, 0.5f, 0.25f, 0.25f, 0.25f, //hu1 .. hu7 (log10)
+	10.0f,                                       //solidity, contour area / hull area
+	1.0f,                                        //deep convexity defects (between fingers)
+	5.0f                                         //minor / major side of the minimum area box
+};
+
+typedef struct {
+	float d[SHAPE_DIMS];
+	int label;
+	int left, right; //SHAPE_NONE for no child
+	int axis;
+}ShapeNode_t;
+
+typedef struct {
+	ShapeNode_t *nodes;
+	int count, capacity;
+	int root;
+}ShapeIndex_t;
+
+/*
+shape_describeContour:
+	Descriptor of a closed contour
+
+	@storage: scratch for the hull and defects (cleared by the caller)
+	@return: false if the contour is degenerate (no area)
+*/
+static bool shape_describeContour(CvSeq *contour, CvMemStorage *storage, float *d)
+{
+	CvMoments m;
+	CvHuMoments hu;
+	cvMoments(contour, &m, 0);
+	if(m.m00 <= 0)
+		return false;
+	cvGetHuMoments(&m, &hu);
+
+	const double h[7] = {hu.hu1, hu.hu2, hu.hu3, hu.hu4, hu.hu5, hu.hu6, hu.hu7};
+	for(int i = 0; i < 7; i++){
+		/* sign(h) * -log10|h|, invariants span many orders of magnitude */
+		double a = fabs(h[i]);
+		double v = a > 1e-30 ? -log10(a) : 30.0;
+		d[i] = (float)(h[i] < 0 ? -v : v);
+	}
+
+	CvSeq *hullPoints = cvConvexHull2(contour, storage, CV_CLOCKWISE, 1);
+	double hullArea = fabs(cvContourArea(hullPoints, CV_WHOLE_SEQ));
+	d[7] = (float)(hullArea > 0 ? m.m00 / hullArea : 1.0);
+
+	/* defects deeper than a fifth of the hand's size, the gaps between fingers */
+	CvSeq *hull = cvConvexHull2(contour, storage, CV_CLOCKWISE, 0);
+	CvSeq *defects = hull->total > 3 ? cvConvexityDefects(contour, hull, storage) : NULL;
+	const float minDepth = (float)(0.2 * sqrt(m.m00));
+	int deep = 0;
+	for(int i = 0; defects && i < defects->total; i++)
+		deep += ((CvConvexityDefect *)cvGetSeqElem(defects, i))->depth > minDepth;
+	d[8] = (float)deep;
+
+	CvBox2D box = cvMinAreaRect2(contour, storage);
+	float major = MAX(box.size.width, box.size.height), minor = MIN(box.size.width, box.size.height);
+	d[9] = major > 0 ? minor / major : 1.0f;
+
+	for(int i = 0; i < SHAPE_DIMS; i++)
+		d[i] *= shape_weights[i];
+	return true;
+}
+
+/* shape_largestContour: the contour with the largest area, which should be the hand */
+static CvSeq * shape_largestContour(CvSeq *first)
+{
+	CvSeq *best = NULL;
+	double bestArea = 0;
+	for(CvSeq *c = first; c != NULL; c = c->h_next){
+		double area = fabs(cvContourArea(c, CV_WHOLE_SEQ));
+		if(area > bestArea){
+			bestArea = area;
+			best = c;
+		}
+	}
+	return best;
+}
+
+/* shape_thresholdInitialize: the adaptive level of the silhouettes, Otsu with hysteresis */
+static void shape_thresholdInitialize(AdaptiveThreshold_t *at)
+{
+	threshold_initialize(at, THRESHOLD_OTSU, 0, SHAPE_THRESHOLD_HYSTERESIS, SHAPE_THRESHOLD_MIN, SHAPE_THRESHOLD_MAX);
+}
+
+/*
+shape_handContour:
+	The hand in a background-subtracted frame, thresholded with the adaptive
+	level of the sequence then the largest of all the contours
+
+	@foreground: 8-bit single channel, 0 where the background was removed
+	@binary: receives the threshold, modified by cvFindContours
+	@first: receives every contour (CV_RETR_LIST), may be NULL
+	@return: the largest contour, NULL if there is none
+*/
+static CvSeq * shape_handContour(AdaptiveThreshold_t *at, const IplImage *foreground, IplImage *binary,
+								 CvMemStorage *storage, CvSeq **first)
+{
+	CvSeq *contours = NULL;
+	threshold_apply(at, foreground, binary);
+	cvFindContours(binary, storage, &contours, sizeof(CvContour), CV_RETR_LIST);
+	if(first)
+		*first = contours;
+	return contours ? shape_largestContour(contours) : NULL;
+}
+
+static void shape_indexInitialize(ShapeIndex_t *idx)
+{
+	idx->capacity = 256;
+	idx->nodes = (ShapeNode_t *)malloc(sizeof(ShapeNode_t) * idx->capacity);
+	idx->count = 0;
+	idx->root = SHAPE_NONE;
+}
+
+static int shape_newNode(ShapeIndex_t *idx, const float *d, int label, int axis)
+{
+	if(idx->count == idx->capacity){
+		idx->capacity *= 2;
+		idx->nodes = (ShapeNode_t *)realloc(idx->nodes, sizeof(ShapeNode_t) * idx->capacity);
+	}
+	ShapeNode_t *node = &idx->nodes[idx->count];
+	memcpy(node->d, d, sizeof(node->d));
+	node->label = label;
+	node->left = node->right = SHAPE_NONE;
+	node->axis = axis;
+	return idx->count++;
+}
+
+/* shape_indexInsert: adds a sample as a new leaf, the tree is not rebalanced */
+static void shape_indexInsert(ShapeIndex_t *idx, const float *d, int label)
+{
+	if(idx->root == SHAPE_NONE){
+		idx->root = shape_newNode(idx, d, label, 0);
+		return;
+	}
+	int n = idx->root;
+	for(;;){
+		ShapeNode_t *node = &idx->nodes[n];
+		int *child = d[node->axis] < node->d[node->axis] ? &node->left : &node->right;
+		if(*child == SHAPE_NONE){
+			const int axis = (node->axis + 1) % SHAPE_DIMS;
+			const int c = shape_newNode(idx, d, label, axis); //may move the nodes
+			if(d[idx->nodes[n].axis] < idx->nodes[n].d[idx->nodes[n].axis])
+				idx->nodes[n].left = c;
+			else
+				idx->nodes[n].right = c;
+			return;
+		}
+		n = *child;
+	}
+}
+
+/* median split build, samples are referenced through @order */
+typedef struct {
+	const float *d; //n * SHAPE_DIMS
+	int axis;
+}ShapeSortCtx_t;
+
+static ShapeSortCtx_t shape_sortCtx; //qsort has no context argument, the build is single threaded
+
+static int shape_compareAxis(const void *a, const void *b)
+{
+	float x = shape_sortCtx.d[*(const int *)a * SHAPE_DIMS + shape_sortCtx.axis];
+	float y = shape_sortCtx.d[*(const int *)b * SHAPE_DIMS + shape_sortCtx.axis];
+	return x < y ? -1 : x > y;
+}
+
+static int shape_buildRange(ShapeIndex_t *idx, const float *d, const int *labels, int *order, int n, int depth)
+{
+	if(n <= 0)
+		return SHAPE_NONE;
+	const int axis = depth % SHAPE_DIMS;
+	shape_sortCtx.d = d;
+	shape_sortCtx.axis = axis;
+	qsort(order, n, sizeof(int), &shape_compareAxis);
+
+	int mid = n / 2;
+	/* equal keys go right, as in shape_indexInsert */
+	while(mid > 0 && d[order[mid - 1] * SHAPE_DIMS + axis] == d[order[mid] * SHAPE_DIMS + axis])
+		mid--;
+	const int node = shape_newNode(idx, d + order[mid] * SHAPE_DIMS, labels[order[mid]], axis);
+	const int left = shape_buildRange(idx, d, labels, order, mid, depth + 1);
+	const int right = shape_buildRange(idx, d, labels, order + mid + 1, n - mid - 1, depth + 1);
+	idx->nodes[node].left = left;
+	idx->nodes[node].right = right;
+	return node;
+}
+
+/*
+shape_indexBuild:
+	Balanced tree of @n descriptors (n * SHAPE_DIMS floats), replaces the content
+*/
+static void shape_indexBuild(ShapeIndex_t *idx, const float *d, const int *labels, int n)
+{
+	int *order = (int *)malloc(sizeof(int) * (n > 0 ? n : 1));
+	for(int i = 0; i < n; i++)
+		order[i] = i;
+	idx->count = 0;
+	idx->root = shape_buildRange(idx, d, labels, order, n, 0);
+	free(order);
+}
+
+typedef struct {
+	int k, found;
+	float dist[SHAPE_MAX_K]; //squared, ascending
+	int label[SHAPE_MAX_K];
+}ShapeKnn_t;
+
+static void shape_search(const ShapeIndex_t *idx, int n, const float *q, ShapeKnn_t *knn)
+{
+	while(n != SHAPE_NONE){
+		const ShapeNode_t *node = &idx->nodes[n];
+		float dist = 0;
+		for(int i = 0; i < SHAPE_DIMS; i++){
+			float e = q[i] - node->d[i];
+			dist += e * e;
+		}
+		if(knn->found < knn->k || dist < knn->dist[knn->found - 1]){
+			int j = knn->found < knn->k ? knn->found++ : knn->k - 1;
+			for(; j > 0 && knn->dist[j - 1] > dist; j--){
+				knn->dist[j] = knn->dist[j - 1];
+				knn->label[j] = knn->label[j - 1];
+			}
+			knn->dist[j] = dist;
+			knn->label[j] = node->label;
+		}
+
+		const float diff = q[node->axis] - node->d[node->axis];
+		const int near = diff < 0 ? node->left : node->right;
+		const int far = diff < 0 ? node->right : node->left;
+		/* the far side only if the splitting plane is closer than the worst kept */
+		if(far != SHAPE_NONE && (knn->found < knn->k || diff * diff < knn->dist[knn->found - 1]))
+			shape_search(idx, far, q, knn);
+		n = near; //loop instead of recursing on the near side
+	}
+}
+
+/*
+shape_indexKnn:
+	@k: neighbours wanted, at most SHAPE_MAX_K
+	@return: neighbours found (fewer than k if the index is smaller)
+*/
+static int shape_indexKnn(const ShapeIndex_t *idx, const float *q, int k, ShapeKnn_t *knn)
+{
+	assert(k > 0 && k <= SHAPE_MAX_K);
+	knn->k = k;
+	knn->found = 0;
+	shape_search(idx, idx->root, q, knn);
+	return knn->found;
+}
+
+/*
+shape_classify:
+	Majority label of the k nearest descriptors, ties go to the nearer label
+
+	@return: the label, SHAPE_NONE if the index is empty
+*/
+static int shape_classify(const ShapeIndex_t *idx, const float *q, int k)
+{
+	ShapeKnn_t knn;
+	if(shape_indexKnn(idx, q, k, &knn) == 0)
+		return SHAPE_NONE;
+	int best = knn.label[0], bestVotes = 0;
+	for(int i = 0; i < knn.found; i++){
+		int votes = 0;
+		for(int j = 0; j < knn.found; j++)
+			votes += knn.label[j] == knn.label[i];
+		if(votes > bestVotes){ //strict, the nearest label of a tie was seen first
+			bestVotes = votes;
+			best = knn.label[i];
+		}
+	}
+	return best;
+}
+
+/*
+shape_describeFrame:
+	Descriptor of a captured frame, preprocessed as the live frames are. The
+	IR background of the captures is black, removing it leaves the pixels
+	brighter than the margin.
+
+	@gray: 8-bit single channel, the background is zeroed in place
+	@at: adaptive level of the sequence the frame belongs to
+	@return: false if the frame holds no usable contour
+*/
+static bool shape_describeFrame(AdaptiveThreshold_t *at, IplImage *gray, IplImage *binary, CvMemStorage *storage,
+								float *d)
+{
+	cvClearMemStorage(storage);
+	cvThreshold(gray, gray, SHAPE_BG_MARGIN, 0, CV_THRESH_TOZERO);
+	CvSeq *hand = shape_handContour(at, gray, binary, storage, NULL);
+	return hand && shape_describeContour(hand, storage, d);
+}
+
+/*
+shape_indexFromDataset:
+	Offline build of the posture index, one descriptor per captured frame
+
+	@ar: packed dataset (archive.h), NULL to read <root>/<pose>/ directly
+	@poseNames: "1pose" .. label is the leading number
+	@return: descriptors in the index, -1 if nothing could be read
+*/
+static int shape_indexFromDataset(ShapeIndex_t *idx, const DatasetArchive_t *ar, const char *root,
+								  const char **poseNames, int numPoses)
+{
+	int cap = 1024, n = 0;
+	float *d = (float *)malloc(sizeof(float) * SHAPE_DIMS * cap);
+	int *labels = (int *)malloc(sizeof(int) * cap);
+	CvMemStorage *storage = cvCreateMemStorage();
+	IplImage *binary = NULL;
+	char dir[DATASET_PATH_LEN], fn[DATASET_PATH_LEN];
+
+	for(int p = 0; p < numPoses; p++){
+		const int label = atoi(poseNames[p]);
+		char **names = NULL;
+		int count;
+		AdaptiveThreshold_t at; //a pose is one captured sequence, the level follows it
+		shape_thresholdInitialize(&at);
+		if(ar)
+			count = archive_count(ar);
+		else{
+			dataset_path(dir, root, poseNames[p]);
+			if((count = dataset_list(dir, &names)) < 0){
+				fprintf(stderr, "Error: Couldn't read directory %s!\n", dir);
+				continue;
+			}
+		}
+
+		for(int i = 0; i < count; i++){
+			IplImage *img;
+			if(ar){
+				if(archive_entry(ar, i)->label != label)
+					continue;
+				img = archive_load(ar, i);
+			}
+			else{
+				dataset_path(fn, dir, names[i]);
+				img = cvLoadImage(fn, CV_LOAD_IMAGE_GRAYSCALE);
+			}
+			if(!img)
+				continue;
+
+			if(!binary || binary->width != img->width || binary->height != img->height){
+				cvReleaseImage(&binary);
+				binary = cvCreateImage(cvGetSize(img), IPL_DEPTH_8U, 1);
+			}
+			if(n == cap){
+				cap *= 2;
+				d = (float *)realloc(d, sizeof(float) * SHAPE_DIMS * cap);
+				labels = (int *)realloc(labels, sizeof(int) * cap);
+			}
+			if(shape_describeFrame(&at, img, binary, storage, d + n * SHAPE_DIMS))
+				labels[n++] = label;
+			cvReleaseImage(&img);
+		}
+		if(names)
+			dataset_freeList(names, count);
+	}
+
+	if(n > 0)
+		shape_indexBuild(idx, d, labels, n);
+	cvReleaseImage(&binary);
+	cvReleaseMemStorage(&storage);
+	free(labels);
+	free(d);
+	return n > 0 ? n : -1;
+}
+
+/* shape_indexSave: @return: false on I/O error */
+static bool shape_indexSave(const ShapeIndex_t *idx, const char *path)
+{
+	FILE *out = fopen(path, "wb");
+	if(!out){
+		perror(path);
+		return false;
+	}
+	int header[3] = {SHAPE_DIMS, idx->count, idx->root};
+	bool ok = fwrite(SHAPE_MAGIC, 4, 1, out) == 1 && fwrite(header, sizeof(header), 1, out) == 1 &&
+			  fwrite(idx->nodes, sizeof(ShapeNode_t), idx->count, out) == (size_t)idx->count;
+	ok = fclose(out) == 0 && ok;
+	if(!ok)
+		fprintf(stderr, "Error: Couldn't write %s!\n", path);
+	return ok;
+}
+
+/* shape_indexLoad: @return: false if missing or built with other descriptors */
+static bool shape_indexLoad(ShapeIndex_t *idx, const char *path)
+{
+	FILE *in = fopen(path, "rb");
+	if(!in)
+		return false;
+	char magic[4];
+	int header[3];
+	bool ok = fread(magic, 4, 1, in) == 1 && !memcmp(magic, SHAPE_MAGIC, 4) &&
+			  fread(header, sizeof(header), 1, in) == 1 && header[0] == SHAPE_DIMS && header[1] >= 0;
+	if(ok){
+		idx->capacity = header[1] > 256 ? header[1] : 256;
+		idx->nodes = (ShapeNode_t *)realloc(idx->nodes, sizeof(ShapeNode_t) * idx->capacity);
+		idx->count = header[1];
+		idx->root = header[2];
+		ok = fread(idx->nodes, sizeof(ShapeNode_t), idx->count, in) == (size_t)idx->count;
+	}
+	fclose(in);
+	if(!ok){
+		fprintf(stderr, "Error: %s is not a posture shape index!\n", path);
+		idx->count = 0;
+		idx->root = SHAPE_NONE;
+	}
+	return ok;
+}
+
+static void shape_indexDestroy(ShapeIndex_t *idx)
+{
+	free(idx->nodes);
+	idx->nodes = NULL;
+	idx->count = 0;
+	idx->root = SHAPE_NONE;
+}
+
+#endif
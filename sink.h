@@ -0,0 +1,371 @@
+/* Output Sinks
+   Where the FSM's cursor moves and button presses end up. A sink is a small
+   table of function pointers, the FSM hands it arrays of timestamped events
+   and never calls the OS itself:
+
+	sink_null      counts the events, for throughput measurements
+	sink_recording keeps every event, to assert exact click/drag sequences
+	sink_batching  merges the events of a frame into one call to another sink,
+				   consecutive moves collapse into the latest position
+	sink_win32     SendInput, one call per send
+	sink_uinput    Linux virtual absolute pointer (/dev/uinput), one write per send
+
+   Idris Soule
+*/
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#endif
+
+#define SINK_CHUNK 64 //events converted per OS call
+
+typedef enum {SINK_MOVE = 0, SINK_LEFT_DOWN, SINK_LEFT_UP, SINK_RIGHT_DOWN, SINK_RIGHT_UP} sinkAction_t;
+
+typedef struct {
+	sinkAction_t action;
+	int x, y;                //screen position (target of a SINK_MOVE)
+	unsigned long long time; //microseconds, stamped by the caller
+}SinkEvent_t;
+
+typedef struct OutputSink_t {
+	void (*send)(struct OutputSink_t *sink, const SinkEvent_t *events, int n);
+	void (*flush)(struct OutputSink_t *sink);   //end of a frame, NULL if unbuffered
+	void (*destroy)(struct OutputSink_t *sink); //NULL if nothing to release
+	void *state;
+	long events;     //events handed to the sink
+	long injections; //calls made downstream (OS or target sink)
+}OutputSink_t;
+
+static inline void sink_send(OutputSink_t *sink, const SinkEvent_t *events, int n)
+{
+	sink->send(sink, events, n);
+}
+
+static inline void sink_flush(OutputSink_t *sink)
+{
+	if(sink->flush)
+		sink->flush(sink);
+}
+
+static inline void sink_destroy(OutputSink_t *sink)
+{
+	if(sink->destroy)
+		sink->destroy(sink);
+	sink->state = NULL;
+}
+
+static inline const char *sink_actionName(sinkAction_t action)
+{
+	static const char *names[] = {"MOVE", "LEFT_DOWN", "LEFT_UP", "RIGHT_DOWN", "RIGHT_UP"};
+	return (unsigned)action < sizeof(names) / sizeof(names[0]) ? names[action] : "?";
+}
+
+/* null sink */
+
+static void sink_nullSend(OutputSink_t *sink, const SinkEvent_t * /*events*/, int n)
+{
+	sink->events += n;
+	sink->injections++;
+}
+
+static inline void sink_null(OutputSink_t *sink)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->send = sink_nullSend;
+}
+
+/* recording sink */
+
+typedef struct {
+	SinkEvent_t *log;
+	int count, capacity;
+}SinkRecording_t;
+
+static void sink_recordingSend(OutputSink_t *sink, const SinkEvent_t *events, int n)
+{
+	SinkRecording_t *rec = (SinkRecording_t *)sink->state;
+	sink->events += n;
+	sink->injections++;
+	if(rec->count + n > rec->capacity){
+		int capacity = rec->capacity * 2;
+		while(capacity < rec->count + n)
+			capacity *= 2;
+		SinkEvent_t *log = (SinkEvent_t *)realloc(rec->log, sizeof(SinkEvent_t) * capacity);
+		if(!log){
+			fprintf(stderr, "Error: Couldn't grow the recording to %d events!\n", capacity);
+			return;
+		}
+		rec->log = log;
+		rec->capacity = capacity;
+	}
+	memcpy(rec->log + rec->count, events, sizeof(SinkEvent_t) * n);
+	rec->count += n;
+}
+
+static void sink_recordingDestroy(OutputSink_t *sink)
+{
+	SinkRecording_t *rec = (SinkRecording_t *)sink->state;
+	free(rec->log);
+	free(rec);
+}
+
+/*
+sink_recording:
+	@capacity: events kept before the log first grows
+	@return: status of initialization
+*/
+static inline bool sink_recording(OutputSink_t *sink, int capacity)
+{
+	memset(sink, 0, sizeof(*sink));
+	SinkRecording_t *rec = (SinkRecording_t *)calloc(1, sizeof(SinkRecording_t));
+	if(!rec)
+		return false;
+	rec->capacity = capacity > 0 ? capacity : 1;
+	rec->log = (SinkEvent_t *)malloc(sizeof(SinkEvent_t) * rec->capacity);
+	if(!rec->log){
+		free(rec);
+		return false;
+	}
+	sink->send = sink_recordingSend;
+	sink->destroy = sink_recordingDestroy;
+	sink->state = rec;
+	return true;
+}
+
+/* sink_recorded: the events logged so far by a recording sink */
+static inline const SinkEvent_t *sink_recorded(const OutputSink_t *sink, int *count)
+{
+	const SinkRecording_t *rec = (const SinkRecording_t *)sink->state;
+	*count = rec->count;
+	return rec->log;
+}
+
+static inline void sink_recordingClear(OutputSink_t *sink)
+{
+	((SinkRecording_t *)sink->state)->count = 0;
+}
+
+/* sink_recordingLog: one line per event, time relative to the first one */
+static inline void sink_recordingLog(const OutputSink_t *sink, FILE *out)
+{
+	int count;
+	const SinkEvent_t *log = sink_recorded(sink, &count);
+	for(int i = 0; i < count; i++)
+		fprintf(out, "%10llu us %-10s %d %d\n", log[i].time - log[0].time,
+				sink_actionName(log[i].action), log[i].x, log[i].y);
+}
+
+/* batching sink */
+
+typedef struct {
+	OutputSink_t *target;
+	SinkEvent_t *batch;
+	int count, capacity;
+}SinkBatch_t;
+
+static void sink_batchingFlush(OutputSink_t *sink)
+{
+	SinkBatch_t *b = (SinkBatch_t *)sink->state;
+	if(b->count){
+		sink_send(b->target, b->batch, b->count);
+		sink->injections++;
+		b->count = 0;
+	}
+	sink_flush(b->target);
+}
+
+static void sink_batchingSend(OutputSink_t *sink, const SinkEvent_t *events, int n)
+{
+	SinkBatch_t *b = (SinkBatch_t *)sink->state;
+	sink->events += n;
+	for(int i = 0; i < n; i++){
+		if(events[i].action == SINK_MOVE && b->count && b->batch[b->count - 1].action == SINK_MOVE){
+			b->batch[b->count - 1] = events[i]; //only the latest position of a run of moves
+			continue;
+		}
+		if(b->count == b->capacity){ //frame larger than the batch, deliver early
+			sink_send(b->target, b->batch, b->count);
+			sink->injections++;
+			b->count = 0;
+		}
+		b->batch[b->count++] = events[i];
+	}
+}
+
+static void sink_batchingDestroy(OutputSink_t *sink)
+{
+	SinkBatch_t *b = (SinkBatch_t *)sink->state;
+	free(b->batch);
+	free(b);
+}
+
+/*
+sink_batching:
+	Holds the events until sink_flush (the end of a frame) and hands
+	them to @target in one call
+
+	@target: sink receiving the batches, still owned by the caller
+	@capacity: events per batch
+	@return: status of initialization
+*/
+static inline bool sink_batching(OutputSink_t *sink, OutputSink_t *target, int capacity)
+{
+	memset(sink, 0, sizeof(*sink));
+	SinkBatch_t *b = (SinkBatch_t *)calloc(1, sizeof(SinkBatch_t));
+	if(!b)
+		return false;
+	b->target = target;
+	b->capacity = capacity > 0 ? capacity : 1;
+	b->batch = (SinkEvent_t *)malloc(sizeof(SinkEvent_t) * b->capacity);
+	if(!b->batch){
+		free(b);
+		return false;
+	}
+	sink->send = sink_batchingSend;
+	sink->flush = sink_batchingFlush;
+	sink->destroy = sink_batchingDestroy;
+	sink->state = b;
+	return true;
+}
+
+#if defined(_WIN32)
+/* Win32 sink: moves are absolute SendInput moves so a whole batch is a single call */
+
+static void sink_win32Send(OutputSink_t *sink, const SinkEvent_t *events, int n)
+{
+	static const DWORD flags[] = {MOUSEEVENTF_MOVE | MOUSEEVENTF_ABSOLUTE, MOUSEEVENTF_LEFTDOWN,
+								  MOUSEEVENTF_LEFTUP, MOUSEEVENTF_RIGHTDOWN, MOUSEEVENTF_RIGHTUP};
+	const int w = GetSystemMetrics(SM_CXSCREEN), h = GetSystemMetrics(SM_CYSCREEN);
+	INPUT inputs[SINK_CHUNK];
+
+	sink->events += n;
+	for(int first = 0; first < n; first += SINK_CHUNK){
+		const int m = n - first < SINK_CHUNK ? n - first : SINK_CHUNK;
+		ZeroMemory(inputs, sizeof(INPUT) * m);
+		for(int i = 0; i < m; i++){
+			const SinkEvent_t *e = &events[first + i];
+			inputs[i].type = INPUT_MOUSE;
+			inputs[i].mi.dwFlags = flags[e->action];
+			if(e->action == SINK_MOVE){ //normalized to 0..65535 across the primary screen
+				inputs[i].mi.dx = MulDiv(e->x < 0 ? 0 : e->x >= w ? w - 1 : e->x, 65535, w - 1);
+				inputs[i].mi.dy = MulDiv(e->y < 0 ? 0 : e->y >= h ? h - 1 : e->y, 65535, h - 1);
+			}
+		}
+		SendInput(m, inputs, sizeof(INPUT));
+		sink->injections++;
+	}
+}
+
+static inline void sink_win32(OutputSink_t *sink)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->send = sink_win32Send;
+}
+
+#elif defined(__linux__)
+/* uinput sink: a virtual absolute pointer, each event is its own report (SYN) */
+
+static void sink_uinputSend(OutputSink_t *sink, const SinkEvent_t *events, int n)
+{
+	const int fd = *(int *)sink->state;
+	struct input_event out[SINK_CHUNK * 3];
+
+	sink->events += n;
+	for(int first = 0; first < n; first += SINK_CHUNK){
+		const int m = n - first < SINK_CHUNK ? n - first : SINK_CHUNK;
+		int k = 0;
+		memset(out, 0, sizeof(out));
+		for(int i = 0; i < m; i++){
+			const SinkEvent_t *e = &events[first + i];
+			switch(e->action){
+				case SINK_MOVE:
+					out[k].type = EV_ABS; out[k].code = ABS_X; out[k++].value = e->x;
+					out[k].type = EV_ABS; out[k].code = ABS_Y; out[k++].value = e->y;
+				break;
+				case SINK_LEFT_DOWN:
+				case SINK_LEFT_UP:
+					out[k].type = EV_KEY; out[k].code = BTN_LEFT; out[k++].value = e->action == SINK_LEFT_DOWN;
+				break;
+				case SINK_RIGHT_DOWN:
+				case SINK_RIGHT_UP:
+					out[k].type = EV_KEY; out[k].code = BTN_RIGHT; out[k++].value = e->action == SINK_RIGHT_DOWN;
+				break;
+			}
+			out[k].type = EV_SYN; out[k].code = SYN_REPORT; out[k++].value = 0;
+		}
+		if(write(fd, out, sizeof(struct input_event) * k) < 0)
+			perror("uinput write()");
+		sink->injections++;
+	}
+}
+
+static void sink_uinputDestroy(OutputSink_t *sink)
+{
+	int *fd = (int *)sink->state;
+	ioctl(*fd, UI_DEV_DESTROY);
+	close(*fd);
+	free(fd);
+}
+
+/*
+sink_uinput:
+	Creates the virtual pointer, needs write access to /dev/uinput
+
+	@screenW, screenH: range of the absolute axes, i.e the screen in pixels
+	@return: status of initialization
+*/
+static inline bool sink_uinput(OutputSink_t *sink, int screenW, int screenH)
+{
+	memset(sink, 0, sizeof(*sink));
+	int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	if(fd < 0){
+		perror("/dev/uinput");
+		return false;
+	}
+	ioctl(fd, UI_SET_EVBIT, EV_SYN);
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+	ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+	ioctl(fd, UI_SET_EVBIT, EV_ABS);
+	ioctl(fd, UI_SET_ABSBIT, ABS_X);
+	ioctl(fd, UI_SET_ABSBIT, ABS_Y);
+
+	struct uinput_user_dev dev;
+	memset(&dev, 0, sizeof(dev));
+	snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "WMGestures pointer");
+	dev.id.bustype = BUS_VIRTUAL;
+	dev.absmax[ABS_X] = screenW - 1;
+	dev.absmax[ABS_Y] = screenH - 1;
+	if(write(fd, &dev, sizeof(dev)) != (ssize_t)sizeof(dev) || ioctl(fd, UI_DEV_CREATE) < 0){
+		perror("uinput device");
+		close(fd);
+		return false;
+	}
+
+	int *state = (int *)malloc(sizeof(int));
+	if(!state){
+		ioctl(fd, UI_DEV_DESTROY);
+		close(fd);
+		return false;
+	}
+	*state = fd;
+	sink->send = sink_uinputSend;
+	sink->destroy = sink_uinputDestroy;
+	sink->state = state;
+	return true;
+}
+#endif
+
+#endif
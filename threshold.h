@@ -0,0 +1,184 @@
+/* Adaptive Threshold
+   Replaces the fixed binarization levels (128 before the contours, 20 in
+   the blob analysis) with a level derived from each frame's intensities so
+   the IR illumination can change without breaking the blob counts.
+
+   threshold_apply binarizes a frame with the current level and builds the
+   256-bin histogram of the same frame in the same pass (SSE2, 16 pixels per
+   step, four interleaved histograms). The next level is then computed from
+   the histogram, Otsu or a percentile, which costs 256 iterations. The level
+   only moves when the new one differs by at least the hysteresis, so a
+   steady scene keeps a steady threshold.
+
+   Idris Soule
+*/
+
+#ifndef THRESHOLD_H
+#define THRESHOLD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <cv.h>
+#include <emmintrin.h>
+
+#define THRESHOLD_BANKS 4
+
+typedef enum {THRESHOLD_OTSU = 0, THRESHOLD_PERCENTILE} thresholdMode_t;
+
+typedef struct {
+	thresholdMode_t mode;
+	float fraction;      //THRESHOLD_PERCENTILE: brightest fraction of the pixels kept
+	int hysteresis;      //grey levels the new level must move by before it is taken
+	int minLevel, maxLevel;
+	int level;           //current threshold, pixels > level are foreground
+	bool primed;         //level comes from a previous frame
+	unsigned int hist[THRESHOLD_BANKS][256];
+}AdaptiveThreshold_t;
+
+/*
+threshold_initialize:
+	@mode: THRESHOLD_OTSU or THRESHOLD_PERCENTILE (of @fraction)
+	@hysteresis: i.e 8 grey levels
+	@minLevel, maxLevel: bounds of the level i.e [20, 235]
+*/
+static void threshold_initialize(AdaptiveThreshold_t *at, thresholdMode_t mode, float fraction, int hysteresis,
+								 int minLevel, int maxLevel)
+{
+	assert(minLevel >= 0 && maxLevel <= 254 && minLevel <= maxLevel);
+	memset(at, 0, sizeof(*at));
+	at->mode = mode;
+	at->fraction = fraction;
+	at->hysteresis = hysteresis;
+	at->minLevel = minLevel;
+	at->maxLevel = maxLevel;
+	at->level = (minLevel + maxLevel) / 2;
+}
+
+/* threshold_otsu: level maximizing the between-class variance */
+static int threshold_otsu(const unsigned int *hist)
+{
+	double total = 0, sum = 0;
+	for(int i = 0; i < 256; i++){
+		total += hist[i];
+		sum += (double)i * hist[i];
+	}
+	double w0 = 0, sum0 = 0, best = -1;
+	int level = 0;
+	for(int t = 0; t < 255; t++){
+		w0 += hist[t];
+		sum0 += (double)t * hist[t];
+		const double w1 = total - w0;
+		if(w0 == 0 || w1 == 0)
+			continue;
+		const double d = sum0 / w0 - (sum - sum0) / w1;
+		const double between = w0 * w1 * d * d;
+		if(between > best){
+			best = between;
+			level = t;
+		}
+	}
+	return level;
+}
+
+/* threshold_percentile: lowest level leaving at most @fraction of the pixels above it */
+static int threshold_percentile(const unsigned int *hist, float fraction)
+{
+	double total = 0;
+	for(int i = 0; i < 256; i++)
+		total += hist[i];
+	const double keep = fraction * total;
+	double above = 0;
+	for(int t = 255; t > 0; t--){
+		if(above + hist[t] > keep)
+			return t;
+		above += hist[t];
+	}
+	return 0;
+}
+
+/* threshold_histRow: histogram of a row into the banks, for the first frame */
+static void threshold_histRow(AdaptiveThreshold_t *at, const uchar *p, int n)
+{
+	int x = 0;
+	for(; x + THRESHOLD_BANKS <= n; x += THRESHOLD_BANKS){
+		at->hist[0][p[x]]++, at->hist[1][p[x + 1]]++;
+		at->hist[2][p[x + 2]]++, at->hist[3][p[x + 3]]++;
+	}
+	for(; x < n; x++)
+		at->hist[0][p[x]]++;
+}
+
+/* threshold_update: next level from the histogram of the frame just read */
+static void threshold_update(AdaptiveThreshold_t *at)
+{
+	unsigned int hist[256];
+	for(int i = 0; i < 256; i++)
+		hist[i] = at->hist[0][i] + at->hist[1][i] + at->hist[2][i] + at->hist[3][i];
+	memset(at->hist, 0, sizeof(at->hist));
+
+	int level = at->mode == THRESHOLD_OTSU ? threshold_otsu(hist) : threshold_percentile(hist, at->fraction);
+	if(level < at->minLevel) level = at->minLevel;
+	if(level > at->maxLevel) level = at->maxLevel;
+	if(!at->primed || abs(level - at->level) >= at->hysteresis)
+		at->level = level;
+	at->primed = true;
+}
+
+/*
+threshold_apply:
+	Binarizes a frame (255 where src > level, 0 elsewhere) and updates the level
+
+	The level used is the one derived from the previous frame, the very first
+	frame is read twice to derive its own.
+
+	@src, @dst: 8-bit single channel of the same size (may be the same image)
+	@return: the level used
+*/
+static int threshold_apply(AdaptiveThreshold_t *at, const IplImage *src, IplImage *dst)
+{
+	assert(src->nChannels == 1 && src->depth == IPL_DEPTH_8U && dst->nChannels == 1 &&
+		   src->width == dst->width && src->height == dst->height);
+
+	if(!at->primed){
+		for(int y = 0; y < src->height; y++)
+			threshold_histRow(at, (const uchar *)src->imageData + y * src->widthStep, src->width);
+		threshold_update(at);
+	}
+
+	const int level = at->level;
+	const __m128i bias = _mm_set1_epi8((char)0x80); //unsigned compare through the signed one
+	const __m128i lv = _mm_xor_si128(_mm_set1_epi8((char)level), bias);
+	CV_DECL_ALIGNED(16) uchar px[16];
+
+	for(int y = 0; y < src->height; y++){
+		const uchar *p = (const uchar *)src->imageData + y * src->widthStep;
+		uchar *q = (uchar *)dst->imageData + y * dst->widthStep;
+		int x = 0;
+		for(; x + 16 <= src->width; x += 16){
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+			_mm_store_si128((__m128i *)px, v);
+			_mm_storeu_si128((__m128i *)(q + x), _mm_cmpgt_epi8(_mm_xor_si128(v, bias), lv));
+			for(int k = 0; k < 16; k += THRESHOLD_BANKS){
+				at->hist[0][px[k]]++, at->hist[1][px[k + 1]]++;
+				at->hist[2][px[k + 2]]++, at->hist[3][px[k + 3]]++;
+			}
+		}
+		for(; x < src->width; x++){
+			at->hist[0][p[x]]++;
+			q[x] = p[x] > level ? 255 : 0;
+		}
+	}
+	threshold_update(at);
+	return level;
+}
+
+/* threshold_image: Otsu binarization of a single image (no history) */
+static int threshold_image(const IplImage *src, IplImage *dst)
+{
+	AdaptiveThreshold_t at;
+	threshold_initialize(&at, THRESHOLD_OTSU, 0, 0, 0, 254);
+	return threshold_apply(&at, src, dst);
+}
+
+#endif
@@ -0,0 +1,154 @@
+/* Timer Service
+   Cancellable one-shot timers kept in a binary min-heap ordered by deadline,
+   on whatever monotonic microsecond clock the owner passes in. There is no
+   thread behind it: the owner asks for the earliest deadline (to bound its
+   sleep) and calls timers_expire when it wakes, the due callbacks run right
+   there on the owner's thread.
+
+   A timer is named by the id timers_start returns, ids are not reused
+   before the 32-bit counter wraps (0 is never an id) so cancelling a timer that
+   already fired is harmless.
+   Cancellation searches the heap, meant for a handful of pending timers.
+
+   Idris Soule
+*/
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <stdlib.h>
+
+#define TIMERS_NONE (~0ULL) //no deadline pending
+
+typedef void (*timerCallback_t)(void *arg);
+
+typedef struct {
+	unsigned long long deadline;
+	unsigned id;
+	timerCallback_t callback;
+	void *arg;
+}TimerEntry_t;
+
+typedef struct {
+	TimerEntry_t *heap;
+	int count, capacity;
+	unsigned nextId;
+}TimerQueue_t;
+
+static bool timers_initialize(TimerQueue_t *tq, int capacity)
+{
+	tq->heap = (TimerEntry_t *)malloc(sizeof(TimerEntry_t) * capacity);
+	tq->count = 0;
+	tq->capacity = capacity;
+	tq->nextId = 1;
+	return tq->heap != NULL;
+}
+
+/* timers_siftUp, timers_siftDown: restore the heap order around entry i */
+static void timers_siftUp(TimerQueue_t *tq, int i)
+{
+	TimerEntry_t e = tq->heap[i];
+	while(i > 0){
+		const int parent = (i - 1) / 2;
+		if(tq->heap[parent].deadline <= e.deadline)
+			break;
+		tq->heap[i] = tq->heap[parent];
+		i = parent;
+	}
+	tq->heap[i] = e;
+}
+
+static void timers_siftDown(TimerQueue_t *tq, int i)
+{
+	TimerEntry_t e = tq->heap[i];
+	for(;;){
+		int child = 2 * i + 1;
+		if(child >= tq->count)
+			break;
+		if(child + 1 < tq->count && tq->heap[child + 1].deadline < tq->heap[child].deadline)
+			child++;
+		if(e.deadline <= tq->heap[child].deadline)
+			break;
+		tq->heap[i] = tq->heap[child];
+		i = child;
+	}
+	tq->heap[i] = e;
+}
+
+/* timers_removeAt: takes entry i out of the heap */
+static void timers_removeAt(TimerQueue_t *tq, int i)
+{
+	tq->heap[i] = tq->heap[--tq->count];
+	if(i < tq->count){
+		timers_siftDown(tq, i);
+		timers_siftUp(tq, i);
+	}
+}
+
+/*
+timers_start:
+	Arms a one-shot timer
+
+	@deadline: clock time at which @callback(@arg) runs
+	@return: id of the timer, 0 if the queue is full
+*/
+static unsigned timers_start(TimerQueue_t *tq, unsigned long long deadline, timerCallback_t callback, void *arg)
+{
+	if(tq->count == tq->capacity)
+		return 0;
+	TimerEntry_t *e = &tq->heap[tq->count];
+	const unsigned id = tq->nextId++;
+	if(!tq->nextId) //wrapped, skip 0
+		tq->nextId = 1;
+	e->deadline = deadline;
+	e->id = id;
+	e->callback = callback;
+	e->arg = arg;
+	timers_siftUp(tq, tq->count++);
+	return id;
+}
+
+/* timers_cancel: @return: false if the timer already fired (or was cancelled) */
+static bool timers_cancel(TimerQueue_t *tq, unsigned id)
+{
+	for(int i = 0; i < tq->count; i++)
+		if(tq->heap[i].id == id){
+			timers_removeAt(tq, i);
+			return true;
+		}
+	return false;
+}
+
+/* timers_next: earliest pending deadline, TIMERS_NONE if there is none */
+static inline unsigned long long timers_next(const TimerQueue_t *tq)
+{
+	return tq->count ? tq->heap[0].deadline : TIMERS_NONE;
+}
+
+/*
+timers_expire:
+	Runs the callbacks of every timer due at @now, earliest first.
+	A callback may start or cancel timers.
+
+	@return: number of timers fired
+*/
+static int timers_expire(TimerQueue_t *tq, unsigned long long now)
+{
+	int fired = 0;
+	while(tq->count && tq->heap[0].deadline <= now){
+		const TimerEntry_t e = tq->heap[0];
+		timers_removeAt(tq, 0);
+		e.callback(e.arg);
+		fired++;
+	}
+	return fired;
+}
+
+static void timers_destroy(TimerQueue_t *tq)
+{
+	free(tq->heap);
+	tq->heap = NULL;
+	tq->count = 0;
+}
+
+#endif